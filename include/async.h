@@ -4,20 +4,147 @@
 #include <stdlib.h>
 #include <stdint.h>
 
-#define NUM_REACTORS 3
+// Upper bound on the number of reactors the file system can run on
+#define MAX_REACTORS 64
+
+/*
+ * Reactor 0 is the main reactor, which runs the REPL. It is followed by the
+ * metadata reactors and then by the data reactors. How many of each are used
+ * is chosen at startup, before the device is initialized.
+ */
+struct reactor_layout {
+  uint32_t num_metadata;
+  uint32_t num_data;
+};
+
+extern struct reactor_layout reactor_layout;
 
 #define MAIN_REACTOR 0
+// The first metadata and data reactors
 #define METADATA_REACTOR 1
-#define DATA_REACTOR 2
+#define DATA_REACTOR (METADATA_REACTOR + reactor_layout.num_metadata)
+#define NUM_REACTORS (DATA_REACTOR + reactor_layout.num_data)
+
+struct future;
+
+/**
+ * A continuation run once every operation counted by a future has completed.
+ * The future's status holds the first error reported, or 0.
+ */
+typedef void (*future_cb)(struct future *f, void *arg);
+
+// Runs a continuation on whichever reactor completes the last operation
+#define FUTURE_ANY_LCORE UINT32_MAX
 
 struct future {
-  // NOTE: counts[i] should only be modified by reactor i's thread
-  volatile size_t counts[NUM_REACTORS];
-  size_t expected_counts[NUM_REACTORS];
+  // NOTE: Holds the number of outstanding operations plus one. The extra count
+  //       is dropped by future_then(), so a continuation cannot run before it
+  //       has been registered.
+  volatile size_t pending;
+  // NOTE: The first failing operation sets this to a negative errno value
+  volatile int status;
+
+  future_cb then_fn;
+  void *then_arg;
+  uint32_t then_lcore;
 };
 
+// Largest number of requests that can be posted to a reactor in one event
+#define MAX_SUBMIT_BATCH_SIZE 64
+#define DEFAULT_SUBMIT_BATCH_SIZE 32
+
+/**
+ * Sets up the shared state used for batched submission. Must be called after
+ * the SPDK environment has been initialized.
+ */
+int async_init(void);
+
 void send_request(uint32_t lcore, void (*fn)(void *), void *arg);
-void spin_wait(struct future *f);
+
+/**
+ * Queues fn(arg) to run on the given lcore.
+ *
+ * Requests are accumulated into a per-target batch owned by the calling thread
+ * and posted as a single event once the batch is full. Batches that are not
+ * full are posted by flush_requests(), which spin_wait() calls before waiting.
+ */
+void send_request_batched(uint32_t lcore, void (*fn)(void *), void *arg);
+
+/**
+ * Posts all batches opened by the calling thread.
+ */
+void flush_requests(void);
+
+/**
+ * Sets the number of requests per batch. A size of 1 posts one event per
+ * request.
+ */
+void set_submit_batch_size(size_t size);
+size_t get_submit_batch_size(void);
+
 void future_init(struct future *f);
 
+/**
+ * Counts one more outstanding operation against the future. Must be called by
+ * the submitter before the operation is handed to another reactor.
+ */
+void future_expect(struct future *f);
+
+/**
+ * Marks one operation counted by the future as complete. A negative status is
+ * recorded if no earlier operation failed. Completing the last operation of a
+ * future with a continuation schedules the continuation.
+ *
+ * NOTE: The future may be released as soon as this function is called, so the
+ *       caller must not touch it afterwards.
+ */
+void future_complete(struct future *f, int status);
+
+/**
+ * Registers a continuation to run on the given lcore once all operations
+ * counted so far have completed. No further operations may be counted against
+ * the future, and it must not be passed to spin_wait() afterwards. The future
+ * must stay valid until the continuation runs; the continuation may release
+ * it.
+ *
+ * NOTE: The main reactor does not process events while the REPL is running, so
+ *       continuations should target the metadata or data reactors.
+ */
+void future_then(struct future *f, uint32_t lcore, future_cb fn, void *arg);
+
+/**
+ * Makes the initialized future out complete once all num_futures futures in
+ * ins have completed. out takes the first error among them. The input futures
+ * are given continuations and follow the same rules as with future_then().
+ */
+void future_when_all(
+  struct future *out, struct future *ins[], size_t num_futures);
+
+enum wait_mode {
+  // Poll the future in a tight loop
+  WAIT_MODE_SPIN,
+  // Poll with an exponentially growing number of pause instructions, then
+  // yield the core to other threads between polls
+  WAIT_MODE_BACKOFF,
+};
+
+/**
+ * Waits for all operations counted by the future to complete and returns its
+ * status. The time spent waiting is accounted to the given call site.
+ *
+ * NOTE: The main reactor runs the REPL inside a single event, so its own event
+ *       queue is not drained while it waits.
+ */
+int spin_wait_at(struct future *f, const char *site);
+#define spin_wait(f) spin_wait_at((f), __func__)
+
+void set_wait_mode(enum wait_mode mode);
+enum wait_mode get_wait_mode(void);
+
+/**
+ * Prints the number of waits and the time spent waiting per call site.
+ */
+void print_wait_stats(void);
+void reset_wait_stats(void);
+
 #endif
@@ -3,6 +3,7 @@
 
 #include <sys/time.h>
 
+#include "block.h"
 #include "super.h"
 #include "testfs.h"
 
@@ -17,6 +18,8 @@
 struct bench_result {
   long long max_us, min_us;
   double avg_us;
+  // Device commands per trial, 0 if the benchmark does not count them
+  double avg_commands;
 };
 
 struct bench_digest {
@@ -25,11 +28,35 @@ struct bench_digest {
   struct bench_result async;
 };
 
+struct bitmap_bench_digest {
+  int trials;
+  struct bench_result fill;
+  struct bench_result count;
+  struct bench_result equal;
+  struct bench_result alloc_range;
+  struct bench_result rebuild;
+};
+
+struct dir_bench_digest {
+  int trials;
+  // Files created per trial, the fewest over all trials
+  int linear_files;
+  int indexed_files;
+  struct bench_result linear_create;
+  struct bench_result indexed_create;
+  struct bench_result linear_lookup;
+  struct bench_result indexed_lookup;
+};
+
 // REPL commands
 int cmd_benchmark(struct super_block *sb, struct context *c);
 int subcmd_benchmark_e2e_write(struct filesystem *fs, struct context *c);
 int subcmd_benchmark_raw_seq_read(struct filesystem *fs, struct context *c);
 int subcmd_benchmark_raw_seq_write(struct filesystem *fs, struct context *c);
+int subcmd_benchmark_submit_batch(struct filesystem *fs, struct context *c);
+int subcmd_benchmark_sync_route(struct filesystem *fs, struct context *c);
+int subcmd_benchmark_bitmap(struct filesystem *fs, struct context *c);
+int subcmd_benchmark_dir_create(struct filesystem *fs, struct context *c);
 int cmd_experiment(struct super_block *sb, struct context *c);
 
 // Raw sequential read/write microbenchmarks
@@ -46,6 +73,40 @@ void benchmark_raw_seq_write(
   int num_blocks
 );
 
+// Per-request vs batched cross-reactor submission microbenchmark
+void benchmark_submit_batch(
+  struct filesystem *fs,
+  struct bench_digest *digest,
+  int num_trials,
+  int num_blocks,
+  size_t batch_size
+);
+
+// Synchronous read latency per routing policy microbenchmark
+void benchmark_sync_route(
+  struct filesystem *fs,
+  struct bench_digest *digest,
+  int num_trials,
+  int num_blocks,
+  enum sync_route route
+);
+
+// Bitmap allocator microbenchmark, CPU only
+int benchmark_bitmap(
+  struct bitmap_bench_digest *digest,
+  int num_trials,
+  u_int32_t nbits
+);
+
+// Create rate in one directory, linear vs. indexed
+void benchmark_dir_create_rate(
+  struct filesystem *fs,
+  struct context *c,
+  struct dir_bench_digest *digest,
+  int num_trials,
+  int num_files
+);
+
 // End-to-end write path microbenchmark
 void benchmark_e2e_write(
   struct filesystem *fs,
@@ -89,6 +150,24 @@ void experiment_raw_seq_write(
   int num_blocks_end,
   int num_trials
 );
+void experiment_submit_batch(
+  struct filesystem *fs,
+  FILE *output,
+  int num_blocks,
+  int num_trials
+);
+void experiment_sync_route(
+  struct filesystem *fs,
+  FILE *output,
+  int num_blocks,
+  int num_trials
+);
+void experiment_data_reactor_scaling(
+  struct filesystem *fs,
+  FILE *output,
+  int num_blocks,
+  int num_trials
+);
 
 // Benchmark utilities
 void populate_digest(
@@ -97,6 +176,12 @@ void populate_digest(
   long long results_async_us[],
   int num_trials
 );
+void populate_result(
+  struct bench_result *result,
+  long long results_us[],
+  int num_trials
+);
+void print_result(char *name, struct bench_result *result);
 void print_digest(char *benchmark_name, struct bench_digest *digest);
 void print_digest_csv(FILE *file, struct bench_digest *digest);
 void print_digest_header_csv(FILE *file);
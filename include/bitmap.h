@@ -8,11 +8,34 @@
  *     bitmap_create  - allocate a new bitmap object.
  *                      Returns NULL on error.
  *     bitmap_getdata - return pointer to raw bit data (for I/O).
- *     bitmap_alloc   - locate a cleared bit, set it, and return its index.
+ *     bitmap_alloc   - locate the lowest cleared bit, set it, and return its
+ *                      index.
+ *     bitmap_alloc_near
+ *                    - locate the first cleared bit at or after a goal
+ *                      index, set it, and return its index.
+ *     bitmap_alloc_range
+ *                    - locate a run of cleared bits at or after a goal
+ *                      index, set them, and return the index of the first
+ *                      one and the run length.
  *     bitmap_mark    - set a clear bit by its index.
  *     bitmap_unmark  - clear a set bit by its index.
  *     bitmap_isset   - return whether a particular bit is set or not.
  *     bitmap_destroy - destroy bitmap.
+ *     bitmap_rebuild - recompute the free count and search summary after
+ *                      the raw bit data was changed directly (e.g. read
+ *                      from disk through bitmap_getdata).
+ *     bitmap_equal   - return whether two bitmaps have the same bits set.
+ *     bitmap_nr_allocated
+ *                    - return the number of set bits.
+ *     bitmap_nr_free - return the number of clear bits.
+ *     bitmap_free_extents
+ *                    - return the number of runs of clear bits below a
+ *                      limit and the length of the longest one.
+ *
+ * The raw bit data is a byte array, so it is the same on disk on any host.
+ * Searches scan it 64 bits at a time and skip full regions using a summary
+ * level, and the number of free bits is cached, so allocating, counting and
+ * comparing do not touch every bit.
  */
 
 #include <limits.h>
@@ -27,11 +50,34 @@ struct bitmap; /* Opaque. */
 int bitmap_create(u_int32_t nbits, struct bitmap **bp);
 void *bitmap_getdata(struct bitmap *);
 int bitmap_alloc(struct bitmap *, u_int32_t *index);
+
+/**
+ * Allocates the first free bit at or after goal, wrapping around to the
+ * lowest free bit if there is none.
+ *
+ * Returns -ENOSPC if no bit is free.
+ */
+int bitmap_alloc_near(struct bitmap *, u_int32_t goal, u_int32_t *index);
+
+/**
+ * Allocates up to want consecutive bits. The search starts at goal and wraps
+ * around once. The first run of want free bits is taken; if there is none, the
+ * longest run found is taken instead. Stores the index of the first bit in
+ * start and the number of bits allocated (1 to want) in got.
+ *
+ * Returns -ENOSPC if no bit is free.
+ */
+int bitmap_alloc_range(struct bitmap *, u_int32_t goal, u_int32_t want,
+                       u_int32_t *start, u_int32_t *got);
 void bitmap_mark(struct bitmap *, u_int32_t index);
 void bitmap_unmark(struct bitmap *, u_int32_t index);
 int bitmap_isset(struct bitmap *, u_int32_t index);
 void bitmap_destroy(struct bitmap *);
+void bitmap_rebuild(struct bitmap *);
 int bitmap_equal(struct bitmap *, struct bitmap *);
 int bitmap_nr_allocated(struct bitmap *);
+int bitmap_nr_free(struct bitmap *);
+u_int32_t bitmap_free_extents(struct bitmap *, u_int32_t limit,
+                              u_int32_t *largest);
 
 #endif /* _BITMAP_H_ */
@@ -2,10 +2,16 @@
 #define _BLOCK_H
 
 #include <stdbool.h>
+#include <sys/uio.h>
 #include "device.h"
 #include "async.h"
+#include "cache.h"
 
-void write_blocks(struct super_block *sb, char *blocks, int start, int nr);
+/**
+ * Synchronous block I/O. Returns 0 on success or a negative errno value; errors
+ * are also recorded against the current transaction.
+ */
+int write_blocks(struct super_block *sb, char *blocks, int start, int nr);
 void write_blocks_async(
   struct super_block *sb,
   uint32_t reactor_id,
@@ -15,7 +21,7 @@ void write_blocks_async(
   int nr
 );
 
-void read_blocks(struct super_block *sb, char *blocks, int start, int nr);
+int read_blocks(struct super_block *sb, char *blocks, int start, int nr);
 void read_blocks_async(
   struct super_block *sb,
   uint32_t reactor_id,
@@ -25,6 +31,275 @@ void read_blocks_async(
   int nr
 );
 
+// Maximum number of iovec entries accepted by the vectored functions below.
+// Callers with more segments must split the I/O.
+#define BLOCK_MAX_IOVS 32
+
+/**
+ * Vectored variants of read_blocks_async() and write_blocks_async().
+ *
+ * The nr blocks starting at start are transferred to/from the memory described
+ * by iov as a single device command. The iovec lengths must add up to
+ * nr * BLOCK_SIZE. The iov array itself only needs to stay valid until the
+ * function returns.
+ *
+ * NOTE: These are not zero-copy. The segments are gathered into (writes) or
+ *       scattered from (reads) one pooled DMA bounce buffer, which saves the
+ *       per-segment commands but not the copy. Use readv_blocks_async_dma()/
+ *       writev_blocks_async_dma() to avoid staging copies.
+ */
+void readv_blocks_async(
+  struct super_block *sb,
+  uint32_t reactor_id,
+  struct future *f,
+  const struct iovec *iov,
+  int iovcnt,
+  int start,
+  int nr
+);
+void writev_blocks_async(
+  struct super_block *sb,
+  uint32_t reactor_id,
+  struct future *f,
+  const struct iovec *iov,
+  int iovcnt,
+  int start,
+  int nr
+);
+
+/**
+ * Returns a DMA-capable buffer for nr blocks, taken from the given reactor's
+ * buffer pool. The contents of the buffer are undefined.
+ *
+ * Buffers obtained from this function can be passed to the *_dma() variants
+ * below, which submit the buffer to the device directly instead of copying
+ * through a bounce buffer. Returns NULL if no memory is available.
+ */
+char *alloc_dma_blocks(struct super_block *sb, uint32_t reactor_id, int nr);
+
+/**
+ * Returns a buffer obtained from alloc_dma_blocks() to its pool.
+ */
+void free_dma_blocks(char *dma_blocks);
+
+/**
+ * Zero-copy variants of write_blocks_async() and read_blocks_async().
+ *
+ * The caller keeps ownership of dma_blocks and must not modify (for writes) or
+ * read (for reads) the buffer until the future completes.
+ */
+void write_blocks_async_dma(
+  struct super_block *sb,
+  uint32_t reactor_id,
+  struct future *f,
+  char *dma_blocks,
+  int start,
+  int nr
+);
+void read_blocks_async_dma(
+  struct super_block *sb,
+  uint32_t reactor_id,
+  struct future *f,
+  char *dma_blocks,
+  int start,
+  int nr
+);
+
+/**
+ * Zero-copy vectored variants. Every segment in dma_iov must point into a
+ * buffer obtained from alloc_dma_blocks(); the segments are handed to
+ * spdk_bdev_readv_blocks()/spdk_bdev_writev_blocks() as-is.
+ */
+void readv_blocks_async_dma(
+  struct super_block *sb,
+  uint32_t reactor_id,
+  struct future *f,
+  const struct iovec *dma_iov,
+  int iovcnt,
+  int start,
+  int nr
+);
+void writev_blocks_async_dma(
+  struct super_block *sb,
+  uint32_t reactor_id,
+  struct future *f,
+  const struct iovec *dma_iov,
+  int iovcnt,
+  int start,
+  int nr
+);
+
+/**
+ * Reads nr blocks starting at start into the block cache only. Used to read
+ * ahead of a sequential reader, who then finds the blocks in the cache once the
+ * future completes.
+ */
+void readahead_blocks_async(
+  struct super_block *sb,
+  uint32_t reactor_id,
+  struct future *f,
+  int start,
+  int nr
+);
+
 void zero_blocks(struct super_block *sb, int start, int nr);
 
+/**
+ * Creates and destroys the fixed-capacity pool of request objects used for
+ * I/O submitted to the given reactor.
+ */
+int block_request_pool_init(
+    struct reactor_context *reactor, uint32_t reactor_id);
+void block_request_pool_destroy(struct reactor_context *reactor);
+
+// Where read_blocks() and write_blocks() send their requests
+enum sync_route {
+  // Always use the data reactor
+  SYNC_ROUTE_DATA,
+  // Use the metadata reactor the block is striped to
+  SYNC_ROUTE_METADATA,
+  // Use the non-main reactor with the fewest outstanding requests
+  SYNC_ROUTE_LEAST_OUTSTANDING,
+  NUM_SYNC_ROUTES,
+};
+
+void block_set_sync_route(enum sync_route route);
+enum sync_route block_get_sync_route(void);
+
+/**
+ * Converts between routing policies and their names ("data", "metadata" and
+ * "least"). Returns -EINVAL for an unknown name.
+ */
+int block_parse_sync_route(const char *name, enum sync_route *route);
+const char *block_sync_route_name(enum sync_route route);
+
+// How file data I/O is spread across the data reactors
+enum data_dispatch {
+  // Cycle through the data reactors
+  DATA_DISPATCH_ROUND_ROBIN,
+  // Assign fixed stripes of DATA_DISPATCH_STRIPE_BLOCKS blocks to each data
+  // reactor, so contiguous blocks can still be merged and requests for the
+  // same block are always ordered
+  DATA_DISPATCH_LBA_HASH,
+  // Use the data reactor with the fewest outstanding requests
+  DATA_DISPATCH_LEAST_OUTSTANDING,
+  NUM_DATA_DISPATCHES,
+};
+
+#define DATA_DISPATCH_STRIPE_BLOCKS 8
+
+/**
+ * Returns the data reactor that I/O for the given block should be sent to.
+ *
+ * NOTE: With the round-robin and least-outstanding policies, two outstanding
+ *       writes to the same block may reach the device in any order.
+ */
+uint32_t block_data_reactor(struct super_block *sb, int block_nr);
+
+void block_set_data_dispatch(enum data_dispatch dispatch);
+enum data_dispatch block_get_data_dispatch(void);
+
+#define METADATA_STRIPE_BLOCKS 8
+
+/**
+ * Returns the metadata reactor that I/O for the given block should be sent to.
+ * Metadata blocks are assigned to the metadata reactors in fixed stripes of
+ * METADATA_STRIPE_BLOCKS blocks, so requests for the same block are always
+ * ordered.
+ */
+uint32_t block_metadata_reactor(int block_nr);
+
+/**
+ * Converts between dispatch policies and their names ("rr", "hash" and
+ * "least"). Returns -EINVAL for an unknown name.
+ */
+int block_parse_data_dispatch(const char *name, enum data_dispatch *dispatch);
+const char *block_data_dispatch_name(enum data_dispatch dispatch);
+
+/**
+ * Limits data dispatch to the first num_data data reactors. 0 uses all of
+ * them.
+ */
+void block_set_active_data_reactors(uint32_t num_data);
+uint32_t block_get_active_data_reactors(void);
+
+// Maximum number of dirty blocks written back per round
+#define CACHE_WRITEBACK_BATCH 256
+
+#define BLOCK_DEFAULT_DIRTY_BACKGROUND_PERCENT 10
+#define BLOCK_DEFAULT_DIRTY_LIMIT_PERCENT 50
+#define BLOCK_DEFAULT_FLUSH_INTERVAL_MS 1000
+
+/*
+ * When dirty blocks of a write-back cache are written to the device. Percents
+ * are of the cache capacity.
+ */
+struct dirty_limits {
+  // The background flusher starts a pass above this many dirty blocks
+  unsigned int background_percent;
+  // Writers write back the dirty blocks themselves above this many
+  unsigned int limit_percent;
+  // The background flusher starts a pass at least this often while blocks are
+  // dirty. 0 disables the timer.
+  unsigned int interval_ms;
+  // testfs_tx_commit() writes back all dirty blocks before returning
+  bool sync_on_commit;
+};
+
+void block_set_dirty_limits(const struct dirty_limits *limits);
+void block_get_dirty_limits(struct dirty_limits *limits);
+
+/**
+ * Starts and stops the background flusher, which runs on the first metadata
+ * reactor and writes back dirty blocks in LBA order through all of them. Must
+ * not be called on a metadata reactor. Stopping a stopped flusher does
+ * nothing.
+ */
+void block_flusher_start(struct filesystem *fs);
+void block_flusher_stop(struct filesystem *fs);
+
+/**
+ * Writes all blocks that are dirty in the block cache to the device in LBA
+ * order and waits for them. Returns the first error encountered, or 0.
+ * block_cache_sync() also records the error in the superblock's transaction
+ * status.
+ *
+ * NOTE: Must not be called on a metadata reactor.
+ */
+int block_cache_writeback_all(struct filesystem *fs);
+int block_cache_sync(struct super_block *sb);
+
+/**
+ * Changes the block cache mode, writing back dirty blocks first unless the new
+ * mode is write-back. The mode is left unchanged if the write-back fails.
+ */
+int block_cache_set_mode(struct super_block *sb, enum cache_mode mode);
+
+/**
+ * Prints the block cache mode, occupancy and hit/miss/eviction counters.
+ */
+void block_print_cache_stats(struct filesystem *fs);
+
+// Default number of requests a reactor may have outstanding before submitters
+// are made to wait
+#define BLOCK_DEFAULT_MAX_OUTSTANDING 1024
+
+/**
+ * Sets the number of requests that may be outstanding on each reactor. A
+ * submitter that would exceed it waits until earlier requests complete.
+ */
+void block_set_max_outstanding(size_t max);
+size_t block_get_max_outstanding(void);
+
+/**
+ * Returns the number of device commands issued so far by all reactors.
+ */
+uint64_t block_get_nr_commands(struct filesystem *fs);
+
+/**
+ * Prints request and DMA buffer pool occupancy and scheduler statistics for
+ * each reactor.
+ */
+void block_print_stats(struct filesystem *fs);
+
 #endif /* _BLOCK_H */
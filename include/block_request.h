@@ -0,0 +1,63 @@
+#ifndef __BLOCK_REQUEST_H__
+#define __BLOCK_REQUEST_H__
+
+#include <stdbool.h>
+#include <sys/queue.h>
+#include <sys/uio.h>
+#include "block.h"
+
+// NOTE: This header is internal to the block layer. It is shared between the
+//       request lifecycle code (block.c) and the per-reactor I/O scheduler
+//       (io_sched.c).
+
+struct rw_request {
+  // The per-reactor pool this request is returned to on completion
+  struct spdk_mempool *pool;
+  struct reactor_context *reactor;
+  struct spdk_bdev_desc *bdev_desc;
+  struct spdk_io_channel *io_channel;
+  struct io_sched *sched;
+
+  bool is_write;
+  // Contiguous DMA buffer for the I/O. NULL if the device reads from or
+  // writes to the caller's DMA vector in iov directly.
+  char *buf;
+  size_t start;
+  size_t nr;
+  // NOTE: Buffers passed in through the *_dma() functions belong to the caller
+  //       and are not returned to the pool on completion
+  bool owns_buf;
+
+  // For contiguous reads through a bounce buffer, the caller's destination
+  char *destination;
+  // For vectored reads through a bounce buffer, the caller's destination
+  // vector. For the vectored *_dma() functions, the caller's DMA vector.
+  struct iovec iov[BLOCK_MAX_IOVS];
+  int iovcnt;
+
+  uint32_t reactor_id;
+  struct future *f;
+
+  // For reads, the cache that is updated with the data read. NULL if the
+  // cache is not involved.
+  struct block_cache *cache;
+  uint64_t cache_epoch;
+  // Issued by read-ahead; the data only goes into the cache
+  bool readahead;
+
+  // Links the request into its scheduler's queue, and the requests that were
+  // merged into one device command together
+  TAILQ_ENTRY(rw_request) sched_link;
+  struct rw_request *merged_next;
+};
+
+/**
+ * Finishes a request once the device has completed it: copies read data out
+ * to the caller, releases the bounce buffer, signals the future and returns
+ * the request to its pool.
+ *
+ * Must be called on the reactor the request was submitted to.
+ */
+void block_request_complete(struct rw_request *req, bool success);
+
+#endif
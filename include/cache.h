@@ -0,0 +1,189 @@
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/*
+ * Fixed-size cache of device blocks keyed by physical block number. The block
+ * layer consults it underneath read_blocks()/write_blocks() and their
+ * asynchronous variants; the cache itself never performs I/O.
+ *
+ * Modes:
+ *     CACHE_MODE_OFF           - the cache is bypassed and kept empty.
+ *     CACHE_MODE_WRITE_THROUGH - writes update the cache and go to the device.
+ *     CACHE_MODE_WRITE_BACK    - writes are absorbed by the cache and the
+ *                                blocks are marked dirty until written back.
+ *
+ * Eviction is least-recently-used among clean blocks. Dirty blocks and blocks
+ * that are being written back are never evicted; a write-back write that finds
+ * no block to evict is not absorbed and goes to the device instead.
+ *
+ * NOTE: All functions may be called from any reactor. A spinlock protects the
+ *       cache, and it is never held across I/O.
+ */
+
+#define CACHE_DEFAULT_NR_BLOCKS 1024
+
+enum cache_mode {
+  CACHE_MODE_OFF,
+  CACHE_MODE_WRITE_THROUGH,
+  CACHE_MODE_WRITE_BACK,
+  NUM_CACHE_MODES,
+};
+
+struct block_cache; /* Opaque. */
+
+struct cache_stats {
+  // Counted in blocks
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  uint64_t absorbed_writes;
+  uint64_t writebacks;
+  // Blocks read ahead that were later read, and that were evicted unread
+  uint64_t readahead_hits;
+  uint64_t readahead_waste;
+
+  size_t nr_cached;
+  size_t nr_dirty;
+  size_t capacity;
+};
+
+/**
+ * Creates an empty write-through cache that can hold nr_blocks blocks.
+ *
+ * Returns NULL on error.
+ */
+struct block_cache *cache_create(size_t nr_blocks);
+void cache_destroy(struct block_cache *cache);
+
+/**
+ * Changes the mode of the cache. Switching to CACHE_MODE_OFF drops all cached
+ * blocks. The cache must not hold dirty blocks unless the new mode is
+ * CACHE_MODE_WRITE_BACK.
+ */
+void cache_set_mode(struct block_cache *cache, enum cache_mode mode);
+enum cache_mode cache_get_mode(struct block_cache *cache);
+
+/**
+ * Copies nr blocks starting at start into the memory described by iov if all
+ * of them are cached. Returns whether the read was served from the cache.
+ */
+bool cache_read(
+  struct block_cache *cache,
+  const struct iovec *iov,
+  int iovcnt,
+  size_t start,
+  size_t nr
+);
+
+/**
+ * Returns whether the block is cached. Does not count as a hit or a miss.
+ */
+bool cache_contains(struct block_cache *cache, size_t block_nr);
+
+/**
+ * Returns a token that is passed to cache_fill() for blocks read from the
+ * device. Must be taken before the read is submitted.
+ */
+uint64_t cache_get_epoch(struct block_cache *cache);
+
+/**
+ * Inserts blocks read from the device that are not cached yet. Nothing is
+ * inserted if any block was written since the epoch was taken, as the data
+ * read may be stale. Blocks inserted by read-ahead are tracked until they are
+ * either read or evicted.
+ */
+void cache_fill(
+  struct block_cache *cache,
+  const char *buf,
+  size_t start,
+  size_t nr,
+  uint64_t epoch,
+  bool readahead
+);
+
+/**
+ * Copies the cached versions of any of the given blocks over the data that was
+ * read from the device, so that reads observe writes still held in the cache.
+ */
+void cache_overlay(
+  struct block_cache *cache,
+  const struct iovec *iov,
+  int iovcnt,
+  size_t start,
+  size_t nr
+);
+
+/**
+ * Records a write of nr blocks starting at start.
+ *
+ * Returns true if the write was absorbed (write-back mode), in which case it
+ * must not be sent to the device. Otherwise the cached copies have been
+ * updated and the caller writes the blocks to the device.
+ */
+bool cache_write(
+  struct block_cache *cache,
+  const struct iovec *iov,
+  int iovcnt,
+  size_t start,
+  size_t nr
+);
+
+/**
+ * Starts writing back dirty blocks. Stores the numbers of up to max dirty
+ * blocks with a block number of at least min_block_nr in block_nrs, in
+ * ascending order, and marks them clean. The blocks stay in the cache until
+ * cache_end_writeback() is called for them. Blocks that are already being
+ * written back are skipped.
+ *
+ * Returns the number of blocks stored.
+ */
+size_t cache_start_writeback(
+  struct block_cache *cache,
+  size_t min_block_nr,
+  size_t block_nrs[],
+  size_t max
+);
+
+/**
+ * Copies the cached contents of blocks that are being written back into buf.
+ */
+void cache_copy_out(
+    struct block_cache *cache, char *buf, size_t start, size_t nr);
+
+/**
+ * Returns whether any of nr blocks starting at start is being written back.
+ * A write sent to the device must wait until none is, or it may be overtaken
+ * by an older copy of the blocks.
+ */
+bool cache_writeback_pending(
+    struct block_cache *cache, size_t start, size_t nr);
+
+/**
+ * Finishes writing back the given blocks. If the write failed they are marked
+ * dirty again.
+ */
+void cache_end_writeback(
+  struct block_cache *cache,
+  const size_t block_nrs[],
+  size_t nr,
+  bool success
+);
+
+size_t cache_nr_dirty(struct block_cache *cache);
+
+void cache_get_stats(struct block_cache *cache, struct cache_stats *stats);
+void cache_reset_stats(struct block_cache *cache);
+
+/**
+ * Converts between cache modes and their names ("off", "wt" and "wb").
+ * Returns -EINVAL for an unknown name.
+ */
+int cache_parse_mode(const char *name, enum cache_mode *mode);
+const char *cache_mode_name(enum cache_mode mode);
+
+#endif
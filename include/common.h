@@ -21,6 +21,7 @@
   } while (0)
 
 #define MAX(a, b) ((a) >= (b) ? (a) : (b))
+#define MIN(a, b) ((a) <= (b) ? (a) : (b))
 
 #define DIVROUNDUP(a, b) (((a) + (b)-1) / (b))
 #define ROUNDUP(a, b) (DIVROUNDUP(a, b) * b)
@@ -0,0 +1,74 @@
+#ifndef _DCACHE_H
+#define _DCACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "super.h"
+
+/*
+ * Cache of directory entries, keyed by the inode number of the directory and
+ * the name. A negative entry records that the directory has no entry of that
+ * name, so that repeated misses do not read the directory either.
+ *
+ * Name lookups in dir.c consult the cache before reading the directory.
+ * Adding or removing a name updates its entry, and removing a directory drops
+ * all of its entries. Each superblock has its own cache of up to
+ * DCACHE_NR_ENTRIES entries, which evicts the least recently used entry when
+ * it is full. Names of DCACHE_NAME_LEN characters or more are not cached.
+ */
+
+#define DCACHE_NR_ENTRIES 1024
+#define DCACHE_NAME_LEN 32
+
+struct dcache_stats {
+  uint64_t hits;
+  uint64_t negative_hits;
+  uint64_t misses;
+  uint64_t evictions;
+
+  // Entries cached, and those of them that are negative
+  size_t nr_cached;
+  size_t nr_negative;
+};
+
+/**
+ * Sets up and tears down the dentry cache of a superblock.
+ */
+void dcache_init(struct super_block *sb);
+void dcache_destroy(struct super_block *sb);
+
+/**
+ * Looks name up in the directory with inode number dir_nr. Returns whether
+ * the cache knows the answer, in which case the inode number of the entry, or
+ * -ENOENT for a negative entry, is stored in inode_nr.
+ */
+bool dcache_lookup(
+    struct super_block *sb, int dir_nr, const char *name, int *inode_nr);
+
+/**
+ * Records that name in the directory dir_nr refers to inode_nr, or that the
+ * directory has no such entry if inode_nr is negative.
+ */
+void dcache_insert(
+    struct super_block *sb, int dir_nr, const char *name, int inode_nr);
+
+/**
+ * Drops all entries of the directory dir_nr.
+ */
+void dcache_forget_dir(struct super_block *sb, int dir_nr);
+
+/**
+ * While the cache is disabled, lookups miss and no entries are added. Adding
+ * and removing names still update cached entries, so that they stay valid
+ * when the cache is enabled again.
+ */
+void dcache_set_enabled(bool enabled);
+bool dcache_get_enabled(void);
+
+void dcache_get_stats(struct dcache_stats *stats);
+void dcache_reset_stats(void);
+void dcache_print_stats(void);
+
+#endif /* _DCACHE_H */
@@ -3,6 +3,8 @@
 
 #include <stdint.h>
 #include "async.h"
+#include "dma_buf.h"
+#include "io_sched.h"
 
 struct bdev_context {
   struct spdk_bdev *bdev;
@@ -14,17 +16,47 @@ struct bdev_context {
 struct reactor_context {
   uint32_t lcore;
   struct spdk_io_channel *io_channel;
+  struct dma_buf_pool dma_bufs;
+  struct spdk_mempool *request_pool;
+  struct io_sched *sched;
+
+  // Requests handed to this reactor and requests it has completed. The
+  // difference is what block submitters are throttled on.
+  volatile uint64_t nr_submitted;
+  volatile uint64_t nr_completed;
 };
 
+struct block_cache;
+
 struct filesystem {
   struct super_block *sb;
   struct bdev_context bdev_ctx;
-  struct reactor_context reactors[NUM_REACTORS];
+  struct block_cache *cache;
+  // NUM_REACTORS entries, indexed by reactor ID
+  struct reactor_context *reactors;
+};
+
+struct dev_opts {
+  // SPDK configuration file describing the bdev
+  const char *config_file;
+  // Cores to run the reactors on. NULL selects the first NUM_REACTORS cores.
+  const char *reactor_mask;
+  uint32_t num_metadata_reactors;
+  uint32_t num_data_reactors;
 };
 
 typedef void (* device_init_cb)(struct filesystem *fs);
 
-void dev_init(const char *file, device_init_cb cb);
+void dev_opts_init(struct dev_opts *opts);
+
+/**
+ * Starts the SPDK application and calls cb on the main reactor once every
+ * reactor can submit I/O. Reactors are mapped to the cores of the reactor mask
+ * in ascending order, starting with the main reactor on the master core.
+ *
+ * Returns a negative value if the options are invalid or SPDK failed to start.
+ */
+int dev_init(const struct dev_opts *opts, device_init_cb cb);
 void dev_stop(struct filesystem *);
 
 #endif
@@ -1,6 +1,8 @@
 #ifndef _DIR_H
 #define _DIR_H
 
+#include <stdbool.h>
+
 #include "inode.h"
 #include "super.h"
 
@@ -17,4 +19,12 @@ int testfs_create_file_or_dir(struct super_block *sb, struct inode *dir,
                               inode_type type, char *name);
 int testfs_make_root_dir(struct super_block *sb);
 
+/**
+ * Selects whether linear directories that outgrow their first block are
+ * converted to the hashed index. Directories that are already indexed stay
+ * indexed either way.
+ */
+void testfs_set_dir_index(bool enabled);
+bool testfs_get_dir_index(void);
+
 #endif /* _DIR_H */
@@ -0,0 +1,57 @@
+#ifndef __DMA_BUF_H__
+#define __DMA_BUF_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Each reactor owns a set of pre-allocated DMA buffer pools, one per size
+// class. Buffers are handed out without zeroing and are recycled when the I/O
+// that uses them completes.
+#define NUM_DMA_BUF_CLASSES 3
+
+struct spdk_mempool;
+
+struct dma_buf_pool {
+  struct spdk_mempool *classes[NUM_DMA_BUF_CLASSES];
+  size_t align;
+};
+
+/**
+ * Creates the DMA buffer pools for the given reactor. Must be called after the
+ * SPDK environment has been initialized.
+ *
+ * Returns 0 on success or a negative value on error.
+ */
+int dma_buf_pool_init(
+    struct dma_buf_pool *pool, uint32_t reactor_id, size_t buf_align);
+
+/**
+ * Frees the DMA buffer pools. All buffers must have been returned.
+ */
+void dma_buf_pool_destroy(struct dma_buf_pool *pool);
+
+/**
+ * Returns a DMA-capable buffer that can hold at least nr blocks. The contents
+ * of the buffer are undefined.
+ *
+ * The buffer is taken from the smallest size class that fits. If the request
+ * is larger than the largest class (or the pool is exhausted), the buffer is
+ * allocated with spdk_dma_malloc() instead.
+ *
+ * Returns NULL if no memory is available.
+ */
+void *dma_buf_get(struct dma_buf_pool *pool, size_t nr);
+
+/**
+ * Returns a buffer obtained from dma_buf_get(). This function can be called
+ * from any reactor.
+ */
+void dma_buf_put(void *buf);
+
+/**
+ * Reports the number of buffers in use and the capacity of each size class.
+ */
+void dma_buf_pool_usage(
+    struct dma_buf_pool *pool, size_t in_use[], size_t capacity[]);
+
+#endif
@@ -23,6 +23,27 @@ struct dinode {
 
 #define INODES_PER_BLOCK (BLOCK_SIZE / (sizeof(struct dinode)))
 
+// Read-ahead windows start at READAHEAD_MIN_WINDOW blocks and double on every
+// window up to the configured maximum
+#define READAHEAD_MIN_WINDOW 4
+#define READAHEAD_DEFAULT_MAX_WINDOW 64
+
+/*
+ * Sequential read-ahead state of an inode. The blocks of the most recent
+ * window, logical blocks [start, end), are being read into the block cache
+ * and are there once f completes.
+ */
+struct readahead {
+  // Logical block of the previous read, -1 before the first one
+  int prev_block;
+  int start;
+  int end;
+  // Number of blocks in the next window
+  int size;
+  bool inflight;
+  struct future f;
+};
+
 /* inode flags */
 #define I_FLAGS_DIRTY 0x1
 #define I_FLAGS_INDIRECT_DIRTY 0x2
@@ -32,33 +53,105 @@ struct inode {
   int i_flags;
   struct dinode in;
   int i_nr;
-  struct hlist_node hnode; /* keep these structures in a hash table */
   int i_count;
+  /* on the inode cache LRU list while i_count is 0 */
+  struct list_head lru;
   struct super_block *sb;
 
   // Stores an in-memory copy of the indirect block
   // This buffer is valid if the INDIRECT_LOADED flag is set
   int indirect[NR_INDIRECT_BLOCKS];
+
+  // Physical block after the last block allocated to the inode, 0 if none
+  int alloc_goal;
+
+  struct readahead ra;
 };
 
-void inode_hash_init(void);
-void inode_hash_destroy(void);
+// Memory the inode cache may use, in bytes
+#define INODE_CACHE_DEFAULT_BUDGET (256 * 1024)
+
+struct inode_cache_stats {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+
+  // Inodes in memory, and those of them that are not referenced
+  size_t nr_cached;
+  size_t nr_unused;
+};
+
+/**
+ * Sets up and tears down the table of in-memory inodes of a superblock. The
+ * table must not hold referenced inodes when it is destroyed. Setting up a
+ * superblock that already has a table destroys the old one first.
+ */
+void inode_hash_init(struct super_block *sb);
+void inode_hash_destroy(struct super_block *sb);
+
+/*
+ * Inodes stay in memory after their last reference is put, together with their
+ * indirect block, so that the next testfs_get_inode() does not read the inode
+ * table. Unreferenced inodes are evicted least recently used first once the
+ * inodes in memory exceed the budget. A budget of 0 frees inodes as soon as
+ * they are no longer referenced.
+ */
+void testfs_set_inode_cache_budget(size_t bytes);
+size_t testfs_get_inode_cache_budget(void);
+void testfs_get_inode_cache_stats(struct inode_cache_stats *stats);
+void testfs_reset_inode_cache_stats(void);
+void testfs_print_inode_cache_stats(struct super_block *sb);
 struct inode *testfs_get_inode(struct super_block *sb, int inode_nr);
 void testfs_sync_inode(struct inode *in);
+
+/**
+ * Copies the inode into the resident inode table and marks its block dirty.
+ */
+void testfs_inode_store(struct inode *in);
 void testfs_put_inode(struct inode *in);
 int testfs_inode_get_size(struct inode *in);
 inode_type testfs_inode_get_type(struct inode *in);
 int testfs_inode_get_nr(struct inode *in);
 struct super_block *testfs_inode_get_sb(struct inode *in);
-int testfs_create_inode(struct super_block *sb, inode_type type,
-                        struct inode **inp);
+/**
+ * Creates an inode of the given type. The inode number is allocated near
+ * parent_nr, the directory the inode will be linked into, or anywhere if
+ * parent_nr is negative.
+ */
+int testfs_create_inode(struct super_block *sb, int parent_nr,
+                        inode_type type, struct inode **inp);
 void testfs_remove_inode(struct inode *in);
 int testfs_read_data(struct inode *in, int start, char *buf, const int size);
 void testfs_truncate_data(struct inode *in, const int size);
+
+/**
+ * Marks the blocks of the inode in b_freemap and verifies their checksums.
+ * Stores the number of runs of physically consecutive data blocks, in logical
+ * order, in nr_extents. Returns the number of bytes in the mapped blocks.
+ */
 int testfs_check_inode(struct super_block *sb, struct bitmap *b_freemap,
-                       struct inode *in);
+                       struct inode *in, int *nr_extents);
 int testfs_write_data(struct inode *in, int start, char *name, const int size);
 int testfs_inode_to_block_offset(struct inode *in);
 int testfs_inode_to_block_nr(struct inode *in);
 
+/**
+ * Tells read-ahead that logical blocks [first, last] of the inode are about to
+ * be read. If the reader is sequential, this waits for blocks in the range
+ * that are still being read ahead and issues the next window.
+ */
+void testfs_readahead(struct inode *in, int first, int last);
+
+/**
+ * Sets the largest read-ahead window in blocks. 0 disables read-ahead.
+ */
+void testfs_set_readahead_window(int max_blocks);
+int testfs_get_readahead_window(void);
+
+/**
+ * Prints the read-ahead settings, the windows issued, and how many blocks read
+ * ahead were used or wasted.
+ */
+void testfs_print_readahead_stats(struct super_block *sb);
+
 #endif /* _INODE_H */
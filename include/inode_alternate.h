@@ -25,9 +25,29 @@ int testfs_write_data_alternate_async(
     struct inode *in, struct future *f, int start, char *buf, const int size);
 
 /**
- * Flushes a list of inodes to the underlying device asynchronously.  *
- * NOTE: This function will modify the order of the inodes in the list that is
- *       passed in.
+ * Reads size bytes of the file represented by the given inode, starting at
+ * offset start, into buf (alternate implementation).
+ *
+ * All logical blocks are mapped up front and every read is issued before this
+ * function returns, with one request per run of physically consecutive
+ * blocks. The data goes straight into buf; the parts of the first and last
+ * block that were not asked for are discarded.
+ *
+ * The caller must not touch buf until the provided future completes.
+ */
+int testfs_read_data_alternate_async(
+    struct inode *in, struct future *f, int start, char *buf, const int size);
+
+/**
+ * Synchronous version of testfs_read_data_alternate_async(). Returns a
+ * negative value on error.
+ */
+int testfs_read_data_alternate(
+    struct inode *in, int start, char *buf, const int size);
+
+/**
+ * Flushes a list of inodes to the underlying device asynchronously. Inode
+ * table blocks are written once each, in ascending order.
  */
 void testfs_bulk_sync_inode_async(
     struct inode *inodes[], size_t num_inodes, struct future *f);
@@ -47,10 +67,8 @@ int testfs_write_data_alternate(
     struct inode *in, int start, char *buf, const int size);
 
 /**
- * Flushes a list of inodes to the underlying device synchronously.
- *
- * NOTE: This function will modify the order of the inodes in the list that is
- *       passed in.
+ * Flushes a list of inodes to the underlying device synchronously. Inode
+ * table blocks are written once each, in ascending order.
  */
 void testfs_bulk_sync_inode(struct inode *inodes[], size_t num_inodes);
 
@@ -60,7 +78,32 @@ void testfs_bulk_sync_inode(struct inode *inodes[], size_t num_inodes);
 
 void testfs_ensure_indirect_loaded(struct inode *in);
 int testfs_inode_log_to_phy(struct inode *in, int log_block_nr);
+
+/**
+ * Returns the physical block that a new block at log_block_nr should ideally
+ * get: the one after the block mapped just before it, or after the last block
+ * allocated to the inode, or 0 if the inode has no blocks yet.
+ */
+int testfs_inode_alloc_goal(struct inode *in, int log_block_nr);
 int testfs_allocate_block_alternate(struct inode *in, int log_block_nr);
-int inode_compare(const void *p1, const void *p2);
+
+/**
+ * Allocates up to nr physically consecutive blocks and maps them to the
+ * logical blocks starting at log_block_nr, which must not be mapped yet.
+ * Stores the number of blocks mapped in got and returns the first physical
+ * block, or a negative value on error.
+ */
+int testfs_allocate_blocks_alternate(
+    struct inode *in, int log_block_nr, int nr, int *got);
+
+/**
+ * Maps up to max_nr logical blocks starting at log_block_nr, allocating those
+ * that have no physical block yet, and stops at the first block that is not
+ * physically consecutive with the ones before it. Stores the number of blocks
+ * in the run in run_nr and returns the first physical block, or a negative
+ * value if not even the first block could be mapped.
+ */
+int testfs_map_run_alternate(
+    struct inode *in, int log_block_nr, int max_nr, int *run_nr);
 
 #endif
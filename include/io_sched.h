@@ -0,0 +1,74 @@
+#ifndef __IO_SCHED_H__
+#define __IO_SCHED_H__
+
+#include <stdint.h>
+
+/*
+ * Per-reactor I/O scheduler. Requests submitted to a reactor are queued in LBA
+ * order and dispatched by a poller on that reactor in ascending sweeps over the
+ * LBA space (C-SCAN), so no request waits longer than one sweep. The poller
+ * coalesces queued requests with contiguous LBAs into a single device command.
+ * Merged commands never cross the device's optimal I/O boundary.
+ *
+ * The number of device commands in flight is capped per reactor. When the
+ * device runs out of submission resources (-ENOMEM), the affected requests are
+ * put back into the queue and dispatching resumes once the bdev
+ * layer signals that resources are available again.
+ *
+ * NOTE: A scheduler is only ever touched by the thread of the reactor that
+ *       owns it (statistics excepted).
+ */
+
+// Upper bound on the size of a merged device command, in blocks
+#define IO_SCHED_MAX_MERGE_BLOCKS 256
+
+// Default number of device commands a reactor keeps in flight. Requests beyond
+// this stay queued in the scheduler, where they can still be merged.
+#define IO_SCHED_DEFAULT_MAX_INFLIGHT 128
+
+struct spdk_bdev;
+struct spdk_io_channel;
+struct rw_request;
+struct io_sched; /* Opaque. */
+
+struct io_sched_stats {
+  // Requests queued on this scheduler so far and the number of device
+  // commands they were dispatched as
+  uint64_t nr_requests;
+  uint64_t nr_commands;
+  // Submissions the device rejected with -ENOMEM and that were retried
+  uint64_t nr_nomem;
+  // Highest number of device commands that were in flight at once
+  uint64_t max_inflight_seen;
+};
+
+/**
+ * Creates a scheduler for the given I/O channel and registers its poller. Must
+ * be called on the owning reactor.
+ *
+ * Returns NULL on error.
+ */
+struct io_sched *io_sched_create(
+  struct spdk_bdev *bdev, struct spdk_io_channel *io_channel);
+
+/**
+ * Unregisters the poller and frees the scheduler. No requests may be queued or
+ * in flight. Must be called on the owning reactor.
+ */
+void io_sched_destroy(struct io_sched *sched);
+
+/**
+ * Queues a request for dispatch. Must be called on the owning reactor.
+ */
+void io_sched_enqueue(struct io_sched *sched, struct rw_request *req);
+
+/**
+ * Sets the number of device commands the scheduler keeps in flight. May be
+ * called from any thread; takes effect on the next poll.
+ */
+void io_sched_set_max_inflight(struct io_sched *sched, uint32_t max_inflight);
+uint32_t io_sched_get_max_inflight(struct io_sched *sched);
+
+void io_sched_get_stats(struct io_sched *sched, struct io_sched_stats *stats);
+
+#endif
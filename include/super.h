@@ -17,15 +17,50 @@ struct dsuper_block {
   int modification_time;
 };
 
+/*
+ * Where new blocks and inodes are placed.
+ *
+ *     ALLOC_FIRST_FIT - the lowest free block or inode.
+ *     ALLOC_NEXT_FIT  - the first free block after the previous block
+ *                       allocation (the rolling cursor of the superblock).
+ *     ALLOC_GOAL      - the first free block after the previous block of
+ *                       the same file, falling back to the rolling cursor,
+ *                       and the first free inode after the parent directory.
+ */
+enum alloc_policy {
+  ALLOC_FIRST_FIT,
+  ALLOC_NEXT_FIT,
+  ALLOC_GOAL,
+  NUM_ALLOC_POLICIES,
+};
+
 struct super_block {
   struct dsuper_block sb;
   struct bitmap *inode_freemap;
   struct bitmap *block_freemap;
+  // Index in the block freemap after the last block allocated
+  u_int32_t alloc_cursor;
   tx_type tx_in_progress;
+  // First I/O error seen during the current transaction, or 0
+  int tx_status;
   struct filesystem *fs;
 
   int *csum_table;
   bool csum_block_dirty[CSUM_TABLE_SIZE];
+
+  // In-memory inodes of this file system (see inode.c)
+  struct inode_hash *inode_hash;
+
+  // Cached directory entries of this file system (see dcache.h)
+  struct dcache *dcache;
+
+  // Resident copy of the inode table, and which of its blocks changed
+  char *inode_table;
+  bool inode_block_dirty[NR_INODE_BLOCKS];
+
+  // Freemap blocks changed since they were last written
+  bool inode_freemap_dirty[INODE_FREEMAP_SIZE];
+  bool block_freemap_dirty[BLOCK_FREEMAP_SIZE];
 };
 
 void testfs_make_super_block(struct filesystem *dev);
@@ -37,29 +72,100 @@ void testfs_make_inode_blocks(struct super_block *sb);
 int testfs_init_super_block(struct filesystem *fs, int corrupt);
 void testfs_write_super_block(struct super_block *sb);
 void testfs_close_super_block(struct super_block *sb);
-void testfs_flush_super_block(struct super_block *sb);
+/**
+ * Writes the superblock, inode table and freemaps and every dirty cached block
+ * back, and drops the cached inodes. Returns the first I/O error, or 0.
+ */
+int testfs_flush_super_block(struct super_block *sb);
 
-int testfs_get_inode_freemap(struct super_block *sb);
+/**
+ * Sets the placement policy of new blocks and inodes. The default is
+ * ALLOC_GOAL.
+ */
+void testfs_set_alloc_policy(enum alloc_policy policy);
+enum alloc_policy testfs_get_alloc_policy(void);
+
+/**
+ * Converts between allocation policies and their names ("first", "next" and
+ * "goal"). Returns -EINVAL for an unknown name.
+ */
+int testfs_parse_alloc_policy(const char *name, enum alloc_policy *policy);
+const char *testfs_alloc_policy_name(enum alloc_policy policy);
+
+/**
+ * Allocates an inode number. Under ALLOC_GOAL the first free inode after
+ * goal_nr (e.g. the parent directory) is taken, so that related inodes share
+ * inode table blocks.
+ */
+int testfs_get_inode_freemap(struct super_block *sb, int goal_nr);
 void testfs_put_inode_freemap(struct super_block *sb, int inode_nr);
 
-int testfs_alloc_block(struct super_block *sb, char *block);
+/*
+ * The goal passed to the block allocators below is the physical block number
+ * that the new block would ideally have, or 0 if there is no preference. It is
+ * only used under ALLOC_GOAL.
+ */
+
+int testfs_alloc_block(struct super_block *sb, int goal, char *block);
 int testfs_free_block(struct super_block *sb, int block_nr);
 
 /**
  * Allocates a block in the in-memory freemap. Caller is responsible for
  * ensuring that the freemap is eventually flushed to the underlying device.
  */
-int testfs_alloc_block_alternate(struct super_block *sb);
+int testfs_alloc_block_alternate(struct super_block *sb, int goal);
 
 /**
- * Writes the in-memory freemap to the underlying device.
+ * Allocates up to want physically consecutive blocks in the in-memory
+ * freemap, like testfs_alloc_block_alternate(). Returns the first block and
+ * stores the number of blocks allocated in got, or returns a negative value
+ * if no block is free.
+ */
+int testfs_alloc_blocks_alternate(
+    struct super_block *sb, int goal, int want, int *got);
+
+/*
+ * Allocating or freeing blocks and inodes only changes the in-memory freemaps
+ * and marks the changed freemap blocks dirty. The dirty blocks are written by
+ * the functions below, with one request per run of consecutive dirty blocks,
+ * and at the latest when the transaction commits.
+ */
+
+/**
+ * Writes the dirty blocks of the in-memory block freemap to the underlying
+ * device.
  */
 void testfs_flush_block_freemap_async(
     struct super_block *sb, struct future *f);
 
 /**
- * Writes the in-memory freemap to the underlying device synchronously.
+ * Writes the dirty blocks of the in-memory block freemap to the underlying
+ * device synchronously.
  */
 void testfs_flush_block_freemap(struct super_block *sb);
 
+/**
+ * Writes the dirty blocks of both freemaps to the underlying device
+ * synchronously.
+ */
+void testfs_flush_freemaps(struct super_block *sb);
+
+/*
+ * The inode table stays in memory while the file system is mounted. Syncing an
+ * inode copies it into its block of the table and marks the block dirty; the
+ * dirty blocks are written by the functions below, like the freemaps, and at
+ * the latest when the transaction commits.
+ */
+
+/**
+ * Writes the dirty inode table blocks to the underlying device.
+ */
+void testfs_flush_inode_blocks_async(
+    struct super_block *sb, struct future *f);
+
+/**
+ * Writes the dirty inode table blocks to the underlying device synchronously.
+ */
+void testfs_flush_inode_blocks(struct super_block *sb);
+
 #endif /* _SUPER_H */
@@ -43,5 +43,18 @@ int cmd_owrite(struct super_block *, struct context *c);
 
 int cmd_checkfs(struct super_block *, struct context *c);
 int cmd_mkfs(struct super_block *, struct context *c);
+int cmd_stats(struct super_block *, struct context *c);
+int cmd_wait_mode(struct super_block *, struct context *c);
+int cmd_io_limits(struct super_block *, struct context *c);
+int cmd_sync_route(struct super_block *, struct context *c);
+int cmd_cache(struct super_block *, struct context *c);
+int cmd_sync(struct super_block *, struct context *c);
+int cmd_dirty_limits(struct super_block *, struct context *c);
+int cmd_readahead(struct super_block *, struct context *c);
+int cmd_inode_cache(struct super_block *, struct context *c);
+int cmd_dentry_cache(struct super_block *, struct context *c);
+int cmd_data_dispatch(struct super_block *, struct context *c);
+int cmd_alloc_policy(struct super_block *, struct context *c);
+int cmd_dir_index(struct super_block *, struct context *c);
 
 #endif /* _TESTFS_H */
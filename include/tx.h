@@ -2,9 +2,23 @@
 #define _TX_H
 
 struct super_block;
+struct future;
 
 typedef enum { TX_NONE, TX_WRITE, TX_CREATE, TX_RM, TX_UMOUNT } tx_type;
 void testfs_tx_start(struct super_block *sb, tx_type type);
-void testfs_tx_commit(struct super_block *sb, tx_type type);
+
+/**
+ * Ends the transaction. Returns the first I/O error recorded while it was in
+ * progress, or 0.
+ */
+int testfs_tx_commit(struct super_block *sb, tx_type type);
+
+/**
+ * Waits for the future and records its error, if any, against the current
+ * transaction. Returns the future's status.
+ */
+int testfs_tx_wait_at(
+  struct super_block *sb, struct future *f, const char *site);
+#define testfs_tx_wait(sb, f) testfs_tx_wait_at((sb), (f), __func__)
 
 #endif /* _TX_H */
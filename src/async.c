@@ -1,8 +1,59 @@
+#include "spdk/env.h"
 #include "spdk/event.h"
 
+#include <assert.h>
+#include <inttypes.h>
+#include <sched.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
 #include "async.h"
 #include "logging.h"
 
+// Number of batch objects shared by all submitting threads. If they are all in
+// flight, requests fall back to one event each.
+#define SUBMIT_BATCH_POOL_SIZE 1024
+#define SUBMIT_BATCH_POOL_CACHE_SIZE 32
+
+struct submit_batch {
+  uint32_t lcore;
+  size_t num_requests;
+  void (*fns[MAX_SUBMIT_BATCH_SIZE])(void *);
+  void *args[MAX_SUBMIT_BATCH_SIZE];
+};
+
+// Number of distinct spin_wait() call sites that are tracked
+#define MAX_WAIT_SITES 64
+
+// Adaptive backoff: the pause count doubles after every unsuccessful poll up to
+// the cap, after which the thread yields its core between polls
+#define WAIT_BACKOFF_MAX_PAUSES 1024
+
+struct wait_site {
+  const char *name;
+  uint64_t num_waits;
+  uint64_t num_yields;
+  uint64_t ticks;
+};
+
+static struct wait_site wait_sites[MAX_WAIT_SITES];
+static enum wait_mode wait_mode = WAIT_MODE_SPIN;
+
+struct reactor_layout reactor_layout = {
+  .num_metadata = 1,
+  .num_data = 1,
+};
+
+static struct spdk_mempool *batch_pool = NULL;
+static size_t submit_batch_size = DEFAULT_SUBMIT_BATCH_SIZE;
+
+// NOTE: Each submitting thread accumulates its own batches, at most one per
+//       target lcore
+static __thread struct submit_batch *open_batches[MAX_REACTORS];
+static __thread size_t num_open_batches = 0;
+
 static void
 __call_fn(void *arg1, void *arg2)
 {
@@ -12,21 +63,250 @@ __call_fn(void *arg1, void *arg2)
   fn(arg2);
 }
 
+static void
+__call_batch(void *arg1, void *arg2)
+{
+  struct submit_batch *batch = arg1;
+
+  for (size_t i = 0; i < batch->num_requests; i++) {
+    batch->fns[i](batch->args[i]);
+  }
+  spdk_mempool_put(batch_pool, batch);
+}
+
+int async_init(void) {
+  batch_pool = spdk_mempool_create(
+    "testfs_submit_batches",
+    SUBMIT_BATCH_POOL_SIZE,
+    sizeof(struct submit_batch),
+    SUBMIT_BATCH_POOL_CACHE_SIZE,
+    SPDK_ENV_SOCKET_ID_ANY
+  );
+  if (batch_pool == NULL) {
+    LOG("spdk_mempool_create() failed for submit batches\n");
+    return -1;
+  }
+  return 0;
+}
+
 void send_request(uint32_t lcore, void (*fn)(void *), void *arg) {
   struct spdk_event *event;
   event = spdk_event_allocate(lcore, __call_fn, (void *)fn, arg);
   spdk_event_call(event);
 }
 
-void spin_wait(struct future *f) {
-  for (size_t i = 0; i < NUM_REACTORS; i++) {
-    while (f->counts[i] != f->expected_counts[i]) {}
+static void post_batch(size_t i) {
+  struct submit_batch *batch = open_batches[i];
+  struct spdk_event *event;
+
+  event = spdk_event_allocate(batch->lcore, __call_batch, batch, NULL);
+  spdk_event_call(event);
+  open_batches[i] = open_batches[--num_open_batches];
+}
+
+void send_request_batched(uint32_t lcore, void (*fn)(void *), void *arg) {
+  struct submit_batch *batch = NULL;
+  size_t i;
+
+  if (submit_batch_size <= 1 || batch_pool == NULL) {
+    send_request(lcore, fn, arg);
+    return;
+  }
+
+  for (i = 0; i < num_open_batches; i++) {
+    if (open_batches[i]->lcore == lcore) {
+      batch = open_batches[i];
+      break;
+    }
+  }
+  if (batch == NULL) {
+    if (num_open_batches == MAX_REACTORS ||
+        (batch = spdk_mempool_get(batch_pool)) == NULL) {
+      send_request(lcore, fn, arg);
+      return;
+    }
+    batch->lcore = lcore;
+    batch->num_requests = 0;
+    i = num_open_batches++;
+    open_batches[i] = batch;
+  }
+
+  batch->fns[batch->num_requests] = fn;
+  batch->args[batch->num_requests] = arg;
+  batch->num_requests++;
+  if (batch->num_requests >= submit_batch_size) {
+    post_batch(i);
+  }
+}
+
+void flush_requests(void) {
+  while (num_open_batches > 0) {
+    post_batch(num_open_batches - 1);
+  }
+}
+
+void set_submit_batch_size(size_t size) {
+  flush_requests();
+  if (size > MAX_SUBMIT_BATCH_SIZE) {
+    size = MAX_SUBMIT_BATCH_SIZE;
+  }
+  submit_batch_size = size;
+}
+
+size_t get_submit_batch_size(void) {
+  return submit_batch_size;
+}
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  _mm_pause();
+#elif defined(__aarch64__)
+  __asm__ volatile("yield");
+#endif
+}
+
+static struct wait_site *get_wait_site(const char *name) {
+  for (size_t i = 0; i < MAX_WAIT_SITES; i++) {
+    // NOTE: Call sites are identified by their __func__ pointer
+    if (wait_sites[i].name == name ||
+        __sync_bool_compare_and_swap(&wait_sites[i].name, NULL, name)) {
+      return &wait_sites[i];
+    }
+  }
+  return NULL;
+}
+
+static uint64_t wait_backoff(struct future *f) {
+  uint64_t num_yields = 0;
+  size_t pauses = 1;
+
+  while (f->pending != 1) {
+    if (pauses < WAIT_BACKOFF_MAX_PAUSES) {
+      for (size_t i = 0; i < pauses; i++) {
+        cpu_relax();
+      }
+      pauses *= 2;
+    } else {
+      sched_yield();
+      num_yields++;
+    }
+  }
+  return num_yields;
+}
+
+int spin_wait_at(struct future *f, const char *site) {
+  uint64_t start = spdk_get_ticks();
+  uint64_t num_yields = 0;
+
+  // NOTE: Requests still sitting in an open batch would never complete
+  flush_requests();
+  if (wait_mode == WAIT_MODE_BACKOFF) {
+    num_yields = wait_backoff(f);
+  } else {
+    while (f->pending != 1) {}
+  }
+  __sync_synchronize();
+
+  struct wait_site *ws = get_wait_site(site);
+  if (ws != NULL) {
+    __sync_fetch_and_add(&ws->num_waits, 1);
+    __sync_fetch_and_add(&ws->num_yields, num_yields);
+    __sync_fetch_and_add(&ws->ticks, spdk_get_ticks() - start);
+  }
+  return f->status;
+}
+
+void set_wait_mode(enum wait_mode mode) {
+  wait_mode = mode;
+}
+
+enum wait_mode get_wait_mode(void) {
+  return wait_mode;
+}
+
+void print_wait_stats(void) {
+  double ticks_per_us = spdk_get_ticks_hz() / 1e6;
+
+  printf("wait mode: %s\n", wait_mode == WAIT_MODE_SPIN ? "spin" : "backoff");
+  printf("%-40s %10s %14s %12s %10s\n",
+    "call site", "waits", "total_us", "avg_us", "yields");
+  for (size_t i = 0; i < MAX_WAIT_SITES && wait_sites[i].name != NULL; i++) {
+    struct wait_site *ws = &wait_sites[i];
+    double total_us = ws->ticks / ticks_per_us;
+    printf("%-40s %10" PRIu64 " %14.1f %12.2f %10" PRIu64 "\n",
+      ws->name,
+      ws->num_waits,
+      total_us,
+      ws->num_waits > 0 ? total_us / ws->num_waits : 0.0,
+      ws->num_yields);
+  }
+}
+
+void reset_wait_stats(void) {
+  for (size_t i = 0; i < MAX_WAIT_SITES; i++) {
+    wait_sites[i].num_waits = 0;
+    wait_sites[i].num_yields = 0;
+    wait_sites[i].ticks = 0;
   }
 }
 
 void future_init(struct future *f) {
-  for (size_t i = 0; i < NUM_REACTORS; i++) {
-    f->counts[i] = 0;
-    f->expected_counts[i] = 0;
+  f->pending = 1;
+  f->status = 0;
+  f->then_fn = NULL;
+  f->then_arg = NULL;
+  f->then_lcore = FUTURE_ANY_LCORE;
+}
+
+void future_expect(struct future *f) {
+  __sync_fetch_and_add(&f->pending, 1);
+}
+
+static void __run_continuation(void *arg) {
+  struct future *f = arg;
+  f->then_fn(f, f->then_arg);
+}
+
+static void release(struct future *f) {
+  if (__sync_sub_and_fetch(&f->pending, 1) != 0) {
+    return;
+  }
+  if (f->then_lcore == FUTURE_ANY_LCORE) {
+    f->then_fn(f, f->then_arg);
+  } else {
+    send_request(f->then_lcore, __run_continuation, f);
+  }
+}
+
+void future_complete(struct future *f, int status) {
+  if (status < 0) {
+    __sync_bool_compare_and_swap(&f->status, 0, status);
+  }
+  // NOTE: The decrement is a full barrier, so the status and any data copied
+  //       by the completing reactor are visible once the waiter sees it
+  release(f);
+}
+
+void future_then(struct future *f, uint32_t lcore, future_cb fn, void *arg) {
+  assert(f->then_fn == NULL);
+  f->then_fn = fn;
+  f->then_arg = arg;
+  f->then_lcore = lcore;
+  // NOTE: Requests still sitting in an open batch would never complete
+  flush_requests();
+  release(f);
+}
+
+static void when_all_one_done(struct future *in, void *arg) {
+  future_complete((struct future *)arg, in->status);
+}
+
+void future_when_all(
+    struct future *out, struct future *ins[], size_t num_futures) {
+  for (size_t i = 0; i < num_futures; i++) {
+    future_expect(out);
+  }
+  for (size_t i = 0; i < num_futures; i++) {
+    future_then(ins[i], FUTURE_ANY_LCORE, when_all_one_done, out);
   }
 }
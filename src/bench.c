@@ -45,6 +45,34 @@ void populate_digest(
   digest->async.max_us = max_async_us;
   digest->async.min_us = min_async_us;
   digest->async.avg_us = average_async_us;
+  digest->sync.avg_commands = 0.;
+  digest->async.avg_commands = 0.;
+}
+
+void populate_result(
+  struct bench_result *result,
+  long long results_us[],
+  int num_trials
+) {
+  result->avg_us = 0.;
+  result->max_us = results_us[0];
+  result->min_us = results_us[0];
+  for (int i = 0; i < num_trials; i++) {
+    result->avg_us += results_us[i] / (double) num_trials;
+    result->max_us = M_MAX(result->max_us, results_us[i]);
+    result->min_us = M_MIN(result->min_us, results_us[i]);
+  }
+  result->avg_commands = 0.;
+}
+
+void print_result(char *name, struct bench_result *result) {
+  printf(
+    "%-16s  min: %lld us  max: %lld us  avg: %.2f us\n",
+    name,
+    result->min_us,
+    result->max_us,
+    result->avg_us
+  );
 }
 
 void print_digest(
@@ -68,29 +96,39 @@ void print_digest(
     digest->async.max_us,
     digest->async.avg_us
   );
+  if (digest->sync.avg_commands > 0. || digest->async.avg_commands > 0.) {
+    printf(
+      "Device commands:  sync: %.1f  async: %.1f\n",
+      digest->sync.avg_commands,
+      digest->async.avg_commands
+    );
+  }
   printf("\n");
 }
 
 void print_digest_header_csv(FILE *file) {
   fprintf(
     file,
-    "%s%s",
+    "%s%s%s",
     "trials,sync_min_us,sync_max_us,sync_avg_us,",
-    "async_min_us,async_max_us,async_avg_us"
+    "async_min_us,async_max_us,async_avg_us,",
+    "sync_avg_commands,async_avg_commands"
   );
 }
 
 void print_digest_csv(FILE *file, struct bench_digest *digest) {
   fprintf(
     file,
-    "%d,%lld,%lld,%.6f,%lld,%lld,%.6f",
+    "%d,%lld,%lld,%.6f,%lld,%lld,%.6f,%.2f,%.2f",
     digest->trials,
     digest->sync.min_us,
     digest->sync.max_us,
     digest->sync.avg_us,
     digest->async.min_us,
     digest->async.max_us,
-    digest->async.avg_us
+    digest->async.avg_us,
+    digest->sync.avg_commands,
+    digest->async.avg_commands
   );
 }
 
@@ -124,6 +162,18 @@ int cmd_benchmark(struct super_block *sb, struct context *c) {
   } else if (strcmp(c->cmd[1], "raw_seq_write") == 0) {
     return subcmd_benchmark_raw_seq_write(fs, c);
 
+  } else if (strcmp(c->cmd[1], "submit_batch") == 0) {
+    return subcmd_benchmark_submit_batch(fs, c);
+
+  } else if (strcmp(c->cmd[1], "sync_route") == 0) {
+    return subcmd_benchmark_sync_route(fs, c);
+
+  } else if (strcmp(c->cmd[1], "bitmap") == 0) {
+    return subcmd_benchmark_bitmap(fs, c);
+
+  } else if (strcmp(c->cmd[1], "create") == 0) {
+    return subcmd_benchmark_dir_create(fs, c);
+
   } else {
     printf("Unknown benchmark: '%s'\n", c->cmd[1]);
     return -EINVAL;
@@ -147,6 +197,22 @@ int cmd_experiment(struct super_block *sb, struct context *c) {
   EXPERIMENT(
     "raw_seq_write", experiment_raw_seq_write(fs, csv, 1, 200, num_trials));
 
+  EXPERIMENT(
+    "submit_batch", experiment_submit_batch(fs, csv, 128, num_trials));
+
+  EXPERIMENT(
+    "sync_route", experiment_sync_route(fs, csv, 128, num_trials));
+
+  EXPERIMENT(
+    "data_reactor_scaling",
+    experiment_data_reactor_scaling(
+      fs,
+      csv,
+      8192, // num_blocks
+      num_trials
+    )
+  );
+
   EXPERIMENT(
     "e2e_write_num_blocks",
     experiment_e2e_write_num_blocks(
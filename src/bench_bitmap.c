@@ -0,0 +1,129 @@
+#include "bench.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include "bitmap.h"
+
+// Bits left free at the start of every 64-bit chunk before allocating ranges
+#define BITMAP_BENCH_RUN 8
+#define BITMAP_BENCH_COUNTS 1000
+
+static void benchmark_bitmap_fill(struct bitmap *b) {
+  u_int32_t index;
+  while (bitmap_alloc(b, &index) == 0) {
+  }
+}
+
+static void benchmark_bitmap_count(struct bitmap *b) {
+  volatile int nr;
+  for (int i = 0; i < BITMAP_BENCH_COUNTS; i++) {
+    nr = bitmap_nr_allocated(b);
+  }
+  (void) nr;
+}
+
+static void benchmark_bitmap_alloc_range(struct bitmap *b) {
+  u_int32_t start = 0, got = 0;
+  while (bitmap_alloc_range(b, start + got, BITMAP_BENCH_RUN, &start, &got)
+         == 0) {
+  }
+}
+
+/**
+ * Benchmarks the bitmap operations used by the allocators. Runs on the CPU
+ * only and does not touch the device.
+ *
+ * Arguments:
+ * cmd[2]: Number of trials
+ * cmd[3]: Number of bits
+ */
+int subcmd_benchmark_bitmap(struct filesystem *fs, struct context *c) {
+  if (c->nargs < 4) {
+    return -EINVAL;
+  }
+
+  int num_trials = strtol(c->cmd[2], NULL, 10);
+  long nbits = strtol(c->cmd[3], NULL, 10);
+  if (num_trials <= 0 || nbits <= 0) {
+    return -EINVAL;
+  }
+
+  struct bitmap_bench_digest digest;
+  int ret = benchmark_bitmap(&digest, num_trials, nbits);
+  if (ret < 0) {
+    return ret;
+  }
+
+  printf("===== bitmap (%ld bits) =====\n", nbits);
+  printf("Number of trials: %d\n", digest.trials);
+  print_result("Fill:", &digest.fill);
+  print_result("Count (x1000):", &digest.count);
+  print_result("Compare:", &digest.equal);
+  print_result("Allocate ranges:", &digest.alloc_range);
+  print_result("Rebuild:", &digest.rebuild);
+  printf("\n");
+  return 0;
+}
+
+/**
+ * Each trial fills an empty bitmap one bit at a time, counts and compares the
+ * full bitmap, and then frees the first BITMAP_BENCH_RUN bits of every 64-bit
+ * chunk and allocates them again as ranges.
+ */
+int benchmark_bitmap(
+  struct bitmap_bench_digest *digest,
+  int num_trials,
+  u_int32_t nbits
+) {
+  long long results_fill_us[num_trials];
+  long long results_count_us[num_trials];
+  long long results_equal_us[num_trials];
+  long long results_alloc_range_us[num_trials];
+  long long results_rebuild_us[num_trials];
+  struct bitmap *a, *b;
+  int ret;
+
+  ret = bitmap_create(nbits, &b);
+  if (ret < 0) {
+    return ret;
+  }
+  ret = bitmap_create(nbits, &a);
+  if (ret < 0) {
+    bitmap_destroy(b);
+    return ret;
+  }
+  // the reference copy for bitmap_equal
+  benchmark_bitmap_fill(a);
+
+  for (int trial = 0; trial < num_trials; trial++) {
+    for (u_int32_t i = 0; i < nbits; i++) {
+      if (bitmap_isset(b, i)) {
+        bitmap_unmark(b, i);
+      }
+    }
+
+    MEASURE_USEC(results_fill_us[trial], benchmark_bitmap_fill(b));
+    MEASURE_USEC(results_count_us[trial], benchmark_bitmap_count(b));
+    MEASURE_USEC(results_equal_us[trial], bitmap_equal(a, b));
+
+    for (u_int32_t i = 0; i < nbits; i += 64) {
+      for (u_int32_t j = i; j < MIN(i + BITMAP_BENCH_RUN, nbits); j++) {
+        bitmap_unmark(b, j);
+      }
+    }
+    MEASURE_USEC(
+      results_alloc_range_us[trial], benchmark_bitmap_alloc_range(b));
+    MEASURE_USEC(results_rebuild_us[trial], bitmap_rebuild(b));
+  }
+
+  bitmap_destroy(a);
+  bitmap_destroy(b);
+
+  digest->trials = num_trials;
+  populate_result(&digest->fill, results_fill_us, num_trials);
+  populate_result(&digest->count, results_count_us, num_trials);
+  populate_result(&digest->equal, results_equal_us, num_trials);
+  populate_result(&digest->alloc_range, results_alloc_range_us, num_trials);
+  populate_result(&digest->rebuild, results_rebuild_us, num_trials);
+  return 0;
+}
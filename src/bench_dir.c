@@ -0,0 +1,142 @@
+#include "bench.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include "dcache.h"
+#include "dir.h"
+
+#define DIR_BENCH_NAME_LENGTH 16
+
+/**
+ * Creates up to num_files files in the root directory of a new file system.
+ * Returns the number of files created before the first failure.
+ */
+static int benchmark_dir_create(
+    struct filesystem *fs, struct context *c, int num_files) {
+  char name[DIR_BENCH_NAME_LENGTH];
+  int i;
+
+  for (i = 0; i < num_files; i++) {
+    sprintf(name, "f%d", i);
+    if (testfs_create_file_or_dir(fs->sb, c->cur_dir, I_FILE, name) < 0) {
+      break;
+    }
+  }
+  return i;
+}
+
+static void benchmark_dir_lookup(struct context *c, int num_files) {
+  char name[DIR_BENCH_NAME_LENGTH];
+
+  for (int i = 0; i < num_files; i++) {
+    sprintf(name, "f%d", i);
+    testfs_dir_name_to_inode_nr(c->cur_dir, name);
+  }
+}
+
+static void print_dir_result(
+  char *name,
+  int num_files,
+  struct bench_result *create,
+  struct bench_result *lookup
+) {
+  printf("%s %d files\n", name, num_files);
+  print_result("  Create:", create);
+  if (num_files > 0) {
+    printf(
+      "  %.2f us and %.2f device commands per create\n",
+      create->avg_us / num_files,
+      create->avg_commands / num_files
+    );
+  }
+  print_result("  Lookup:", lookup);
+}
+
+/**
+ * Benchmarks creating files in one directory, and then looking all of them
+ * up, with linear directories and with the hashed directory index.
+ *
+ * NOTE: This formats the file system before every run.
+ *
+ * Arguments:
+ * cmd[2]: Number of trials
+ * cmd[3]: Number of files
+ */
+int subcmd_benchmark_dir_create(struct filesystem *fs, struct context *c) {
+  if (c->nargs < 4) {
+    return -EINVAL;
+  }
+
+  int num_trials = strtol(c->cmd[2], NULL, 10);
+  int num_files = strtol(c->cmd[3], NULL, 10);
+  if (num_trials <= 0 || num_files <= 0) {
+    return -EINVAL;
+  }
+
+  struct dir_bench_digest digest;
+  benchmark_dir_create_rate(fs, c, &digest, num_trials, num_files);
+
+  printf("===== dir create (%d files) =====\n", num_files);
+  printf("Number of trials: %d\n", digest.trials);
+  print_dir_result(
+    "Linear:", digest.linear_files,
+    &digest.linear_create, &digest.linear_lookup);
+  print_dir_result(
+    "Indexed:", digest.indexed_files,
+    &digest.indexed_create, &digest.indexed_lookup);
+  printf("\n");
+  return 0;
+}
+
+/**
+ * Each trial formats the file system and creates num_files files in the root
+ * directory, first with the directory index off and then with it on. The
+ * inode table and the size limit of a directory cap the number of files, so
+ * a run stops at the first create that fails. The dentry cache is disabled
+ * meanwhile, so that lookups measure the directory format.
+ */
+void benchmark_dir_create_rate(
+  struct filesystem *fs,
+  struct context *c,
+  struct dir_bench_digest *digest,
+  int num_trials,
+  int num_files
+) {
+  long long results_create_us[2][num_trials];
+  long long results_lookup_us[2][num_trials];
+  uint64_t commands[2] = {0, 0};
+  int created[2] = {num_files, num_files};
+  bool dir_index = testfs_get_dir_index();
+  bool dcache_enabled = dcache_get_enabled();
+
+  dcache_set_enabled(false);
+  for (int trial = 0; trial < num_trials; trial++) {
+    for (int indexed = 0; indexed < 2; indexed++) {
+      int nr;
+
+      testfs_set_dir_index(indexed);
+      cmd_mkfs(fs->sb, c);
+      uint64_t commands_before = block_get_nr_commands(fs);
+      MEASURE_USEC(
+        results_create_us[indexed][trial],
+        nr = benchmark_dir_create(fs, c, num_files)
+      );
+      commands[indexed] += block_get_nr_commands(fs) - commands_before;
+      MEASURE_USEC(
+        results_lookup_us[indexed][trial], benchmark_dir_lookup(c, nr));
+      created[indexed] = MIN(created[indexed], nr);
+    }
+  }
+  testfs_set_dir_index(dir_index);
+  dcache_set_enabled(dcache_enabled);
+
+  digest->trials = num_trials;
+  digest->linear_files = created[0];
+  digest->indexed_files = created[1];
+  populate_result(&digest->linear_create, results_create_us[0], num_trials);
+  populate_result(&digest->indexed_create, results_create_us[1], num_trials);
+  populate_result(&digest->linear_lookup, results_lookup_us[0], num_trials);
+  populate_result(&digest->indexed_lookup, results_lookup_us[1], num_trials);
+  digest->linear_create.avg_commands = (double) commands[0] / num_trials;
+  digest->indexed_create.avg_commands = (double) commands[1] / num_trials;
+}
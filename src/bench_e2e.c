@@ -71,7 +71,11 @@ static void benchmark_async_writes(
   char *content,
   int size
 ) {
-  struct future f;
+  // One future per stage of the write, joined into f
+  struct future data_f, inode_f, freemap_f, csum_f, f;
+  struct future *stages[] = {&data_f, &inode_f, &freemap_f, &csum_f};
+  size_t num_stages = sizeof(stages) / sizeof(stages[0]);
+  FOR(num_stages, future_init(stages[i]));
   future_init(&f);
 
   struct inode *file_inodes[num_files];
@@ -84,12 +88,14 @@ static void benchmark_async_writes(
   testfs_tx_start(fs->sb, TX_WRITE);
   FOR(
     num_files,
-    testfs_write_data_alternate_async(file_inodes[i], &f, 0, content, size)
+    testfs_write_data_alternate_async(
+      file_inodes[i], &data_f, 0, content, size)
   );
-  testfs_bulk_sync_inode_async(file_inodes, num_files, &f);
-  testfs_flush_block_freemap_async(fs->sb, &f);
-  testfs_flush_csum_async(fs->sb, &f);
-  spin_wait(&f);
+  testfs_bulk_sync_inode_async(file_inodes, num_files, &inode_f);
+  testfs_flush_block_freemap_async(fs->sb, &freemap_f);
+  testfs_flush_csum_async(fs->sb, &csum_f);
+  future_when_all(&f, stages, num_stages);
+  testfs_tx_wait(fs->sb, &f);
   testfs_tx_commit(fs->sb, TX_WRITE);
 
   FOR(num_files, testfs_put_inode(file_inodes[i]));
@@ -145,24 +151,32 @@ void benchmark_e2e_write(
 
   long long results_sync_us[num_trials];
   long long results_async_us[num_trials];
+  uint64_t sync_commands = 0;
+  uint64_t async_commands = 0;
 
   for (int trial = 0; trial < num_trials; trial++) {
     benchmark_set_up(fs, c, filenames, num_files);
+    uint64_t commands_before = block_get_nr_commands(fs);
     MEASURE_USEC(
       results_sync_us[trial],
       benchmark_sync_writes(
         fs, c->cur_dir, filenames, num_files, content, size)
     );
+    sync_commands += block_get_nr_commands(fs) - commands_before;
 
     benchmark_set_up(fs, c, filenames, num_files);
+    commands_before = block_get_nr_commands(fs);
     MEASURE_USEC(
       results_async_us[trial],
       benchmark_async_writes(
         fs, c->cur_dir, filenames, num_files, content, size)
     );
+    async_commands += block_get_nr_commands(fs) - commands_before;
   }
 
   populate_digest(digest, results_sync_us, results_async_us, num_trials);
+  digest->sync.avg_commands = (double) sync_commands / num_trials;
+  digest->async.avg_commands = (double) async_commands / num_trials;
 }
 
 /**
@@ -2,8 +2,25 @@
 
 #include <stdlib.h>
 #include "async.h"
+#include "bitmap.h"
 #include "block.h"
 
+// Turns the block cache off so that a benchmark measures the device rather
+// than the cache, and returns the mode to restore afterwards
+static enum cache_mode bypass_cache(struct filesystem *fs) {
+  enum cache_mode old_mode = cache_get_mode(fs->cache);
+  block_cache_set_mode(fs->sb, CACHE_MODE_OFF);
+  return old_mode;
+}
+
+// Returns the first block past the largest data region the block freemap can
+// describe. The file system never allocates from there, so benchmarks that run
+// on a mounted file system can write to it without clobbering its contents.
+static int scratch_blocks_start(struct super_block *sb) {
+  return sb->sb.data_blocks_start +
+    BLOCK_SIZE * BLOCK_FREEMAP_SIZE * BITS_PER_WORD;
+}
+
 static void benchmark_raw_write(struct filesystem *fs, int num_blocks) {
   char block[BLOCK_SIZE];
   for (int i = 0; i < num_blocks; i++) {
@@ -39,6 +56,44 @@ static void benchmark_raw_read_async(
   spin_wait(&f);
 }
 
+// NOTE: Only every other block is written so that the scheduler cannot merge
+//       requests and the measurement reflects the cost of submission alone.
+//       The blocks are scratch blocks, as this runs on the mounted file system.
+static void benchmark_raw_write_strided(
+    struct filesystem *fs, char *block, int num_blocks, size_t batch_size) {
+  size_t old_batch_size = get_submit_batch_size();
+  int start = scratch_blocks_start(fs->sb);
+  struct future f;
+
+  set_submit_batch_size(batch_size);
+  future_init(&f);
+  for (int i = 0; i < num_blocks; i++) {
+    write_blocks_async(fs->sb, DATA_REACTOR, &f, block, start + i * 2, 1);
+  }
+  spin_wait(&f);
+  set_submit_batch_size(old_batch_size);
+}
+
+static void benchmark_raw_read_routed(
+    struct filesystem *fs, char *buffer, int num_blocks, enum sync_route route) {
+  enum sync_route old_route = block_get_sync_route();
+  block_set_sync_route(route);
+  benchmark_raw_read(fs, buffer, num_blocks);
+  block_set_sync_route(old_route);
+}
+
+static void benchmark_raw_write_dispatched(
+    struct filesystem *fs, char *block, int num_blocks) {
+  int start = scratch_blocks_start(fs->sb);
+  struct future f;
+  future_init(&f);
+  for (int i = 0; i < num_blocks; i++) {
+    write_blocks_async(
+      fs->sb, block_data_reactor(fs->sb, i), &f, block, start + i, 1);
+  }
+  spin_wait(&f);
+}
+
 /**
  * Benchmarks sequential reads of blocks from the underlying device.
  *
@@ -72,6 +127,7 @@ void benchmark_raw_seq_read(
   long long results_sync_us[num_trials];
   long long results_async_us[num_trials];
 
+  enum cache_mode old_mode = bypass_cache(fs);
   for (int trial = 0; trial < num_trials; trial++) {
     MEASURE_USEC(
       results_sync_us[trial], benchmark_raw_read(fs, buffer, num_blocks));
@@ -81,6 +137,7 @@ void benchmark_raw_seq_read(
       benchmark_raw_read_async(fs, buffer, num_blocks)
     );
   }
+  block_cache_set_mode(fs->sb, old_mode);
 
   free(buffer);
   populate_digest(digest, results_sync_us, results_async_us, num_trials);
@@ -117,12 +174,14 @@ void benchmark_raw_seq_write(
   long long results_sync_us[num_trials];
   long long results_async_us[num_trials];
 
+  enum cache_mode old_mode = bypass_cache(fs);
   for (int trial = 0; trial < num_trials; trial++) {
     MEASURE_USEC(results_sync_us[trial], benchmark_raw_write(fs, num_blocks));
 
     MEASURE_USEC(
       results_async_us[trial], benchmark_raw_write_async(fs, num_blocks));
   }
+  block_cache_set_mode(fs->sb, old_mode);
 
   populate_digest(digest, results_sync_us, results_async_us, num_trials);
 }
@@ -170,3 +229,219 @@ void experiment_raw_seq_read(
     fprintf(output, "\r\n");
   }
 }
+
+/**
+ * Benchmarks asynchronous block submission with one event per request against
+ * batched submission. The "sync" column of the digest holds the per-request
+ * results and the "async" column holds the batched results.
+ *
+ * Arguments:
+ * cmd[2]: Number of trials
+ * cmd[3]: Number of blocks
+ * cmd[4]: Batch size
+ */
+int subcmd_benchmark_submit_batch(struct filesystem *fs, struct context *c) {
+  if (c->nargs < 5) {
+    return -EINVAL;
+  }
+
+  int num_trials = strtol(c->cmd[2], NULL, 10);
+  int num_blocks = strtol(c->cmd[3], NULL, 10);
+  int batch_size = strtol(c->cmd[4], NULL, 10);
+  if (num_trials <= 0 || num_blocks <= 0 ||
+      batch_size < 1 || batch_size > MAX_SUBMIT_BATCH_SIZE) {
+    return -EINVAL;
+  }
+
+  struct bench_digest digest;
+  benchmark_submit_batch(fs, &digest, num_trials, num_blocks, batch_size);
+  print_digest("submit_batch", &digest);
+
+  return 0;
+}
+
+void benchmark_submit_batch(
+  struct filesystem *fs,
+  struct bench_digest *digest,
+  int num_trials,
+  int num_blocks,
+  size_t batch_size
+) {
+  char block[BLOCK_SIZE];
+  memset(block, 0, BLOCK_SIZE);
+
+  long long results_single_us[num_trials];
+  long long results_batched_us[num_trials];
+
+  enum cache_mode old_mode = bypass_cache(fs);
+  for (int trial = 0; trial < num_trials; trial++) {
+    MEASURE_USEC(
+      results_single_us[trial],
+      benchmark_raw_write_strided(fs, block, num_blocks, 1)
+    );
+
+    MEASURE_USEC(
+      results_batched_us[trial],
+      benchmark_raw_write_strided(fs, block, num_blocks, batch_size)
+    );
+  }
+  block_cache_set_mode(fs->sb, old_mode);
+
+  populate_digest(digest, results_single_us, results_batched_us, num_trials);
+}
+
+void experiment_submit_batch(
+  struct filesystem *fs,
+  FILE *output,
+  int num_blocks,
+  int num_trials
+) {
+  fprintf(output, "batch_size,");
+  print_digest_header_csv(output);
+  fprintf(output, "\r\n");
+
+  struct bench_digest digest;
+  for (size_t batch_size = 2; batch_size <= MAX_SUBMIT_BATCH_SIZE;
+      batch_size *= 2) {
+    benchmark_submit_batch(fs, &digest, num_trials, num_blocks, batch_size);
+
+    fprintf(output, "%zu,", batch_size);
+    print_digest_csv(output, &digest);
+    fprintf(output, "\r\n");
+  }
+}
+
+/**
+ * Benchmarks synchronous single-block reads under each routing policy. The
+ * "sync" column of each digest holds the results of routing to the data
+ * reactor and the "async" column those of the policy being compared.
+ *
+ * Arguments:
+ * cmd[2]: Number of trials
+ * cmd[3]: Number of blocks
+ */
+int subcmd_benchmark_sync_route(struct filesystem *fs, struct context *c) {
+  if (c->nargs < 4) {
+    return -EINVAL;
+  }
+
+  int num_trials = strtol(c->cmd[2], NULL, 10);
+  int num_blocks = strtol(c->cmd[3], NULL, 10);
+  if (num_trials <= 0 || num_blocks <= 0) {
+    return -EINVAL;
+  }
+
+  struct bench_digest digest;
+  char name[64];
+  for (int route = 0; route < NUM_SYNC_ROUTES; route++) {
+    benchmark_sync_route(fs, &digest, num_trials, num_blocks, route);
+    snprintf(name, sizeof(name), "sync_route_%s", block_sync_route_name(route));
+    print_digest(name, &digest);
+  }
+
+  return 0;
+}
+
+void benchmark_sync_route(
+  struct filesystem *fs,
+  struct bench_digest *digest,
+  int num_trials,
+  int num_blocks,
+  enum sync_route route
+) {
+  char *buffer = malloc(sizeof(char) * BLOCK_SIZE * num_blocks);
+
+  long long results_data_us[num_trials];
+  long long results_route_us[num_trials];
+
+  // NOTE: A cache hit would return before the route is even consulted
+  enum cache_mode old_mode = bypass_cache(fs);
+  for (int trial = 0; trial < num_trials; trial++) {
+    MEASURE_USEC(
+      results_data_us[trial],
+      benchmark_raw_read_routed(fs, buffer, num_blocks, SYNC_ROUTE_DATA)
+    );
+
+    MEASURE_USEC(
+      results_route_us[trial],
+      benchmark_raw_read_routed(fs, buffer, num_blocks, route)
+    );
+  }
+  block_cache_set_mode(fs->sb, old_mode);
+
+  free(buffer);
+  populate_digest(digest, results_data_us, results_route_us, num_trials);
+}
+
+void experiment_sync_route(
+  struct filesystem *fs,
+  FILE *output,
+  int num_blocks,
+  int num_trials
+) {
+  fprintf(output, "route,");
+  print_digest_header_csv(output);
+  fprintf(output, "\r\n");
+
+  struct bench_digest digest;
+  for (int route = 0; route < NUM_SYNC_ROUTES; route++) {
+    benchmark_sync_route(fs, &digest, num_trials, num_blocks, route);
+
+    fprintf(output, "%s,", block_sync_route_name(route));
+    print_digest_csv(output, &digest);
+    fprintf(output, "\r\n");
+  }
+}
+
+/**
+ * Measures sequential write throughput while spreading the blocks over an
+ * increasing number of data reactors, once per data dispatch policy.
+ *
+ * NOTE: The number of data reactors is fixed at startup (--data-reactors), so
+ *       this experiment limits dispatch to the first n of them. It runs on the
+ *       mounted file system and thus writes to scratch blocks past its data
+ *       region.
+ */
+void experiment_data_reactor_scaling(
+  struct filesystem *fs,
+  FILE *output,
+  int num_blocks,
+  int num_trials
+) {
+  enum data_dispatch old_dispatch = block_get_data_dispatch();
+  uint32_t old_active = block_get_active_data_reactors();
+  enum cache_mode old_mode = bypass_cache(fs);
+  char block[BLOCK_SIZE];
+  long long elapsed_us;
+
+  fprintf(output, "dispatch,num_data_reactors,trials,avg_us,mb_per_s\r\n");
+
+  for (int dispatch = 0; dispatch < NUM_DATA_DISPATCHES; dispatch++) {
+    block_set_data_dispatch(dispatch);
+    for (uint32_t n = 1; n <= reactor_layout.num_data; n++) {
+      block_set_active_data_reactors(n);
+
+      double avg_us = 0.;
+      for (int trial = 0; trial < num_trials; trial++) {
+        MEASURE_USEC(
+          elapsed_us, benchmark_raw_write_dispatched(fs, block, num_blocks));
+        avg_us += elapsed_us / (double) num_trials;
+      }
+
+      double mb = (double) num_blocks * BLOCK_SIZE / (1024. * 1024.);
+      fprintf(
+        output,
+        "%s,%u,%d,%.6f,%.6f\r\n",
+        block_data_dispatch_name(dispatch),
+        n,
+        num_trials,
+        avg_us,
+        mb / (avg_us / 1e6)
+      );
+    }
+  }
+
+  block_set_data_dispatch(old_dispatch);
+  block_set_active_data_reactors(old_active);
+  block_cache_set_mode(fs->sb, old_mode);
+}
@@ -5,88 +5,207 @@
 
 #include "bitmap.h"
 #include <assert.h>
+#include <endian.h>
 #include <errno.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include "testfs.h"
 
 /*
- * It would be a lot more efficient on most platforms to use u_int32_t
- * or unsigned long as the base type for holding bits. But we don't,
- * because if one uses any data type more than a single byte wide,
- * bitmap data saved on disk becomes endian-dependent, which is a
- * severe nuisance.
+ * The bits are stored as an array of bytes, since if one uses any data type
+ * more than a single byte wide, bitmap data saved on disk becomes
+ * endian-dependent, which is a severe nuisance. Bit n lives in byte n / 8 at
+ * position n % 8, so eight consecutive bytes read as a little-endian 64-bit
+ * integer hold bits 64k to 64k + 63 in order. Searches and counts work on
+ * these 64-bit chunks, and the array is padded to a whole number of chunks
+ * with bits that are always set.
+ *
+ * A summary keeps one bit per chunk that is set when the chunk is full, so a
+ * search for a free bit skips 4096 bits in use per summary word. The number of
+ * free bits is kept up to date so that it never has to be counted.
  */
 
+#define CHUNK_BITS 64
+#define CHUNK_BYTES (CHUNK_BITS / BITS_PER_WORD)
+#define CHUNK_ALLBITS (~(uint64_t)0)
+
 struct bitmap {
   u_int32_t nbits;
   WORD_TYPE *v;
+  u_int32_t nr_free;
+  u_int32_t nr_chunks;
+  // One bit per chunk, set when all bits of the chunk are set
+  uint64_t *full;
+  // No chunk below this one has a clear bit
+  u_int32_t first_free_chunk;
 };
 
+static inline uint64_t chunk_load(struct bitmap *b, u_int32_t chunk) {
+  uint64_t w;
+  memcpy(&w, b->v + chunk * CHUNK_BYTES, CHUNK_BYTES);
+  return le64toh(w);
+}
+
+static inline void summary_update(struct bitmap *b, u_int32_t chunk) {
+  uint64_t mask = (uint64_t)1 << (chunk % CHUNK_BITS);
+  if (chunk_load(b, chunk) == CHUNK_ALLBITS) {
+    b->full[chunk / CHUNK_BITS] |= mask;
+  } else {
+    b->full[chunk / CHUNK_BITS] &= ~mask;
+  }
+}
+
 /* return negative value on error */
-// takes nbits as argument, rounds it off to nearest WORD_TYPE = 8 bits.
-// zeroes the trailing bits, initializes bp with the struct bitmap -
-// which contains no of actual bits (minus the trailing bits)
-// and a char array containing all bit information
+// takes nbits as argument, rounds it up to whole 64-bit chunks and marks the
+// trailing bits in use. initializes bp with the struct bitmap - which contains
+// the no of actual bits (minus the trailing bits) and a char array containing
+// all bit information
 int bitmap_create(u_int32_t nbits, struct bitmap **bp) {
   struct bitmap *b;
-  u_int32_t words;
+  u_int32_t chunks;
 
-  // round up nbits up to 8 BITS_PER_WORD = 8
-  words = DIVROUNDUP(nbits, BITS_PER_WORD);
+  chunks = DIVROUNDUP(nbits, CHUNK_BITS);
   b = malloc(sizeof(struct bitmap));
   if (b == NULL) {
     return -ENOMEM;
   }
-  b->v = malloc(words * sizeof(WORD_TYPE));
+  b->v = malloc(chunks * CHUNK_BYTES);
   if (b->v == NULL) {
     free(b);
     return -ENOMEM;
   }
+  b->full = malloc(DIVROUNDUP(chunks, CHUNK_BITS) * sizeof(uint64_t));
+  if (b->full == NULL) {
+    free(b->v);
+    free(b);
+    return -ENOMEM;
+  }
 
-  bzero(b->v, words * sizeof(WORD_TYPE));
+  bzero(b->v, chunks * CHUNK_BYTES);
   b->nbits = nbits;
+  b->nr_chunks = chunks;
+  bitmap_rebuild(b);
+  *bp = b;
+  return 0;
+}
+
+void bitmap_rebuild(struct bitmap *b) {
+  u_int32_t i;
+  u_int32_t nr_summary = DIVROUNDUP(b->nr_chunks, CHUNK_BITS);
+  u_int32_t nr_set = 0;
 
   /* Mark any leftover bits at the end in use */
-  if (nbits / BITS_PER_WORD < words) {
-    u_int32_t j;
-    u_int32_t ix = words - 1;
-    u_int32_t overbits = nbits - ix * BITS_PER_WORD;
+  for (i = b->nbits; i < b->nr_chunks * CHUNK_BITS; i++) {
+    b->v[i / BITS_PER_WORD] |= (WORD_TYPE)1 << (i % BITS_PER_WORD);
+  }
 
-    assert(nbits / BITS_PER_WORD == words - 1);
-    assert(overbits > 0 && overbits < BITS_PER_WORD);
+  /* Summary bits past the last chunk read as full chunks */
+  bzero(b->full, nr_summary * sizeof(uint64_t));
+  for (i = b->nr_chunks; i < nr_summary * CHUNK_BITS; i++) {
+    b->full[i / CHUNK_BITS] |= (uint64_t)1 << (i % CHUNK_BITS);
+  }
 
-    for (j = overbits; j < BITS_PER_WORD; j++) {
-      b->v[ix] |= ((WORD_TYPE)1 << j);
+  for (i = 0; i < b->nr_chunks; i++) {
+    uint64_t w = chunk_load(b, i);
+    nr_set += __builtin_popcountll(w);
+    if (w == CHUNK_ALLBITS) {
+      b->full[i / CHUNK_BITS] |= (uint64_t)1 << (i % CHUNK_BITS);
     }
   }
-  *bp = b;
-  return 0;
+  b->nr_free = b->nr_chunks * CHUNK_BITS - nr_set;
+  b->first_free_chunk = 0;
 }
 
 void *bitmap_getdata(struct bitmap *b) { return b->v; }
 
+/*
+ * Returns the index of the first clear bit at or after from, or nbits if there
+ * is none.
+ */
+static u_int32_t bitmap_find_clear(struct bitmap *b, u_int32_t from) {
+  u_int32_t chunk = from / CHUNK_BITS;
+  u_int32_t s;
+  uint64_t w;
+
+  if (from >= b->nbits) {
+    return b->nbits;
+  }
+  // the rest of the chunk holding from
+  w = ~chunk_load(b, chunk) & (CHUNK_ALLBITS << (from % CHUNK_BITS));
+  if (w) {
+    return chunk * CHUNK_BITS + __builtin_ctzll(w);
+  }
+  // then the first chunk after it that the summary says is not full
+  chunk++;
+  for (s = chunk / CHUNK_BITS; s * CHUNK_BITS < b->nr_chunks; s++) {
+    w = ~b->full[s];
+    if (s == chunk / CHUNK_BITS) {
+      w &= CHUNK_ALLBITS << (chunk % CHUNK_BITS);
+    }
+    if (w) {
+      chunk = s * CHUNK_BITS + __builtin_ctzll(w);
+      w = ~chunk_load(b, chunk);
+      assert(w);
+      return chunk * CHUNK_BITS + __builtin_ctzll(w);
+    }
+  }
+  return b->nbits;
+}
+
+/*
+ * Returns the index of the first set bit in [from, limit), or limit if there
+ * is none.
+ */
+static u_int32_t bitmap_find_set(
+    struct bitmap *b, u_int32_t from, u_int32_t limit) {
+  u_int32_t chunk = from / CHUNK_BITS;
+  uint64_t w = chunk_load(b, chunk) & (CHUNK_ALLBITS << (from % CHUNK_BITS));
+
+  while (chunk * CHUNK_BITS < limit) {
+    if (w) {
+      return MIN(chunk * CHUNK_BITS + __builtin_ctzll(w), limit);
+    }
+    chunk++;
+    if (chunk >= b->nr_chunks) {
+      break;
+    }
+    w = chunk_load(b, chunk);
+  }
+  return limit;
+}
+
 /* return negative value on error */
 int bitmap_alloc(struct bitmap *b, u_int32_t *index) {
-  u_int32_t ix;
-  u_int32_t maxix = DIVROUNDUP(b->nbits, BITS_PER_WORD);
-  u_int32_t offset;
+  u_int32_t i;
 
-  for (ix = 0; ix < maxix; ix++) {
-    if (b->v[ix] != WORD_ALLBITS) {
-      for (offset = 0; offset < BITS_PER_WORD; offset++) {
-        WORD_TYPE mask = ((WORD_TYPE)1) << offset;
-        if ((b->v[ix] & mask) == 0) {
-          b->v[ix] |= mask;
-          *index = (ix * BITS_PER_WORD) + offset;
-          assert(*index < b->nbits);
-          return 0;
-        }
-      }
-      assert(0);
-    }
+  if (b->nr_free == 0) {
+    return -ENOSPC;
   }
-  return -ENOSPC;
+  i = bitmap_find_clear(b, b->first_free_chunk * CHUNK_BITS);
+  assert(i < b->nbits);
+  b->first_free_chunk = i / CHUNK_BITS;
+  bitmap_mark(b, i);
+  *index = i;
+  return 0;
+}
+
+/* return negative value on error */
+int bitmap_alloc_near(struct bitmap *b, u_int32_t goal, u_int32_t *index) {
+  u_int32_t i;
+
+  if (b->nr_free == 0) {
+    return -ENOSPC;
+  }
+  i = bitmap_find_clear(b, goal);
+  if (i >= b->nbits) {
+    // wrap around
+    i = bitmap_find_clear(b, b->first_free_chunk * CHUNK_BITS);
+  }
+  assert(i < b->nbits);
+  bitmap_mark(b, i);
+  *index = i;
+  return 0;
 }
 
 static inline void bitmap_translate(u_int32_t bitno, u_int32_t *ix,
@@ -97,6 +216,47 @@ static inline void bitmap_translate(u_int32_t bitno, u_int32_t *ix,
   *mask = ((WORD_TYPE)1) << offset;
 }
 
+/* return negative value on error */
+int bitmap_alloc_range(struct bitmap *b, u_int32_t goal, u_int32_t want,
+                       u_int32_t *start, u_int32_t *got) {
+  u_int32_t best_start = 0;
+  u_int32_t best_len = 0;
+  u_int32_t from = goal < b->nbits ? goal : 0;
+  u_int32_t pass;
+  u_int32_t i;
+
+  assert(want > 0);
+  if (b->nr_free == 0) {
+    return -ENOSPC;
+  }
+  // search [goal, nbits) first, then wrap around to [0, goal).
+  // runs do not wrap around the end.
+  for (pass = 0; pass < 2 && best_len < want; pass++) {
+    u_int32_t lo = pass == 0 ? from : 0;
+    u_int32_t hi = pass == 0 ? b->nbits : from;
+
+    for (i = bitmap_find_clear(b, lo); i < hi;) {
+      u_int32_t end = bitmap_find_set(b, i, MIN(i + want, b->nbits));
+      if (end - i > best_len) {
+        best_start = i;
+        best_len = end - i;
+        if (best_len == want) {
+          break;
+        }
+      }
+      i = bitmap_find_clear(b, end);
+    }
+  }
+  assert(best_len > 0);
+
+  for (i = best_start; i < best_start + best_len; i++) {
+    bitmap_mark(b, i);
+  }
+  *start = best_start;
+  *got = best_len;
+  return 0;
+}
+
 void bitmap_mark(struct bitmap *b, u_int32_t index) {
   u_int32_t ix;
   WORD_TYPE mask;
@@ -106,6 +266,8 @@ void bitmap_mark(struct bitmap *b, u_int32_t index) {
   assert((b->v[ix] & mask) == 0);
 
   b->v[ix] |= mask;
+  b->nr_free--;
+  summary_update(b, index / CHUNK_BITS);
 }
 
 void bitmap_unmark(struct bitmap *b, u_int32_t index) {
@@ -117,6 +279,9 @@ void bitmap_unmark(struct bitmap *b, u_int32_t index) {
   assert((b->v[ix] & mask) != 0);
 
   b->v[ix] &= ~mask;
+  b->nr_free++;
+  summary_update(b, index / CHUNK_BITS);
+  b->first_free_chunk = MIN(b->first_free_chunk, index / CHUNK_BITS);
 }
 
 int bitmap_isset(struct bitmap *b, u_int32_t index) {
@@ -128,29 +293,35 @@ int bitmap_isset(struct bitmap *b, u_int32_t index) {
 }
 
 void bitmap_destroy(struct bitmap *b) {
+  free(b->full);
   free(b->v);
   free(b);
 }
 
 /* return TRUE when equal, FALSE when not equal */
 int bitmap_equal(struct bitmap *a, struct bitmap *b) {
-  u_int32_t ix;
-  u_int32_t maxix;
-
   if (a->nbits != b->nbits) return 0;
-  maxix = DIVROUNDUP(b->nbits, BITS_PER_WORD);
-  for (ix = 0; ix < maxix; ix++) {
-    if (a->v[ix] != b->v[ix]) return 0;
-  }
-  return 1;
+  if (a->nr_free != b->nr_free) return 0;
+  // the padding bits are set in both
+  return memcmp(a->v, b->v, a->nr_chunks * CHUNK_BYTES) == 0;
 }
 
-int bitmap_nr_allocated(struct bitmap *b) {
-  int i;
-  int nr = 0;
+int bitmap_nr_allocated(struct bitmap *b) { return b->nbits - b->nr_free; }
+
+int bitmap_nr_free(struct bitmap *b) { return b->nr_free; }
+
+u_int32_t bitmap_free_extents(struct bitmap *b, u_int32_t limit,
+                              u_int32_t *largest) {
+  u_int32_t nr = 0;
+  u_int32_t i;
 
-  for (i = 0; i < b->nbits; i++) {
-    if (bitmap_isset(b, i)) nr++;
+  limit = MIN(limit, b->nbits);
+  *largest = 0;
+  for (i = bitmap_find_clear(b, 0); i < limit;) {
+    u_int32_t end = bitmap_find_set(b, i, limit);
+    *largest = MAX(*largest, end - i);
+    nr++;
+    i = bitmap_find_clear(b, end);
   }
   return nr;
 }
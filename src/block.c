@@ -1,3 +1,4 @@
+#include <immintrin.h>
 #include <unistd.h>
 #include "spdk/bdev.h"
 #include "spdk/env.h"
@@ -10,107 +11,336 @@
 #include "testfs.h"
 #include "device.h"
 #include "block.h"
+#include "block_request.h"
+#include "cache.h"
+#include "dma_buf.h"
+#include "io_sched.h"
 #include "logging.h"
 
 #include "spdk/event.h"
 
 static char zero[BLOCK_SIZE] = {0};
 
-struct rw_request {
-  struct spdk_bdev_desc *bdev_desc;
-  struct spdk_io_channel *io_channel;
+// How often the flusher checks whether a pass is due
+#define FLUSHER_POLL_PERIOD_US 1000
 
-  char *buf;
-  size_t start;
-  size_t nr;
+// Number of request objects preallocated for each reactor. A submitter that
+// finds the pool empty waits for in-flight requests to complete.
+#define REQUEST_POOL_SIZE 2048
+#define REQUEST_POOL_CACHE_SIZE 64
+
+static size_t max_outstanding = BLOCK_DEFAULT_MAX_OUTSTANDING;
+static enum sync_route sync_route = SYNC_ROUTE_DATA;
+
+static const char *sync_route_names[] = {"data", "metadata", "least"};
+
+static enum data_dispatch data_dispatch = DATA_DISPATCH_LBA_HASH;
+static uint32_t num_active_data = 0;
+static uint32_t next_data_reactor = 0;
+
+static const char *data_dispatch_names[] = {"rr", "hash", "least"};
 
-  uint32_t reactor_id;
-  struct future *f;
+static struct dirty_limits dirty_limits = {
+  .background_percent = BLOCK_DEFAULT_DIRTY_BACKGROUND_PERCENT,
+  .limit_percent = BLOCK_DEFAULT_DIRTY_LIMIT_PERCENT,
+  .interval_ms = BLOCK_DEFAULT_FLUSH_INTERVAL_MS,
+  .sync_on_commit = false,
 };
 
-struct r_request {
-  struct rw_request common;
-  char *destination;
+// Who is writing back dirty blocks. Only one writer-back runs at a time, so a
+// block is never written by two requests that the device could reorder.
+enum flusher_state {
+  FLUSHER_IDLE,
+  // The background flusher is running a pass
+  FLUSHER_RUNNING,
+  // block_cache_sync() is running
+  FLUSHER_SYNCING,
+  FLUSHER_STOPPED,
 };
 
-static void reactor_read_complete(
-    struct spdk_bdev_io *bdev_io, bool success, void *cb_arg) {
-  struct r_request *req = cb_arg;
-  spdk_bdev_free_io(bdev_io);
-  // NOTE: It's important that this memcpy occurs before we increment the counter
-  memcpy(req->destination, req->common.buf, req->common.nr * BLOCK_SIZE);
-  __sync_synchronize();
-  req->common.f->counts[req->common.reactor_id] += 1;
-  spdk_dma_free(req->common.buf);
-  free(req);
-}
-
-static void reactor_read(void *arg) {
-  struct r_request *req = arg;
-  spdk_bdev_read_blocks(
-    req->common.bdev_desc,
-    req->common.io_channel,
-    req->common.buf,
-    req->common.start,
-    req->common.nr,
-    reactor_read_complete,
-    req
+// Background flusher. Its poller and continuations run on the metadata
+// reactor.
+struct flusher {
+  struct filesystem *fs;
+  struct spdk_poller *poller;
+  volatile int state;
+  uint64_t last_pass_ticks;
+
+  // The current round of the pass
+  size_t block_nrs[CACHE_WRITEBACK_BATCH];
+  size_t nr;
+  size_t next_block_nr;
+  struct future f;
+
+  uint64_t nr_passes;
+  volatile uint64_t nr_throttled;
+};
+
+static struct flusher flusher = {.state = FLUSHER_IDLE};
+
+static void release_request_buf(struct rw_request *req) {
+  if (req->owns_buf) {
+    dma_buf_put(req->buf);
+  }
+}
+
+int block_request_pool_init(
+    struct reactor_context *reactor, uint32_t reactor_id) {
+  char name[64];
+  snprintf(name, sizeof(name), "testfs_req_%u", reactor_id);
+  reactor->request_pool = spdk_mempool_create(
+    name,
+    REQUEST_POOL_SIZE,
+    sizeof(struct rw_request),
+    REQUEST_POOL_CACHE_SIZE,
+    SPDK_ENV_SOCKET_ID_ANY
   );
+  if (reactor->request_pool == NULL) {
+    LOG("spdk_mempool_create() failed for %s\n", name);
+    return -ENOMEM;
+  }
+  reactor->nr_submitted = 0;
+  reactor->nr_completed = 0;
+  return 0;
+}
+
+void block_request_pool_destroy(struct reactor_context *reactor) {
+  if (reactor->request_pool != NULL) {
+    spdk_mempool_free(reactor->request_pool);
+    reactor->request_pool = NULL;
+  }
+}
+
+// Returns NULL if the pool is empty and the caller is the target reactor
+// itself, which would otherwise wait for completions that only it can reap.
+//
+// NOTE: Requests are always taken from the target reactor's pool by the
+//       submitting reactor and put back by the target reactor when the I/O
+//       completes. The mempool's per-lcore caches keep both sides lock-free in
+//       the common case and its shared ring acts as the cross-reactor return
+//       queue.
+static void *get_request(struct filesystem *fs, uint32_t reactor_id) {
+  struct reactor_context *reactor = &(fs->reactors[reactor_id]);
+  struct spdk_mempool *pool = reactor->request_pool;
+  struct rw_request *req;
+
+  // Throttle the submitter while the reactor has too much outstanding work
+  //
+  // NOTE: A reactor submitting to itself is never throttled, as it would wait
+  //       for completions that only it can reap
+  while (reactor->nr_submitted - reactor->nr_completed >= max_outstanding &&
+         spdk_env_get_current_core() != reactor->lcore) {
+    flush_requests();
+  }
+  while ((req = spdk_mempool_get(pool)) == NULL) {
+    if (spdk_env_get_current_core() == reactor->lcore) {
+      // Only this reactor can return requests to its pool
+      return NULL;
+    }
+    // All requests are in flight - wait for the target reactor to return some
+    flush_requests();
+  }
+  __sync_fetch_and_add(&(reactor->nr_submitted), 1);
+  req->pool = pool;
+  req->reactor = reactor;
+  return req;
+}
+
+static void put_request(struct rw_request *req) {
+  spdk_mempool_put(req->pool, req);
+}
+
+// Fails an I/O for which no request could be taken without blocking
+static void fail_no_request(struct future *f) {
+  future_expect(f);
+  future_complete(f, -EAGAIN);
+}
+
+static void gather_to_buf(char *buf, const struct iovec *iov, int iovcnt) {
+  for (int i = 0; i < iovcnt; i++) {
+    memcpy(buf, iov[i].iov_base, iov[i].iov_len);
+    buf += iov[i].iov_len;
+  }
+}
+
+static void scatter_from_buf(const struct iovec *iov, int iovcnt, char *buf) {
+  for (int i = 0; i < iovcnt; i++) {
+    memcpy(iov[i].iov_base, buf, iov[i].iov_len);
+    buf += iov[i].iov_len;
+  }
 }
 
-static void reactor_write_complete(
-    struct spdk_bdev_io *bdev_io, bool success, void *cb_arg) {
-  struct rw_request *req = cb_arg;
-  spdk_bdev_free_io(bdev_io);
-  req->f->counts[req->reactor_id] += 1;
-  spdk_dma_free(req->buf);
-  free(req);
+// Makes a completed read reflect the block cache: blocks whose latest version
+// is still only in the cache are copied over the data read from the device,
+// and the blocks read are added to the cache
+static void complete_cached_read(struct rw_request *req, bool success) {
+  struct iovec dest;
+  const struct iovec *iov = req->iov;
+  int iovcnt = req->iovcnt;
+  // The whole blocks read, if they are in one buffer. For vectored reads
+  // through a bounce buffer, the caller may only receive parts of them.
+  const char *data = req->buf;
+
+  if (req->destination != NULL || (req->buf != NULL && req->iovcnt == 0)) {
+    dest.iov_base = req->destination != NULL ? req->destination : req->buf;
+    dest.iov_len = req->nr * BLOCK_SIZE;
+    iov = &dest;
+    iovcnt = 1;
+  }
+  if (data == NULL && iovcnt == 1) {
+    data = iov->iov_base;
+  }
+  if (success && data != NULL) {
+    cache_fill(
+      req->cache, data, req->start, req->nr, req->cache_epoch, req->readahead);
+  }
+  cache_overlay(req->cache, iov, iovcnt, req->start, req->nr);
+}
+
+void block_request_complete(struct rw_request *req, bool success) {
+  // NOTE: It's important that this memcpy occurs before we increment the counter
+  if (!req->is_write) {
+    if (req->destination != NULL) {
+      memcpy(req->destination, req->buf, req->nr * BLOCK_SIZE);
+    } else if (req->buf != NULL && req->iovcnt > 0) {
+      scatter_from_buf(req->iov, req->iovcnt, req->buf);
+    }
+    if (req->cache != NULL) {
+      complete_cached_read(req, success);
+    }
+  }
+  release_request_buf(req);
+
+  struct future *f = req->f;
+  req->reactor->nr_completed++;
+  put_request(req);
+  future_complete(f, success ? 0 : -EIO);
 }
 
-static void reactor_write(void *arg) {
+// Runs on the target reactor
+static void reactor_submit(void *arg) {
   struct rw_request *req = arg;
-  spdk_bdev_write_blocks(
-    req->bdev_desc,
-    req->io_channel,
-    req->buf,
-    req->start,
-    req->nr,
-    reactor_write_complete,
-    req
-  );
+  io_sched_enqueue(req->sched, req);
+}
+
+static void submit_request(
+    struct filesystem *fs, uint32_t reactor_id, struct rw_request *request) {
+  uint32_t lcore = fs->reactors[reactor_id].lcore;
+
+  // NOTE: A reactor submitting to itself already owns the io_channel, so the
+  //       request goes straight into its scheduler without an event hop
+  if (spdk_env_get_current_core() == lcore) {
+    io_sched_enqueue(request->sched, request);
+    return;
+  }
+  send_request_batched(lcore, reactor_submit, request);
+}
+
+static uint64_t reactor_outstanding(struct reactor_context *reactor) {
+  return reactor->nr_submitted - reactor->nr_completed;
+}
+
+// Picks the reactor a synchronous request is sent to.
+//
+// NOTE: The main reactor is never used. The REPL runs inside a single event on
+//       it, so its bdev poller cannot reap completions while the caller waits.
+//       For the same reason a reactor never routes a synchronous request to
+//       itself.
+static uint32_t sync_reactor(struct super_block *sb, int block_nr) {
+  struct reactor_context *reactors = sb->fs->reactors;
+  uint32_t current = spdk_env_get_current_core();
+  uint32_t best;
+
+  switch (sync_route) {
+    case SYNC_ROUTE_METADATA:
+      best = block_metadata_reactor(block_nr);
+      break;
+    case SYNC_ROUTE_LEAST_OUTSTANDING:
+      best = METADATA_REACTOR;
+      for (uint32_t i = METADATA_REACTOR + 1; i < NUM_REACTORS; i++) {
+        if (reactor_outstanding(&reactors[i]) <
+            reactor_outstanding(&reactors[best])) {
+          best = i;
+        }
+      }
+      break;
+    default:
+      best = DATA_REACTOR;
+      break;
+  }
+
+  if (reactors[best].lcore == current) {
+    best = best == DATA_REACTOR ?
+      block_metadata_reactor(block_nr) : DATA_REACTOR;
+  }
+  return best;
 }
 
-void fill_request_common(
+static void fill_request_common(
   struct rw_request *request,
-  struct super_block *sb,
+  struct filesystem *fs,
   uint32_t reactor_id,
   struct future *f,
+  bool is_write,
   size_t start,
   size_t nr
 ) {
-  request->bdev_desc = sb->fs->bdev_ctx.bdev_desc;
-  request->io_channel = sb->fs->reactors[reactor_id].io_channel;
+  request->bdev_desc = fs->bdev_ctx.bdev_desc;
+  request->io_channel = fs->reactors[reactor_id].io_channel;
+  request->sched = fs->reactors[reactor_id].sched;
 
+  request->is_write = is_write;
   request->start = start;
   request->nr = nr;
-  request->buf =
-    spdk_dma_zmalloc(nr * BLOCK_SIZE, sb->fs->bdev_ctx.buf_align, NULL);
-  if (!request->buf) {
-    LOG("spdk_dma_zmalloc() failed!\n");
-  }
+  request->buf = NULL;
+  request->owns_buf = false;
+  request->destination = NULL;
+  request->iovcnt = 0;
 
   request->reactor_id = reactor_id;
   request->f = f;
+
+  request->cache = NULL;
+  request->readahead = false;
+  if (!is_write) {
+    request->cache = fs->cache;
+    request->cache_epoch = cache_get_epoch(fs->cache);
+  }
 }
 
-void read_blocks(struct super_block *sb, char *blocks, int start, int nr) {
+static void fill_request_bounce_buf(
+    struct rw_request *request, struct super_block *sb) {
+  // NOTE: The pooled buffer is not zeroed; reads overwrite it entirely and
+  //       writes copy the caller's data over it
+  request->buf = dma_buf_get(
+    &(sb->fs->reactors[request->reactor_id].dma_bufs), request->nr);
+  request->owns_buf = true;
+  if (!request->buf) {
+    LOG("dma_buf_get() failed!\n");
+  }
+}
+
+static void fill_request_iov(
+  struct rw_request *request,
+  const struct iovec *iov,
+  int iovcnt,
+  size_t nr
+) {
+  size_t len = 0;
+  assert(iovcnt > 0 && iovcnt <= BLOCK_MAX_IOVS);
+  for (int i = 0; i < iovcnt; i++) {
+    request->iov[i] = iov[i];
+    len += iov[i].iov_len;
+  }
+  assert(len == nr * BLOCK_SIZE);
+  request->iovcnt = iovcnt;
+}
+
+int read_blocks(struct super_block *sb, char *blocks, int start, int nr) {
   struct future f;
   future_init(&f);
-  // NOTE: We use the data reactor by default for synchronous reads. We cannot
-  //       use the main reactor because this function is called on the main
-  //       reactor.
-  read_blocks_async(sb, DATA_REACTOR, &f, blocks, start, nr);
-  spin_wait(&f);
+  read_blocks_async(sb, sync_reactor(sb, start), &f, blocks, start, nr);
+  return testfs_tx_wait(sb, &f);
 }
 
 void read_blocks_async(
@@ -121,21 +351,124 @@ void read_blocks_async(
   int start,
   int nr
 ) {
-  struct r_request *request = malloc(sizeof(struct r_request));
-  fill_request_common(&(request->common), sb, reactor_id, f, start, nr);
+  struct iovec iov = {.iov_base = blocks, .iov_len = nr * BLOCK_SIZE};
+  if (cache_read(sb->fs->cache, &iov, 1, start, nr)) {
+    return;
+  }
+
+  struct rw_request *request = get_request(sb->fs, reactor_id);
+  if (request == NULL) {
+    fail_no_request(f);
+    return;
+  }
+  fill_request_common(request, sb->fs, reactor_id, f, false, start, nr);
+  fill_request_bounce_buf(request, sb);
   request->destination = blocks;
-  f->expected_counts[reactor_id] += 1;
-  send_request(sb->fs->reactors[reactor_id].lcore, reactor_read, request);
+  future_expect(f);
+  submit_request(sb->fs, reactor_id, request);
+}
+
+void read_blocks_async_dma(
+  struct super_block *sb,
+  uint32_t reactor_id,
+  struct future *f,
+  char *dma_blocks,
+  int start,
+  int nr
+) {
+  struct rw_request *request = get_request(sb->fs, reactor_id);
+  if (request == NULL) {
+    fail_no_request(f);
+    return;
+  }
+  fill_request_common(request, sb->fs, reactor_id, f, false, start, nr);
+  request->buf = dma_blocks;
+  request->destination = NULL;
+  future_expect(f);
+  submit_request(sb->fs, reactor_id, request);
+}
+
+static size_t dirty_blocks(struct block_cache *cache, unsigned int percent) {
+  struct cache_stats stats;
+  cache_get_stats(cache, &stats);
+  return stats.capacity * percent / 100;
+}
+
+// Offers a write to the block cache. Returns true if the cache absorbed it and
+// the write must not be sent to the device.
+//
+// Returns whether the caller runs on one of the metadata reactors, which
+// complete the cache's writebacks and thus cannot wait for them
+static bool on_metadata_reactor(struct filesystem *fs) {
+  uint32_t current = spdk_env_get_current_core();
+
+  for (uint32_t i = METADATA_REACTOR; i < DATA_REACTOR; i++) {
+    if (fs->reactors[i].lcore == current) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// NOTE: A writer that finds the dirty limit exceeded writes the dirty blocks
+//       back itself before its write is absorbed, so dirty data cannot grow
+//       faster than the device takes it. The metadata reactors cannot wait
+//       for their own writes; there the write goes to the device once the
+//       cache has no room left.
+static bool cache_absorb_write(
+  struct super_block *sb,
+  const struct iovec *iov,
+  int iovcnt,
+  int start,
+  int nr
+) {
+  struct block_cache *cache = sb->fs->cache;
+  bool can_wait = !on_metadata_reactor(sb->fs);
+
+  if (cache_get_mode(cache) == CACHE_MODE_WRITE_BACK &&
+      cache_nr_dirty(cache) >= dirty_blocks(cache, dirty_limits.limit_percent) &&
+      can_wait) {
+    __sync_fetch_and_add(&flusher.nr_throttled, 1);
+    block_cache_sync(sb);
+  }
+  if (cache_write(cache, iov, iovcnt, start, nr)) {
+    return true;
+  }
+  // Let an older copy of the blocks that is being written back reach the
+  // device first. The metadata reactors complete those writes themselves and
+  // cannot wait; the cache keeps such blocks dirty so they are written again.
+  if (can_wait) {
+    while (cache_writeback_pending(cache, start, nr)) {
+      flush_requests();
+    }
+  }
+  return false;
 }
 
-void write_blocks(struct super_block *sb, char *blocks, int start, int nr) {
+void readahead_blocks_async(
+  struct super_block *sb,
+  uint32_t reactor_id,
+  struct future *f,
+  int start,
+  int nr
+) {
+  struct rw_request *request = get_request(sb->fs, reactor_id);
+  if (request == NULL) {
+    fail_no_request(f);
+    return;
+  }
+  fill_request_common(request, sb->fs, reactor_id, f, false, start, nr);
+  fill_request_bounce_buf(request, sb);
+  request->readahead = true;
+  future_expect(f);
+  submit_request(sb->fs, reactor_id, request);
+}
+
+int write_blocks(struct super_block *sb, char *blocks, int start, int nr) {
   struct future f;
   future_init(&f);
-  // NOTE: We use the data reactor by default for synchronous writes. We cannot
-  //       use the main reactor because this function is called on the main
-  //       reactor.
-  write_blocks_async(sb, DATA_REACTOR, &f, blocks, start, nr);
-  spin_wait(&f);
+  write_blocks_async(sb, sync_reactor(sb, start), &f, blocks, start, nr);
+  return testfs_tx_wait(sb, &f);
 }
 
 void write_blocks_async(
@@ -146,11 +479,167 @@ void write_blocks_async(
   int start,
   int nr
 ) {
-  struct rw_request *request = malloc(sizeof(struct rw_request));
-  fill_request_common(request, sb, reactor_id, f, start, nr);
+  struct iovec iov = {.iov_base = blocks, .iov_len = nr * BLOCK_SIZE};
+  if (cache_absorb_write(sb, &iov, 1, start, nr)) {
+    return;
+  }
+
+  struct rw_request *request = get_request(sb->fs, reactor_id);
+  if (request == NULL) {
+    fail_no_request(f);
+    return;
+  }
+  fill_request_common(request, sb->fs, reactor_id, f, true, start, nr);
+  fill_request_bounce_buf(request, sb);
   memcpy(request->buf, blocks, nr * BLOCK_SIZE);
-  f->expected_counts[reactor_id] += 1;
-  send_request(sb->fs->reactors[reactor_id].lcore, reactor_write, request);
+  future_expect(f);
+  submit_request(sb->fs, reactor_id, request);
+}
+
+static void submit_write_dma(
+  struct filesystem *fs,
+  uint32_t reactor_id,
+  struct future *f,
+  char *dma_blocks,
+  int start,
+  int nr,
+  bool owns_buf
+) {
+  struct rw_request *request = get_request(fs, reactor_id);
+  if (request == NULL) {
+    if (owns_buf) {
+      dma_buf_put(dma_blocks);
+    }
+    fail_no_request(f);
+    return;
+  }
+  fill_request_common(request, fs, reactor_id, f, true, start, nr);
+  request->buf = dma_blocks;
+  request->owns_buf = owns_buf;
+  future_expect(f);
+  submit_request(fs, reactor_id, request);
+}
+
+void write_blocks_async_dma(
+  struct super_block *sb,
+  uint32_t reactor_id,
+  struct future *f,
+  char *dma_blocks,
+  int start,
+  int nr
+) {
+  struct iovec iov = {.iov_base = dma_blocks, .iov_len = nr * BLOCK_SIZE};
+  if (cache_absorb_write(sb, &iov, 1, start, nr)) {
+    return;
+  }
+  submit_write_dma(sb->fs, reactor_id, f, dma_blocks, start, nr, false);
+}
+
+char *alloc_dma_blocks(struct super_block *sb, uint32_t reactor_id, int nr) {
+  return dma_buf_get(&(sb->fs->reactors[reactor_id].dma_bufs), nr);
+}
+
+void free_dma_blocks(char *dma_blocks) {
+  dma_buf_put(dma_blocks);
+}
+
+void readv_blocks_async(
+  struct super_block *sb,
+  uint32_t reactor_id,
+  struct future *f,
+  const struct iovec *iov,
+  int iovcnt,
+  int start,
+  int nr
+) {
+  if (cache_read(sb->fs->cache, iov, iovcnt, start, nr)) {
+    return;
+  }
+
+  struct rw_request *request = get_request(sb->fs, reactor_id);
+  if (request == NULL) {
+    fail_no_request(f);
+    return;
+  }
+  fill_request_common(request, sb->fs, reactor_id, f, false, start, nr);
+  fill_request_bounce_buf(request, sb);
+  fill_request_iov(request, iov, iovcnt, nr);
+  request->destination = NULL;
+  future_expect(f);
+  submit_request(sb->fs, reactor_id, request);
+}
+
+void writev_blocks_async(
+  struct super_block *sb,
+  uint32_t reactor_id,
+  struct future *f,
+  const struct iovec *iov,
+  int iovcnt,
+  int start,
+  int nr
+) {
+  if (cache_absorb_write(sb, iov, iovcnt, start, nr)) {
+    return;
+  }
+
+  struct rw_request *request = get_request(sb->fs, reactor_id);
+  if (request == NULL) {
+    fail_no_request(f);
+    return;
+  }
+  fill_request_common(request, sb->fs, reactor_id, f, true, start, nr);
+  fill_request_bounce_buf(request, sb);
+  assert(iovcnt > 0);
+  // NOTE: The caller's vector only needs to stay valid until we return, so we
+  //       gather it into the bounce buffer right away
+  gather_to_buf(request->buf, iov, iovcnt);
+  future_expect(f);
+  submit_request(sb->fs, reactor_id, request);
+}
+
+void readv_blocks_async_dma(
+  struct super_block *sb,
+  uint32_t reactor_id,
+  struct future *f,
+  const struct iovec *dma_iov,
+  int iovcnt,
+  int start,
+  int nr
+) {
+  struct rw_request *request = get_request(sb->fs, reactor_id);
+  if (request == NULL) {
+    fail_no_request(f);
+    return;
+  }
+  fill_request_common(request, sb->fs, reactor_id, f, false, start, nr);
+  fill_request_iov(request, dma_iov, iovcnt, nr);
+  request->destination = NULL;
+  future_expect(f);
+  submit_request(sb->fs, reactor_id, request);
+}
+
+void writev_blocks_async_dma(
+  struct super_block *sb,
+  uint32_t reactor_id,
+  struct future *f,
+  const struct iovec *dma_iov,
+  int iovcnt,
+  int start,
+  int nr
+) {
+  if (cache_absorb_write(sb, dma_iov, iovcnt, start, nr)) {
+    return;
+  }
+
+  struct rw_request *request = get_request(sb->fs, reactor_id);
+  if (request == NULL) {
+    fail_no_request(f);
+    return;
+  }
+  fill_request_common(request, sb->fs, reactor_id, f, true, start, nr);
+  fill_request_iov(request, dma_iov, iovcnt, nr);
+  future_expect(f);
+  submit_request(sb->fs, reactor_id, request);
 }
 
 void zero_blocks(struct super_block *sb, int start, int nr) {
@@ -160,3 +649,391 @@ void zero_blocks(struct super_block *sb, int start, int nr) {
     write_blocks(sb, zero, start + i, 1);
   }
 }
+
+// Writes the given blocks, which are being written back, with one request per
+// run of consecutive blocks, spread over the metadata reactors. Returns
+// -ENOMEM if a buffer could not be allocated; the runs before it are still
+// written.
+static int submit_writeback(
+  struct filesystem *fs,
+  struct future *f,
+  const size_t block_nrs[],
+  size_t nr
+) {
+  size_t run_start = 0;
+
+  for (size_t i = 1; i <= nr; i++) {
+    if (i < nr && block_nrs[i] == block_nrs[i - 1] + 1) {
+      continue;
+    }
+    size_t run_nr = i - run_start;
+    uint32_t reactor_id = block_metadata_reactor(block_nrs[run_start]);
+    char *buf = dma_buf_get(&(fs->reactors[reactor_id].dma_bufs), run_nr);
+    if (buf == NULL) {
+      return -ENOMEM;
+    }
+    cache_copy_out(fs->cache, buf, block_nrs[run_start], run_nr);
+    submit_write_dma(
+      fs, reactor_id, f, buf, block_nrs[run_start], run_nr, true);
+    run_start = i;
+  }
+  return 0;
+}
+
+static void flusher_round(void);
+
+static void flusher_end_pass(void) {
+  flusher.last_pass_ticks = spdk_get_ticks();
+  __sync_synchronize();
+  flusher.state = FLUSHER_IDLE;
+}
+
+static void flusher_round_done(struct future *f, void *arg) {
+  cache_end_writeback(
+    flusher.fs->cache, flusher.block_nrs, flusher.nr, f->status == 0);
+  if (f->status < 0) {
+    // The blocks are dirty again and are retried on a later pass
+    flusher_end_pass();
+    return;
+  }
+  flusher.next_block_nr = flusher.block_nrs[flusher.nr - 1] + 1;
+  flusher_round();
+}
+
+// Starts writing back the next batch of dirty blocks of the pass in LBA order,
+// or ends the pass
+static void flusher_round(void) {
+  struct filesystem *fs = flusher.fs;
+
+  flusher.nr = cache_start_writeback(
+    fs->cache, flusher.next_block_nr, flusher.block_nrs, CACHE_WRITEBACK_BATCH);
+  if (flusher.nr == 0) {
+    flusher_end_pass();
+    return;
+  }
+
+  future_init(&flusher.f);
+  if (submit_writeback(fs, &flusher.f, flusher.block_nrs, flusher.nr) < 0) {
+    future_expect(&flusher.f);
+    future_complete(&flusher.f, -ENOMEM);
+  }
+  future_then(
+    &flusher.f, fs->reactors[METADATA_REACTOR].lcore, flusher_round_done, NULL);
+}
+
+static bool flusher_due(struct block_cache *cache, uint64_t now) {
+  size_t nr_dirty = cache_nr_dirty(cache);
+
+  if (nr_dirty == 0) {
+    return false;
+  }
+  if (nr_dirty >= dirty_blocks(cache, dirty_limits.background_percent)) {
+    return true;
+  }
+  return dirty_limits.interval_ms > 0 &&
+    now - flusher.last_pass_ticks >=
+      dirty_limits.interval_ms * spdk_get_ticks_hz() / 1000;
+}
+
+static int flusher_poll(void *arg) {
+  struct reactor_context *reactors = flusher.fs->reactors;
+  uint64_t now = spdk_get_ticks();
+  uint64_t outstanding = 0;
+
+  if (flusher.state == FLUSHER_STOPPED) {
+    spdk_poller_unregister(&flusher.poller);
+    return 0;
+  }
+  if (cache_nr_dirty(flusher.fs->cache) == 0) {
+    flusher.last_pass_ticks = now;
+    return 0;
+  }
+  // Leave room for foreground requests to the busiest metadata reactor
+  for (uint32_t i = METADATA_REACTOR; i < DATA_REACTOR; i++) {
+    outstanding = MAX(outstanding, reactor_outstanding(&reactors[i]));
+  }
+  if (!flusher_due(flusher.fs->cache, now) ||
+      outstanding + CACHE_WRITEBACK_BATCH > max_outstanding) {
+    return 0;
+  }
+  if (!__sync_bool_compare_and_swap(
+        &flusher.state, FLUSHER_IDLE, FLUSHER_RUNNING)) {
+    return 0;
+  }
+
+  flusher.next_block_nr = 0;
+  flusher.nr_passes++;
+  flusher_round();
+  return 1;
+}
+
+// Runs on the metadata reactor
+static void flusher_register(void *arg) {
+  flusher.last_pass_ticks = spdk_get_ticks();
+  flusher.poller =
+    spdk_poller_register(flusher_poll, NULL, FLUSHER_POLL_PERIOD_US);
+  if (flusher.poller == NULL) {
+    LOG("Could not register the block cache flusher\n");
+  }
+}
+
+void block_flusher_start(struct filesystem *fs) {
+  flusher.fs = fs;
+  flusher.state = FLUSHER_IDLE;
+  send_request(fs->reactors[METADATA_REACTOR].lcore, flusher_register, NULL);
+}
+
+void block_flusher_stop(struct filesystem *fs) {
+  // NOTE: The poller unregisters itself once it observes the stopped state
+  while (!__sync_bool_compare_and_swap(
+           &flusher.state, FLUSHER_IDLE, FLUSHER_STOPPED)) {
+    if (flusher.state == FLUSHER_STOPPED) {
+      break;
+    }
+    _mm_pause();
+  }
+}
+
+int block_cache_writeback_all(struct filesystem *fs) {
+  size_t block_nrs[CACHE_WRITEBACK_BATCH];
+  size_t next_block_nr = 0;
+  size_t nr;
+  int ret = 0;
+
+  // Wait for a pass of the background flusher to finish
+  while (!__sync_bool_compare_and_swap(
+           &flusher.state, FLUSHER_IDLE, FLUSHER_SYNCING)) {
+    if (flusher.state == FLUSHER_STOPPED) {
+      break;
+    }
+    _mm_pause();
+  }
+
+  // NOTE: Only blocks that were dirty when a batch is collected are written,
+  //       so a concurrent writer cannot keep this loop running forever
+  while ((nr = cache_start_writeback(
+            fs->cache, next_block_nr, block_nrs, CACHE_WRITEBACK_BATCH)) > 0) {
+    struct future f;
+    future_init(&f);
+    int submit_ret = submit_writeback(fs, &f, block_nrs, nr);
+    int status = spin_wait(&f);
+    if (status == 0) {
+      status = submit_ret;
+    }
+    cache_end_writeback(fs->cache, block_nrs, nr, status == 0);
+    if (status < 0) {
+      ret = status;
+      break;
+    }
+    next_block_nr = block_nrs[nr - 1] + 1;
+  }
+
+  __sync_bool_compare_and_swap(&flusher.state, FLUSHER_SYNCING, FLUSHER_IDLE);
+  return ret;
+}
+
+int block_cache_sync(struct super_block *sb) {
+  int ret = block_cache_writeback_all(sb->fs);
+  if (ret < 0 && sb->tx_status == 0) {
+    sb->tx_status = ret;
+  }
+  return ret;
+}
+
+void block_set_dirty_limits(const struct dirty_limits *limits) {
+  dirty_limits = *limits;
+  if (dirty_limits.limit_percent > 100) {
+    dirty_limits.limit_percent = 100;
+  }
+  if (dirty_limits.background_percent > dirty_limits.limit_percent) {
+    dirty_limits.background_percent = dirty_limits.limit_percent;
+  }
+}
+
+void block_get_dirty_limits(struct dirty_limits *limits) {
+  *limits = dirty_limits;
+}
+
+int block_cache_set_mode(struct super_block *sb, enum cache_mode mode) {
+  if (mode != CACHE_MODE_WRITE_BACK) {
+    int ret = block_cache_sync(sb);
+    if (ret < 0) {
+      // Dirty blocks are left, which only a write-back cache may hold
+      return ret;
+    }
+  }
+  cache_set_mode(sb->fs->cache, mode);
+  return 0;
+}
+
+void block_set_max_outstanding(size_t max) {
+  max_outstanding = max > 0 ? max : 1;
+}
+
+size_t block_get_max_outstanding(void) {
+  return max_outstanding;
+}
+
+void block_set_sync_route(enum sync_route route) {
+  sync_route = route;
+}
+
+enum sync_route block_get_sync_route(void) {
+  return sync_route;
+}
+
+int block_parse_sync_route(const char *name, enum sync_route *route) {
+  for (size_t i = 0; i < NUM_SYNC_ROUTES; i++) {
+    if (strcmp(name, sync_route_names[i]) == 0) {
+      *route = i;
+      return 0;
+    }
+  }
+  return -EINVAL;
+}
+
+const char *block_sync_route_name(enum sync_route route) {
+  return sync_route_names[route];
+}
+
+uint32_t block_get_active_data_reactors(void) {
+  if (num_active_data == 0 || num_active_data > reactor_layout.num_data) {
+    return reactor_layout.num_data;
+  }
+  return num_active_data;
+}
+
+void block_set_active_data_reactors(uint32_t num_data) {
+  num_active_data = num_data;
+}
+
+uint32_t block_data_reactor(struct super_block *sb, int block_nr) {
+  struct reactor_context *reactors = sb->fs->reactors;
+  uint32_t num_data = block_get_active_data_reactors();
+  uint32_t best;
+
+  switch (data_dispatch) {
+    case DATA_DISPATCH_ROUND_ROBIN:
+      return DATA_REACTOR +
+        __sync_fetch_and_add(&next_data_reactor, 1) % num_data;
+    case DATA_DISPATCH_LEAST_OUTSTANDING:
+      best = DATA_REACTOR;
+      for (uint32_t i = DATA_REACTOR + 1; i < DATA_REACTOR + num_data; i++) {
+        if (reactor_outstanding(&reactors[i]) <
+            reactor_outstanding(&reactors[best])) {
+          best = i;
+        }
+      }
+      return best;
+    default:
+      return DATA_REACTOR +
+        (block_nr / DATA_DISPATCH_STRIPE_BLOCKS) % num_data;
+  }
+}
+
+uint32_t block_metadata_reactor(int block_nr) {
+  return METADATA_REACTOR +
+    (block_nr / METADATA_STRIPE_BLOCKS) % reactor_layout.num_metadata;
+}
+
+void block_set_data_dispatch(enum data_dispatch dispatch) {
+  data_dispatch = dispatch;
+}
+
+enum data_dispatch block_get_data_dispatch(void) {
+  return data_dispatch;
+}
+
+int block_parse_data_dispatch(const char *name, enum data_dispatch *dispatch) {
+  for (size_t i = 0; i < NUM_DATA_DISPATCHES; i++) {
+    if (strcmp(name, data_dispatch_names[i]) == 0) {
+      *dispatch = i;
+      return 0;
+    }
+  }
+  return -EINVAL;
+}
+
+const char *block_data_dispatch_name(enum data_dispatch dispatch) {
+  return data_dispatch_names[dispatch];
+}
+
+uint64_t block_get_nr_commands(struct filesystem *fs) {
+  uint64_t nr_commands = 0;
+  for (uint32_t i = 0; i < NUM_REACTORS; i++) {
+    struct io_sched_stats stats;
+    io_sched_get_stats(fs->reactors[i].sched, &stats);
+    nr_commands += stats.nr_commands;
+  }
+  return nr_commands;
+}
+
+void block_print_stats(struct filesystem *fs) {
+  size_t in_use[NUM_DMA_BUF_CLASSES], capacity[NUM_DMA_BUF_CLASSES];
+  struct io_sched_stats stats;
+
+  printf(
+    "reactor  requests (in use/capacity)  dma buffers per class"
+    "  submitted  device commands  enomem retries  max in flight\n");
+  for (size_t i = 0; i < NUM_REACTORS; i++) {
+    struct reactor_context *reactor = &(fs->reactors[i]);
+    printf(
+      "%7zu  %8zu/%-17d",
+      i,
+      REQUEST_POOL_SIZE - spdk_mempool_count(reactor->request_pool),
+      REQUEST_POOL_SIZE
+    );
+    dma_buf_pool_usage(&(reactor->dma_bufs), in_use, capacity);
+    for (size_t c = 0; c < NUM_DMA_BUF_CLASSES; c++) {
+      printf("  %zu/%zu", in_use[c], capacity[c]);
+    }
+    io_sched_get_stats(reactor->sched, &stats);
+    printf(
+      "  %llu  %llu  %llu  %llu/%u\n",
+      (unsigned long long) stats.nr_requests,
+      (unsigned long long) stats.nr_commands,
+      (unsigned long long) stats.nr_nomem,
+      (unsigned long long) stats.max_inflight_seen,
+      io_sched_get_max_inflight(reactor->sched)
+    );
+  }
+}
+
+void block_print_cache_stats(struct filesystem *fs) {
+  struct cache_stats stats;
+  cache_get_stats(fs->cache, &stats);
+
+  uint64_t lookups = stats.hits + stats.misses;
+  printf("mode: %s\n", cache_mode_name(cache_get_mode(fs->cache)));
+  printf(
+    "cached: %zu/%zu  dirty: %zu\n",
+    stats.nr_cached,
+    stats.capacity,
+    stats.nr_dirty
+  );
+  printf(
+    "hits: %llu  misses: %llu  hit rate: %.2f%%\n",
+    (unsigned long long) stats.hits,
+    (unsigned long long) stats.misses,
+    lookups > 0 ? 100. * stats.hits / lookups : 0.
+  );
+  printf(
+    "evictions: %llu  absorbed writes: %llu  written back: %llu\n",
+    (unsigned long long) stats.evictions,
+    (unsigned long long) stats.absorbed_writes,
+    (unsigned long long) stats.writebacks
+  );
+  printf(
+    "flusher passes: %llu  throttled writes: %llu\n",
+    (unsigned long long) flusher.nr_passes,
+    (unsigned long long) flusher.nr_throttled
+  );
+  printf(
+    "dirty limits: background %u%%  limit %u%%  interval %u ms  "
+    "sync on commit: %s\n",
+    dirty_limits.background_percent,
+    dirty_limits.limit_percent,
+    dirty_limits.interval_ms,
+    dirty_limits.sync_on_commit ? "on" : "off"
+  );
+}
@@ -0,0 +1,500 @@
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+#include "list.h"
+#include "testfs.h"
+
+struct cache_entry {
+  size_t block_nr;
+  bool valid;
+  bool dirty;
+  // Being written back - the device may not have the data yet, so the entry
+  // cannot be evicted
+  bool writeback;
+  // Inserted by read-ahead and not read since
+  bool readahead;
+  char *data;
+
+  struct hlist_node hnode;
+  // Most recently used entries are at the head of the LRU list
+  struct list_head lru;
+};
+
+struct block_cache {
+  volatile int lock;
+  enum cache_mode mode;
+
+  size_t nr_blocks;
+  unsigned int hash_bits;
+  struct hlist_head *buckets;
+  struct cache_entry *entries;
+  char *data;
+  struct list_head lru;
+  // Scratch space for cache_start_writeback(), used under the lock
+  size_t *candidates;
+
+  size_t nr_cached;
+  size_t nr_dirty;
+  // Incremented on every write, see cache_fill()
+  uint64_t epoch;
+
+  struct cache_stats stats;
+};
+
+static const char *cache_mode_names[] = {"off", "wt", "wb"};
+
+static void cache_lock(struct block_cache *cache) {
+  while (__sync_lock_test_and_set(&cache->lock, 1)) {
+    while (cache->lock) {}
+  }
+}
+
+static void cache_unlock(struct block_cache *cache) {
+  __sync_lock_release(&cache->lock);
+}
+
+static struct hlist_head *bucket(struct block_cache *cache, size_t block_nr) {
+  return &cache->buckets[hash_int((unsigned int)block_nr, cache->hash_bits)];
+}
+
+static struct cache_entry *find(struct block_cache *cache, size_t block_nr) {
+  struct hlist_node *elem;
+  struct cache_entry *entry;
+
+  hlist_for_each_entry(entry, elem, bucket(cache, block_nr), hnode) {
+    if (entry->block_nr == block_nr) {
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+static void touch(struct block_cache *cache, struct cache_entry *entry) {
+  list_del(&entry->lru);
+  list_add(&entry->lru, &cache->lru);
+}
+
+static void drop(struct block_cache *cache, struct cache_entry *entry) {
+  hlist_del(&entry->hnode);
+  entry->valid = false;
+  cache->nr_cached--;
+  list_del(&entry->lru);
+  list_add_tail(&entry->lru, &cache->lru);
+}
+
+// Returns the least recently used entry that can be reused, or NULL if every
+// entry is dirty or being written back
+static struct cache_entry *get_victim(struct block_cache *cache) {
+  struct list_head *pos;
+
+  for (pos = cache->lru.prev; pos != &cache->lru; pos = pos->prev) {
+    struct cache_entry *entry = list_entry(pos, struct cache_entry, lru);
+    if (!entry->valid) {
+      return entry;
+    }
+    if (!entry->dirty && !entry->writeback) {
+      cache->stats.evictions++;
+      if (entry->readahead) {
+        cache->stats.readahead_waste++;
+      }
+      drop(cache, entry);
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+static struct cache_entry *insert(struct block_cache *cache, size_t block_nr) {
+  struct cache_entry *entry = get_victim(cache);
+  if (entry == NULL) {
+    return NULL;
+  }
+  entry->block_nr = block_nr;
+  entry->valid = true;
+  entry->dirty = false;
+  entry->writeback = false;
+  entry->readahead = false;
+  INIT_HLIST_NODE(&entry->hnode);
+  hlist_add_head(&entry->hnode, bucket(cache, block_nr));
+  touch(cache, entry);
+  cache->nr_cached++;
+  return entry;
+}
+
+static void set_dirty(
+    struct block_cache *cache, struct cache_entry *entry, bool dirty) {
+  if (entry->dirty != dirty) {
+    cache->nr_dirty += dirty ? 1 : -1;
+    entry->dirty = dirty;
+  }
+}
+
+// Copies one block between a cache entry and the block at block_offset within
+// an I/O vector
+static void copy_iov_block(
+  const struct iovec *iov,
+  int iovcnt,
+  size_t block_offset,
+  char *block,
+  bool to_iov
+) {
+  size_t offset = block_offset * BLOCK_SIZE;
+  size_t copied = 0;
+
+  for (int i = 0; i < iovcnt && copied < BLOCK_SIZE; i++) {
+    if (offset >= iov[i].iov_len) {
+      offset -= iov[i].iov_len;
+      continue;
+    }
+    size_t len = iov[i].iov_len - offset;
+    if (len > BLOCK_SIZE - copied) {
+      len = BLOCK_SIZE - copied;
+    }
+    char *base = (char *)iov[i].iov_base + offset;
+    if (to_iov) {
+      memcpy(base, block + copied, len);
+    } else {
+      memcpy(block + copied, base, len);
+    }
+    copied += len;
+    offset = 0;
+  }
+}
+
+struct block_cache *cache_create(size_t nr_blocks) {
+  struct block_cache *cache = calloc(1, sizeof(struct block_cache));
+  if (cache == NULL) {
+    return NULL;
+  }
+
+  cache->hash_bits = 1;
+  while ((1UL << cache->hash_bits) < nr_blocks) {
+    cache->hash_bits++;
+  }
+  cache->nr_blocks = nr_blocks;
+  cache->buckets = calloc(1UL << cache->hash_bits, sizeof(struct hlist_head));
+  cache->entries = calloc(nr_blocks, sizeof(struct cache_entry));
+  cache->data = malloc(nr_blocks * BLOCK_SIZE);
+  cache->candidates = malloc(nr_blocks * sizeof(size_t));
+  if (cache->buckets == NULL || cache->entries == NULL ||
+      cache->data == NULL || cache->candidates == NULL) {
+    cache_destroy(cache);
+    return NULL;
+  }
+
+  INIT_LIST_HEAD(&cache->lru);
+  for (size_t i = 0; i < nr_blocks; i++) {
+    cache->entries[i].data = cache->data + i * BLOCK_SIZE;
+    list_add_tail(&cache->entries[i].lru, &cache->lru);
+  }
+  cache->mode = CACHE_MODE_WRITE_THROUGH;
+  cache->stats.capacity = nr_blocks;
+  return cache;
+}
+
+void cache_destroy(struct block_cache *cache) {
+  free(cache->buckets);
+  free(cache->entries);
+  free(cache->data);
+  free(cache->candidates);
+  free(cache);
+}
+
+void cache_set_mode(struct block_cache *cache, enum cache_mode mode) {
+  cache_lock(cache);
+  assert(mode == CACHE_MODE_WRITE_BACK || cache->nr_dirty == 0);
+  if (mode == CACHE_MODE_OFF) {
+    for (size_t i = 0; i < cache->nr_blocks; i++) {
+      if (cache->entries[i].valid) {
+        drop(cache, &cache->entries[i]);
+      }
+    }
+  }
+  cache->mode = mode;
+  cache_unlock(cache);
+}
+
+enum cache_mode cache_get_mode(struct block_cache *cache) {
+  return cache->mode;
+}
+
+bool cache_read(
+  struct block_cache *cache,
+  const struct iovec *iov,
+  int iovcnt,
+  size_t start,
+  size_t nr
+) {
+  struct cache_entry *entries[nr];
+
+  if (cache->mode == CACHE_MODE_OFF) {
+    return false;
+  }
+
+  cache_lock(cache);
+  for (size_t i = 0; i < nr; i++) {
+    entries[i] = find(cache, start + i);
+    if (entries[i] == NULL) {
+      cache->stats.misses += nr;
+      cache_unlock(cache);
+      return false;
+    }
+  }
+  for (size_t i = 0; i < nr; i++) {
+    copy_iov_block(iov, iovcnt, i, entries[i]->data, true);
+    touch(cache, entries[i]);
+    if (entries[i]->readahead) {
+      cache->stats.readahead_hits++;
+      entries[i]->readahead = false;
+    }
+  }
+  cache->stats.hits += nr;
+  cache_unlock(cache);
+  return true;
+}
+
+bool cache_contains(struct block_cache *cache, size_t block_nr) {
+  bool found;
+
+  if (cache->mode == CACHE_MODE_OFF) {
+    return false;
+  }
+  cache_lock(cache);
+  found = find(cache, block_nr) != NULL;
+  cache_unlock(cache);
+  return found;
+}
+
+uint64_t cache_get_epoch(struct block_cache *cache) {
+  return cache->epoch;
+}
+
+void cache_fill(
+  struct block_cache *cache,
+  const char *buf,
+  size_t start,
+  size_t nr,
+  uint64_t epoch,
+  bool readahead
+) {
+  if (cache->mode == CACHE_MODE_OFF) {
+    return;
+  }
+
+  cache_lock(cache);
+  if (cache->epoch == epoch) {
+    for (size_t i = 0; i < nr; i++) {
+      if (find(cache, start + i) != NULL) {
+        continue;
+      }
+      struct cache_entry *entry = insert(cache, start + i);
+      if (entry == NULL) {
+        break;
+      }
+      memcpy(entry->data, buf + i * BLOCK_SIZE, BLOCK_SIZE);
+      entry->readahead = readahead;
+    }
+  }
+  cache_unlock(cache);
+}
+
+void cache_overlay(
+  struct block_cache *cache,
+  const struct iovec *iov,
+  int iovcnt,
+  size_t start,
+  size_t nr
+) {
+  if (cache->mode == CACHE_MODE_OFF) {
+    return;
+  }
+
+  cache_lock(cache);
+  for (size_t i = 0; i < nr; i++) {
+    struct cache_entry *entry = find(cache, start + i);
+    if (entry != NULL) {
+      copy_iov_block(iov, iovcnt, i, entry->data, true);
+    }
+  }
+  cache_unlock(cache);
+}
+
+bool cache_write(
+  struct block_cache *cache,
+  const struct iovec *iov,
+  int iovcnt,
+  size_t start,
+  size_t nr
+) {
+  bool absorbed;
+
+  if (cache->mode == CACHE_MODE_OFF) {
+    return false;
+  }
+
+  cache_lock(cache);
+  cache->epoch++;
+  absorbed = cache->mode == CACHE_MODE_WRITE_BACK;
+  for (size_t i = 0; i < nr; i++) {
+    struct cache_entry *entry = find(cache, start + i);
+    if (entry == NULL) {
+      entry = insert(cache, start + i);
+    } else {
+      touch(cache, entry);
+    }
+    if (entry == NULL) {
+      absorbed = false;
+      continue;
+    }
+    copy_iov_block(iov, iovcnt, i, entry->data, false);
+    entry->readahead = false;
+    set_dirty(cache, entry, cache->mode == CACHE_MODE_WRITE_BACK);
+  }
+
+  if (absorbed) {
+    cache->stats.absorbed_writes += nr;
+  } else if (cache->mode == CACHE_MODE_WRITE_BACK) {
+    // The caller writes the whole range to the device, which makes the cached
+    // copies clean. A block still being written back stays dirty, as the older
+    // copy in flight may reach the device last.
+    for (size_t i = 0; i < nr; i++) {
+      struct cache_entry *entry = find(cache, start + i);
+      if (entry != NULL && !entry->writeback) {
+        set_dirty(cache, entry, false);
+      }
+    }
+  }
+  cache_unlock(cache);
+  return absorbed;
+}
+
+static int compare_block_nr(const void *p1, const void *p2) {
+  size_t a = *(const size_t *)p1;
+  size_t b = *(const size_t *)p2;
+  return a < b ? -1 : (a > b ? 1 : 0);
+}
+
+size_t cache_start_writeback(
+  struct block_cache *cache,
+  size_t min_block_nr,
+  size_t block_nrs[],
+  size_t max
+) {
+  size_t *candidates = cache->candidates;
+  size_t nr_candidates = 0;
+  size_t nr = 0;
+
+  cache_lock(cache);
+  if (cache->nr_dirty == 0) {
+    cache_unlock(cache);
+    return 0;
+  }
+
+  for (size_t i = 0; i < cache->nr_blocks; i++) {
+    struct cache_entry *entry = &cache->entries[i];
+    // NOTE: A block rewritten while it is being written back is dirty again,
+    //       but must wait for the write in flight to end
+    if (entry->valid && entry->dirty && !entry->writeback &&
+        entry->block_nr >= min_block_nr) {
+      candidates[nr_candidates++] = entry->block_nr;
+    }
+  }
+  qsort(candidates, nr_candidates, sizeof(size_t), compare_block_nr);
+
+  for (; nr < nr_candidates && nr < max; nr++) {
+    struct cache_entry *entry = find(cache, candidates[nr]);
+    set_dirty(cache, entry, false);
+    entry->writeback = true;
+    block_nrs[nr] = candidates[nr];
+  }
+  cache->stats.writebacks += nr;
+  cache_unlock(cache);
+  return nr;
+}
+
+void cache_copy_out(
+    struct block_cache *cache, char *buf, size_t start, size_t nr) {
+  cache_lock(cache);
+  for (size_t i = 0; i < nr; i++) {
+    struct cache_entry *entry = find(cache, start + i);
+    assert(entry != NULL && entry->writeback);
+    memcpy(buf + i * BLOCK_SIZE, entry->data, BLOCK_SIZE);
+  }
+  cache_unlock(cache);
+}
+
+bool cache_writeback_pending(
+    struct block_cache *cache, size_t start, size_t nr) {
+  bool pending = false;
+
+  if (cache->mode == CACHE_MODE_OFF) {
+    return false;
+  }
+
+  cache_lock(cache);
+  for (size_t i = 0; i < nr && !pending; i++) {
+    struct cache_entry *entry = find(cache, start + i);
+    pending = entry != NULL && entry->writeback;
+  }
+  cache_unlock(cache);
+  return pending;
+}
+
+void cache_end_writeback(
+  struct block_cache *cache,
+  const size_t block_nrs[],
+  size_t nr,
+  bool success
+) {
+  cache_lock(cache);
+  for (size_t i = 0; i < nr; i++) {
+    struct cache_entry *entry = find(cache, block_nrs[i]);
+    assert(entry != NULL);
+    entry->writeback = false;
+    if (!success) {
+      set_dirty(cache, entry, true);
+    }
+  }
+  cache_unlock(cache);
+}
+
+size_t cache_nr_dirty(struct block_cache *cache) {
+  return cache->nr_dirty;
+}
+
+void cache_get_stats(struct block_cache *cache, struct cache_stats *stats) {
+  cache_lock(cache);
+  *stats = cache->stats;
+  stats->nr_cached = cache->nr_cached;
+  stats->nr_dirty = cache->nr_dirty;
+  cache_unlock(cache);
+}
+
+void cache_reset_stats(struct block_cache *cache) {
+  cache_lock(cache);
+  cache->stats.hits = 0;
+  cache->stats.misses = 0;
+  cache->stats.evictions = 0;
+  cache->stats.absorbed_writes = 0;
+  cache->stats.writebacks = 0;
+  cache->stats.readahead_hits = 0;
+  cache->stats.readahead_waste = 0;
+  cache_unlock(cache);
+}
+
+int cache_parse_mode(const char *name, enum cache_mode *mode) {
+  for (size_t i = 0; i < NUM_CACHE_MODES; i++) {
+    if (strcmp(name, cache_mode_names[i]) == 0) {
+      *mode = i;
+      return 0;
+    }
+  }
+  return -EINVAL;
+}
+
+const char *cache_mode_name(enum cache_mode mode) {
+  return cache_mode_names[mode];
+}
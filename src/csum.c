@@ -31,7 +31,7 @@ static void testfs_write_csum_asnyc(
   assert(table);
   write_blocks_async(
     sb,
-    METADATA_REACTOR,
+    block_metadata_reactor(sb->sb.csum_table_start + nr),
     f,
     table + (nr * BLOCK_SIZE),
     sb->sb.csum_table_start + nr,
@@ -111,7 +111,7 @@ void testfs_flush_csum_async(struct super_block *sb, struct future *f) {
     }
     write_blocks_async(
       sb,
-      METADATA_REACTOR,
+      block_metadata_reactor(sb->sb.csum_table_start + csum_block_nr),
       f,
       table + (csum_block_nr * BLOCK_SIZE),
       sb->sb.csum_table_start + csum_block_nr,
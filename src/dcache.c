@@ -0,0 +1,232 @@
+#include <stdlib.h>
+
+#include "dcache.h"
+#include "list.h"
+#include "testfs.h"
+
+/*
+ * The entries of a cache are allocated up front. An entry is either on the
+ * free list, or on the LRU list and in the hash chain of its bucket. Chains
+ * link entries by index.
+ */
+
+#define DCACHE_HASH_SHIFT 9
+#define DCACHE_NR_BUCKETS (1 << DCACHE_HASH_SHIFT)
+
+struct dentry {
+  int dir_nr;
+  // Negative for a negative entry
+  int inode_nr;
+  u_int32_t hash;
+  // Next entry in the hash chain, -1 at the end
+  int next;
+  struct list_head lru;
+  char name[DCACHE_NAME_LEN];
+};
+
+struct dcache {
+  struct dentry entries[DCACHE_NR_ENTRIES];
+  // First entry of each hash chain, -1 if empty
+  int buckets[DCACHE_NR_BUCKETS];
+  // Cached entries, most recently used first
+  struct list_head lru;
+  struct list_head free;
+};
+
+static bool dcache_enabled = true;
+static struct dcache_stats dcache_stats;
+
+// FNV-1a of the name, mixed with the directory
+static u_int32_t dcache_hash(int dir_nr, const char *name) {
+  u_int32_t hash = 2166136261u;
+
+  for (; *name; name++) {
+    hash ^= (unsigned char)*name;
+    hash *= 16777619u;
+  }
+  return hash ^ (u_int32_t)dir_nr;
+}
+
+static inline int dcache_bucket(u_int32_t hash) {
+  return hash_int(hash, DCACHE_HASH_SHIFT);
+}
+
+static struct dentry *dcache_find(
+    struct dcache *d, int dir_nr, const char *name, u_int32_t hash) {
+  for (int i = d->buckets[dcache_bucket(hash)]; i >= 0;
+       i = d->entries[i].next) {
+    struct dentry *de = &d->entries[i];
+    if (de->hash == hash && de->dir_nr == dir_nr &&
+        strcmp(de->name, name) == 0) {
+      return de;
+    }
+  }
+  return NULL;
+}
+
+static void dcache_remove(struct dcache *d, struct dentry *de) {
+  int index = de - d->entries;
+  int *link = &d->buckets[dcache_bucket(de->hash)];
+
+  while (*link != index) {
+    assert(*link >= 0);
+    link = &d->entries[*link].next;
+  }
+  *link = de->next;
+  list_del(&de->lru);
+  list_add(&de->lru, &d->free);
+  dcache_stats.nr_cached--;
+  if (de->inode_nr < 0) {
+    dcache_stats.nr_negative--;
+  }
+}
+
+static void dcache_set(struct dentry *de, int inode_nr) {
+  if ((de->inode_nr < 0) != (inode_nr < 0)) {
+    if (inode_nr < 0) {
+      dcache_stats.nr_negative++;
+    } else {
+      dcache_stats.nr_negative--;
+    }
+  }
+  de->inode_nr = inode_nr;
+}
+
+void dcache_init(struct super_block *sb) {
+  struct dcache *d = malloc(sizeof(struct dcache));
+  if (!d) {
+    EXIT("malloc");
+  }
+  INIT_LIST_HEAD(&d->lru);
+  INIT_LIST_HEAD(&d->free);
+  for (int i = 0; i < DCACHE_NR_ENTRIES; i++) {
+    list_add_tail(&d->entries[i].lru, &d->free);
+  }
+  for (int i = 0; i < DCACHE_NR_BUCKETS; i++) {
+    d->buckets[i] = -1;
+  }
+  sb->dcache = d;
+}
+
+void dcache_destroy(struct super_block *sb) {
+  struct dcache *d = sb->dcache;
+  struct dentry *de, *tmp;
+
+  assert(d);
+  list_for_each_entry_safe(de, tmp, &d->lru, lru) {
+    dcache_remove(d, de);
+  }
+  free(d);
+  sb->dcache = NULL;
+}
+
+bool dcache_lookup(
+    struct super_block *sb, int dir_nr, const char *name, int *inode_nr) {
+  struct dcache *d = sb->dcache;
+  struct dentry *de;
+
+  if (!dcache_enabled || strlen(name) >= DCACHE_NAME_LEN) {
+    return false;
+  }
+  de = dcache_find(d, dir_nr, name, dcache_hash(dir_nr, name));
+  if (!de) {
+    dcache_stats.misses++;
+    return false;
+  }
+  list_del(&de->lru);
+  list_add(&de->lru, &d->lru);
+  if (de->inode_nr < 0) {
+    dcache_stats.negative_hits++;
+    *inode_nr = -ENOENT;
+  } else {
+    dcache_stats.hits++;
+    *inode_nr = de->inode_nr;
+  }
+  return true;
+}
+
+void dcache_insert(
+    struct super_block *sb, int dir_nr, const char *name, int inode_nr) {
+  struct dcache *d = sb->dcache;
+  u_int32_t hash;
+  struct dentry *de;
+  int bucket;
+
+  if (strlen(name) >= DCACHE_NAME_LEN) {
+    return;
+  }
+  hash = dcache_hash(dir_nr, name);
+  de = dcache_find(d, dir_nr, name, hash);
+  if (de) {
+    dcache_set(de, inode_nr);
+    list_del(&de->lru);
+    list_add(&de->lru, &d->lru);
+    return;
+  }
+  if (!dcache_enabled) {
+    return;
+  }
+  if (list_empty(&d->free)) {
+    dcache_remove(d, list_entry(d->lru.prev, struct dentry, lru));
+    dcache_stats.evictions++;
+  }
+  de = list_entry(d->free.next, struct dentry, lru);
+  list_del(&de->lru);
+  list_add(&de->lru, &d->lru);
+  de->dir_nr = dir_nr;
+  de->inode_nr = 0;
+  dcache_set(de, inode_nr);
+  de->hash = hash;
+  strcpy(de->name, name);
+  bucket = dcache_bucket(hash);
+  de->next = d->buckets[bucket];
+  d->buckets[bucket] = de - d->entries;
+  dcache_stats.nr_cached++;
+}
+
+void dcache_forget_dir(struct super_block *sb, int dir_nr) {
+  struct dcache *d = sb->dcache;
+  struct dentry *de, *tmp;
+
+  list_for_each_entry_safe(de, tmp, &d->lru, lru) {
+    if (de->dir_nr == dir_nr) {
+      dcache_remove(d, de);
+    }
+  }
+}
+
+void dcache_set_enabled(bool enabled) {
+  dcache_enabled = enabled;
+}
+
+bool dcache_get_enabled(void) {
+  return dcache_enabled;
+}
+
+void dcache_get_stats(struct dcache_stats *stats) {
+  *stats = dcache_stats;
+}
+
+void dcache_reset_stats(void) {
+  dcache_stats.hits = 0;
+  dcache_stats.negative_hits = 0;
+  dcache_stats.misses = 0;
+  dcache_stats.evictions = 0;
+}
+
+void dcache_print_stats(void) {
+  printf(
+    "%s  entries: %zu of %d  negative: %zu\n",
+    dcache_enabled ? "on" : "off",
+    dcache_stats.nr_cached,
+    DCACHE_NR_ENTRIES,
+    dcache_stats.nr_negative
+  );
+  printf(
+    "hits: %llu  negative hits: %llu  misses: %llu  evictions: %llu\n",
+    (unsigned long long) dcache_stats.hits,
+    (unsigned long long) dcache_stats.negative_hits,
+    (unsigned long long) dcache_stats.misses,
+    (unsigned long long) dcache_stats.evictions
+  );
+}
@@ -1,3 +1,4 @@
+#include "spdk/stdinc.h"
 #include "spdk/thread.h"
 #include "spdk/event.h"
 #include "spdk/log.h"
@@ -6,6 +7,9 @@
 #include "spdk/util.h"
 
 #include "device.h"
+#include "block.h"
+#include "cache.h"
+#include "common.h"
 #include "logging.h"
 
 struct init_completed_context {
@@ -20,11 +24,16 @@ struct reactor_init_context {
   struct init_completed_context *completed_ctx;
 };
 
-static void init_bdev(struct filesystem *fs) {
+struct reactor_stop_context {
+  struct reactor_context *reactor;
+  struct future *f;
+};
+
+static int init_bdev(struct filesystem *fs) {
   fs->bdev_ctx.bdev = spdk_bdev_first();
   if (fs->bdev_ctx.bdev == NULL) {
     SPDK_ERRLOG("Could not get bdev\n");
-    spdk_app_stop(-1);
+    return -ENODEV;
   }
 
   LOG("BLOCK_SIZE %d\n", spdk_bdev_get_block_size(fs->bdev_ctx.bdev));
@@ -34,11 +43,27 @@ static void init_bdev(struct filesystem *fs) {
   if (spdk_bdev_open(
         fs->bdev_ctx.bdev, true, NULL, NULL, &(fs->bdev_ctx.bdev_desc))) {
     SPDK_ERRLOG("Could not open bdev: %s\n", fs->bdev_ctx.bdev_name);
-    spdk_app_stop(-1);
+    return -ENODEV;
   }
 
   fs->bdev_ctx.buf_align = spdk_bdev_get_buf_align(fs->bdev_ctx.bdev);
   SPDK_NOTICELOG("Bdev: %s init finished\n", fs->bdev_ctx.bdev_name);
+  return 0;
+}
+
+static int init_reactor_pools(struct filesystem *fs) {
+  for (size_t i = 0; i < NUM_REACTORS; i++) {
+    if (dma_buf_pool_init(
+          &(fs->reactors[i].dma_bufs), i, fs->bdev_ctx.buf_align)) {
+      SPDK_ERRLOG("Could not create DMA buffer pools for reactor %zu\n", i);
+      return -ENOMEM;
+    }
+    if (block_request_pool_init(&(fs->reactors[i]), i)) {
+      SPDK_ERRLOG("Could not create request pool for reactor %zu\n", i);
+      return -ENOMEM;
+    }
+  }
+  return 0;
 }
 
 static void init_reactors_complete(void *arg) {
@@ -48,6 +73,7 @@ static void init_reactors_complete(void *arg) {
     return;
   }
 
+  block_flusher_start(ctx->fs);
   LOG("START FINISHED\n");
   // NOTE: This function currently already runs on the main reactor, but this
   //       will ensure the REPL runs on a clean stack.
@@ -59,6 +85,12 @@ static void acquire_io_channels(void *arg) {
   struct reactor_init_context *ctx = arg;
   ctx->reactor->io_channel =
     spdk_bdev_get_io_channel(ctx->fs->bdev_ctx.bdev_desc);
+  ctx->reactor->sched =
+    io_sched_create(ctx->fs->bdev_ctx.bdev, ctx->reactor->io_channel);
+  if (ctx->reactor->sched == NULL) {
+    SPDK_ERRLOG("Could not start I/O scheduler on %d\n", ctx->reactor->lcore);
+    spdk_app_stop(-1);
+  }
   LOG(
     "Reactor %d, io_channel %p, thread %p\n",
     ctx->reactor->lcore,
@@ -73,49 +105,186 @@ static void acquire_io_channels(void *arg) {
   free(ctx);
 }
 
+// Assigns the cores of the reactor mask to the reactors in ascending order.
+// The main reactor always runs on the master core, which runs this function.
+static int map_reactors(struct filesystem *fs) {
+  uint32_t master = spdk_env_get_current_core();
+  uint32_t core;
+  size_t i = MAIN_REACTOR + 1;
+
+  fs->reactors[MAIN_REACTOR].lcore = master;
+  SPDK_ENV_FOREACH_CORE(core) {
+    if (i == NUM_REACTORS) {
+      break;
+    }
+    if (core != master) {
+      fs->reactors[i++].lcore = core;
+    }
+  }
+  if (i < NUM_REACTORS) {
+    SPDK_ERRLOG(
+      "Reactor mask has %zu cores, but %u reactors are configured\n",
+      i,
+      NUM_REACTORS
+    );
+    return -EINVAL;
+  }
+
+  for (i = 0; i < NUM_REACTORS; i++) {
+    LOG(
+      "Reactor %zu (%s) on lcore %u\n",
+      i,
+      i == MAIN_REACTOR ? "main" : (i < DATA_REACTOR ? "metadata" : "data"),
+      fs->reactors[i].lcore
+    );
+  }
+  return 0;
+}
+
 static void init_reactors(
     struct filesystem *fs, struct init_completed_context *completed_ctx) {
-  struct reactor_init_context *ctx[NUM_REACTORS];
-
   for (size_t i = 0; i < NUM_REACTORS; i++) {
-    // NOTE: We use the reactor context index to assign the lcore ID, but we
-    //       can change the mapping if needed
-    fs->reactors[i].lcore = i;
-
-    ctx[i] = malloc(sizeof(struct reactor_init_context));
-    ctx[i]->fs = fs;
-    ctx[i]->reactor = &(fs->reactors[i]);
-    ctx[i]->completed_ctx = completed_ctx;
-    send_request(fs->reactors[i].lcore, acquire_io_channels, ctx[i]);
+    struct reactor_init_context *ctx =
+      malloc(sizeof(struct reactor_init_context));
+    ctx->fs = fs;
+    ctx->reactor = &(fs->reactors[i]);
+    ctx->completed_ctx = completed_ctx;
+    send_request(fs->reactors[i].lcore, acquire_io_channels, ctx);
   }
 }
 
 static void start(void *arg1, void *arg2) {
   struct filesystem *fs = malloc(sizeof(struct filesystem));
   fs->sb = NULL;
+  fs->reactors = calloc(NUM_REACTORS, sizeof(struct reactor_context));
+  if (fs->reactors == NULL || map_reactors(fs)) {
+    spdk_app_stop(-1);
+    return;
+  }
+  if (init_bdev(fs)) {
+    spdk_app_stop(-1);
+    return;
+  }
+  fs->cache = cache_create(CACHE_DEFAULT_NR_BLOCKS);
+  if (fs->cache == NULL) {
+    SPDK_ERRLOG("Could not create block cache\n");
+    spdk_app_stop(-1);
+    return;
+  }
+  if (async_init()) {
+    SPDK_ERRLOG("Could not set up batched submission\n");
+    spdk_app_stop(-1);
+    return;
+  }
+  // NOTE: Stop before any reactor acquires an I/O channel, so no reactor runs
+  //       on partially initialized pools.
+  if (init_reactor_pools(fs)) {
+    spdk_app_stop(-1);
+    return;
+  }
   struct init_completed_context *completed_ctx =
     malloc(sizeof(struct init_completed_context));
   completed_ctx->fs = fs;
   completed_ctx->app_start = (device_init_cb) arg1;
   completed_ctx->outstanding_requests = NUM_REACTORS;
-  init_bdev(fs);
   init_reactors(fs, completed_ctx);
 }
 
+// Runs on the reactor that owns the scheduler and the I/O channel
+static void release_io_channel(void *arg) {
+  struct reactor_stop_context *ctx = arg;
+  io_sched_destroy(ctx->reactor->sched);
+  ctx->reactor->sched = NULL;
+  spdk_put_io_channel(ctx->reactor->io_channel);
+  ctx->reactor->io_channel = NULL;
+  if (ctx->f) {
+    future_complete(ctx->f, 0);
+  }
+  free(ctx);
+}
+
+static void release_io_channels(struct filesystem *fs) {
+  struct future f;
+  future_init(&f);
+
+  for (size_t i = 0; i < NUM_REACTORS; i++) {
+    struct reactor_stop_context *ctx =
+      malloc(sizeof(struct reactor_stop_context));
+    if (!ctx) {
+      EXIT("malloc");
+    }
+    ctx->reactor = &(fs->reactors[i]);
+    // NOTE: The main reactor does not process its events while this runs, so
+    //       it releases its own channel directly
+    if (i == MAIN_REACTOR) {
+      ctx->f = NULL;
+      release_io_channel(ctx);
+    } else {
+      ctx->f = &f;
+      future_expect(&f);
+      send_request(fs->reactors[i].lcore, release_io_channel, ctx);
+    }
+  }
+  spin_wait(&f);
+}
+
 void dev_stop(struct filesystem *fs) {
+  block_flusher_stop(fs);
+  // The superblock may already be gone, but a write-back cache can still hold
+  // dirty blocks
+  if (fs->cache && block_cache_writeback_all(fs) < 0) {
+    LOG("Could not write back the block cache\n");
+  }
+  release_io_channels(fs);
   for (int i = 0; i < NUM_REACTORS; i++) {
-    spdk_put_io_channel(fs->reactors[i].io_channel);
+    dma_buf_pool_destroy(&(fs->reactors[i].dma_bufs));
+    block_request_pool_destroy(&(fs->reactors[i]));
   }
+  cache_destroy(fs->cache);
+  fs->cache = NULL;
   spdk_bdev_close(fs->bdev_ctx.bdev_desc);
   spdk_app_stop(0);
 }
 
-void dev_init(const char *f, device_init_cb cb) {
-  int rc;
+void dev_opts_init(struct dev_opts *opts) {
+  opts->config_file = "config.conf";
+  opts->reactor_mask = NULL;
+  opts->num_metadata_reactors = 1;
+  opts->num_data_reactors = 1;
+}
+
+int dev_init(const struct dev_opts *dev_opts, device_init_cb cb) {
+  char reactor_mask[32];
+  uint32_t num_reactors;
+
+  if (dev_opts->num_metadata_reactors == 0 ||
+      dev_opts->num_data_reactors == 0) {
+    LOG("At least one metadata and one data reactor are required\n");
+    return -EINVAL;
+  }
+  num_reactors =
+    1 + dev_opts->num_metadata_reactors + dev_opts->num_data_reactors;
+  if (num_reactors > MAX_REACTORS) {
+    LOG("At most %d reactors are supported\n", MAX_REACTORS);
+    return -EINVAL;
+  }
+  reactor_layout.num_metadata = dev_opts->num_metadata_reactors;
+  reactor_layout.num_data = dev_opts->num_data_reactors;
+
   struct spdk_app_opts opts = {};
   spdk_app_opts_init(&opts);
   opts.name = "hello_world";
-  opts.config_file = "config.conf";
-  opts.reactor_mask = "0x7";
-  spdk_app_start(&opts, start, cb);
+  opts.config_file = dev_opts->config_file;
+  if (dev_opts->reactor_mask != NULL) {
+    opts.reactor_mask = dev_opts->reactor_mask;
+  } else {
+    snprintf(
+      reactor_mask,
+      sizeof(reactor_mask),
+      "0x%llx",
+      num_reactors == 64 ? ~0ULL : (1ULL << num_reactors) - 1
+    );
+    opts.reactor_mask = reactor_mask;
+  }
+  return spdk_app_start(&opts, start, cb);
 }
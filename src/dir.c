@@ -1,6 +1,8 @@
 #include "dir.h"
 #include "block.h"
+#include "dcache.h"
 #include "inode.h"
+#include "inode_alternate.h"
 #include "super.h"
 #include "testfs.h"
 #include "tx.h"
@@ -23,7 +25,8 @@ struct dirent *testfs_next_dirent(struct inode *dir, int *offset) {
   if (*offset >= testfs_inode_get_size(dir)) return NULL;
   // read data from dir into buffer "d" at offset-offset of size struct dirent
   // dirent contains inode number and name length value
-  ret = testfs_read_data(dir, *offset, (char *)&d, sizeof(struct dirent));
+  ret = testfs_read_data_alternate(
+    dir, *offset, (char *)&d, sizeof(struct dirent));
   if (ret < 0) return NULL;
   assert(d.d_name_len > 0);
   dp = malloc(sizeof(struct dirent) + d.d_name_len);
@@ -33,7 +36,7 @@ struct dirent *testfs_next_dirent(struct inode *dir, int *offset) {
   *offset += sizeof(struct dirent);
   // since d_dname is stored at the end of every dirent, we need to read that
   // many bytes of data
-  ret = testfs_read_data(dir, *offset, D_NAME(dp), d.d_name_len);
+  ret = testfs_read_data_alternate(dir, *offset, D_NAME(dp), d.d_name_len);
   if (ret < 0) {
     free(dp);
     return NULL;
@@ -87,6 +90,424 @@ static int testfs_write_dirent(struct inode *dir, char *name, int len,
   return ret;
 }
 
+// Directories start out in the linear format: a stream of dirents in which
+// removed entries have a negative inode number. A linear directory that
+// outgrows its first block is converted to the indexed format:
+//
+//   block 0:  ".", "..", and a removed dirent whose name holds the index
+//   block 1-: leaf blocks
+//
+// The index is an array of (hash, block) pairs sorted by hash, the first of
+// which has hash 0. A pair is packed in 32 bits: the leaf block number takes
+// the low DX_BLOCK_BITS bits, and only the bits above them of the hash of a
+// name are used. A name is stored in the leaf of the last pair whose hash
+// is not larger than the hash of the name, so a lookup, insert or remove reads
+// the root block and one leaf. Dirents never straddle leaf blocks and the
+// unused tail of a leaf is covered by a removed dirent, so an indexed
+// directory still reads as a stream of dirents with testfs_next_dirent().
+//
+// Leaves are split when they overflow and are never merged.
+
+// "." and ".." come first in every directory, the index follows them
+#define DX_ROOT_OFFSET \
+  (2 * sizeof(struct dirent) + sizeof(".") + sizeof(".."))
+#define DX_INFO_SIZE \
+  (BLOCK_SIZE - DX_ROOT_OFFSET - sizeof(struct dirent))
+#define DX_MAGIC "\0dx1"
+#define DX_MAGIC_LEN 4
+#define DX_MAX_ENTRIES \
+  ((DX_INFO_SIZE - DX_MAGIC_LEN - sizeof(u_int32_t)) / sizeof(u_int32_t))
+#define DX_BLOCK_BITS 8
+#define DX_BLOCK_MASK ((1u << DX_BLOCK_BITS) - 1)
+#define DX_HASH(e) ((e) & ~DX_BLOCK_MASK)
+#define DX_BLOCK(e) ((e) & DX_BLOCK_MASK)
+// A leaf holds at most this many dirents with one character names
+#define DX_LEAF_MAX_NAMES (BLOCK_SIZE / (sizeof(struct dirent) + 2))
+
+struct dx_root {
+  char magic[DX_MAGIC_LEN];
+  u_int32_t nr_entries;
+  u_int32_t entries[DX_MAX_ENTRIES];
+};
+
+// A live dirent of a leaf, or one that is being added to it
+struct dx_name {
+  u_int32_t hash;
+  int inode_nr;
+  int len;  // including the terminating NUL
+  const char *name;
+};
+
+static bool dir_index_enabled = true;
+
+void testfs_set_dir_index(bool enabled) {
+  dir_index_enabled = enabled;
+}
+
+bool testfs_get_dir_index(void) {
+  return dir_index_enabled;
+}
+
+// FNV-1a
+static u_int32_t dx_hash(const char *name) {
+  u_int32_t hash = 2166136261u;
+
+  for (; *name; name++) {
+    hash ^= (unsigned char)*name;
+    hash *= 16777619u;
+  }
+  return DX_HASH(hash);
+}
+
+static int dx_compare(const void *a, const void *b) {
+  u_int32_t ha = ((const struct dx_name *)a)->hash;
+  u_int32_t hb = ((const struct dx_name *)b)->hash;
+
+  return (ha > hb) - (ha < hb);
+}
+
+static int dx_bytes(const struct dx_name names[], int nr) {
+  int bytes = 0;
+  int i;
+
+  for (i = 0; i < nr; i++) bytes += sizeof(struct dirent) + names[i].len;
+  return bytes;
+}
+
+/* copies the header of the dirent at offset in buf, which holds size bytes.
+ * returns the length of the dirent, or -EIO if it does not fit in buf. */
+static int testfs_dirent_at(const char *buf, int size, int offset,
+                            struct dirent *d) {
+  if (offset + (int)sizeof(struct dirent) > size) return -EIO;
+  memcpy(d, buf + offset, sizeof(struct dirent));
+  if (d->d_name_len <= 0 ||
+      d->d_name_len > size - offset - (int)sizeof(struct dirent))
+    return -EIO;
+  return sizeof(struct dirent) + d->d_name_len;
+}
+
+/* returns whether the dirent at dp, with header d, is called name. */
+static bool testfs_dirent_is(const char *dp, const struct dirent *d,
+                             const char *name) {
+  int len = strlen(name) + 1;
+
+  return d->d_name_len >= len &&
+         memcmp(dp + sizeof(struct dirent), name, len) == 0;
+}
+
+static bool testfs_is_dot(const char *name) {
+  return strcmp(name, ".") == 0 || strcmp(name, "..") == 0;
+}
+
+/* reads the whole directory into a buffer that the caller should free.
+ * returns the size of the directory. */
+static int testfs_dir_read_all(struct inode *dir, char **bufp) {
+  int size = testfs_inode_get_size(dir);
+  char *buf = malloc(MAX(size, 1));
+  int ret;
+
+  if (!buf) return -ENOMEM;
+  if (size > 0) {
+    ret = testfs_read_data_alternate(dir, 0, buf, size);
+    if (ret < 0) {
+      free(buf);
+      return ret;
+    }
+  }
+  *bufp = buf;
+  return size;
+}
+
+/* returns the inode number of the live dirent called name in the linear
+ * dirents in buf, and stores its offset in offset if it is not NULL.
+ * returns -ENOENT if there is no such dirent. */
+static int testfs_linear_lookup(const char *buf, int size, const char *name,
+                                int *offset) {
+  struct dirent d;
+  int off, len;
+
+  for (off = 0; off < size; off += len) {
+    len = testfs_dirent_at(buf, size, off, &d);
+    if (len < 0) return len;
+    if (d.d_inode_nr < 0 || !testfs_dirent_is(buf + off, &d, name)) continue;
+    if (offset) *offset = off;
+    return d.d_inode_nr;
+  }
+  return -ENOENT;
+}
+
+static int testfs_dir_read_block(struct inode *dir, int nr, char *block) {
+  return testfs_read_data_alternate(dir, nr * BLOCK_SIZE, block, BLOCK_SIZE);
+}
+
+static int testfs_dir_write_block(struct inode *dir, int nr, char *block) {
+  return testfs_write_data(dir, nr * BLOCK_SIZE, block, BLOCK_SIZE);
+}
+
+/* reads block 0 of dir into block and its index into root.
+ * returns 1 if dir is indexed, 0 if it is linear. */
+static int dx_read_root(struct inode *dir, char *block, struct dx_root *root) {
+  int size = testfs_inode_get_size(dir);
+  struct dirent d;
+  int ret;
+
+  if (size < 2 * BLOCK_SIZE || size % BLOCK_SIZE != 0) return 0;
+  ret = testfs_dir_read_block(dir, 0, block);
+  if (ret < 0) return ret;
+  memcpy(&d, block + DX_ROOT_OFFSET, sizeof(struct dirent));
+  if (d.d_inode_nr >= 0 || d.d_name_len != DX_INFO_SIZE) return 0;
+  memcpy(root, block + DX_ROOT_OFFSET + sizeof(struct dirent), sizeof(*root));
+  if (memcmp(root->magic, DX_MAGIC, DX_MAGIC_LEN) != 0) return 0;
+  if (root->nr_entries == 0 || root->nr_entries > DX_MAX_ENTRIES) return -EIO;
+  return 1;
+}
+
+static int dx_write_root(struct inode *dir, char *block,
+                         const struct dx_root *root) {
+  memcpy(block + DX_ROOT_OFFSET + sizeof(struct dirent), root, sizeof(*root));
+  return testfs_dir_write_block(dir, 0, block);
+}
+
+/* returns the index entry of the leaf that holds names with this hash. */
+static int dx_find_pos(const struct dx_root *root, u_int32_t hash) {
+  int lo = 0, hi = root->nr_entries - 1;
+
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (DX_HASH(root->entries[mid]) <= hash)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return lo;
+}
+
+/* reads the leaf of the index entry at pos into leaf and stores its live
+ * dirents in names. returns the number of dirents. */
+static int dx_read_leaf(struct inode *dir, const struct dx_root *root,
+                        int pos, char *leaf, struct dx_name names[]) {
+  u_int32_t block_nr = DX_BLOCK(root->entries[pos]);
+  struct dirent d;
+  int off, len, ret;
+  int nr = 0;
+
+  if (block_nr == 0 ||
+      (block_nr + 1) * BLOCK_SIZE > (u_int32_t)testfs_inode_get_size(dir))
+    return -EIO;
+  ret = testfs_dir_read_block(dir, block_nr, leaf);
+  if (ret < 0) return ret;
+  for (off = 0; off < BLOCK_SIZE; off += len) {
+    const char *name, *end;
+
+    len = testfs_dirent_at(leaf, BLOCK_SIZE, off, &d);
+    if (len < 0) return len;
+    if (d.d_inode_nr < 0) continue;
+    name = leaf + off + sizeof(struct dirent);
+    end = memchr(name, '\0', d.d_name_len);
+    if (!end || nr == DX_LEAF_MAX_NAMES) return -EIO;
+    names[nr].hash = dx_hash(name);
+    names[nr].inode_nr = d.d_inode_nr;
+    names[nr].len = end - name + 1;
+    names[nr].name = name;
+    nr++;
+  }
+  return nr;
+}
+
+/* reads the leaf that name hashes to, see dx_read_leaf(), and stores the
+ * number of its dirents in nr and its index entry in pos.
+ * returns the index of name in names, or -ENOENT. */
+static int dx_find(struct inode *dir, const struct dx_root *root,
+                   const char *name, char *leaf, struct dx_name names[],
+                   int *nr, int *pos) {
+  u_int32_t hash = dx_hash(name);
+  int i;
+
+  *pos = dx_find_pos(root, hash);
+  *nr = dx_read_leaf(dir, root, *pos, leaf, names);
+  if (*nr < 0) return *nr;
+  for (i = 0; i < *nr; i++) {
+    if (names[i].hash == hash && strcmp(names[i].name, name) == 0) return i;
+  }
+  return -ENOENT;
+}
+
+/* packs dirents, which must fit, into a leaf block. */
+static void dx_fill_leaf(char *block, const struct dx_name names[], int nr) {
+  struct dirent d;
+  int off = 0, last = 0;
+  int i, slack;
+
+  memset(block, 0, BLOCK_SIZE);
+  for (i = 0; i < nr; i++) {
+    d.d_name_len = names[i].len;
+    d.d_inode_nr = names[i].inode_nr;
+    memcpy(block + off, &d, sizeof(struct dirent));
+    memcpy(block + off + sizeof(struct dirent), names[i].name, names[i].len);
+    last = off;
+    off += sizeof(struct dirent) + names[i].len;
+  }
+  slack = BLOCK_SIZE - off;
+  if (slack > (int)sizeof(struct dirent)) {
+    d.d_name_len = slack - sizeof(struct dirent);
+    d.d_inode_nr = -1;
+    memcpy(block + off, &d, sizeof(struct dirent));
+  } else if (slack > 0) {
+    // too small for a dirent of its own, the last name is padded instead
+    assert(nr > 0);
+    d.d_name_len = names[nr - 1].len + slack;
+    d.d_inode_nr = names[nr - 1].inode_nr;
+    memcpy(block + last, &d, sizeof(struct dirent));
+  }
+}
+
+/* spreads the dirents of an overflowing leaf over the leaf of the index
+ * entry at pos and as many new leaves as needed, appended to the directory.
+ * leaves are split between different hashes, around the middle byte.
+ * if appending fails, orig, the previous contents of the leaf, is written
+ * back and the directory is truncated to its previous size. */
+static int dx_split(struct inode *dir, char *root_block, struct dx_root *root,
+                    int pos, struct dx_name names[], int nr,
+                    char *orig) {
+  int starts[DX_LEAF_MAX_NAMES + 2];
+  u_int32_t added[DX_LEAF_MAX_NAMES + 1];
+  char block[BLOCK_SIZE];
+  int size = testfs_inode_get_size(dir);
+  int goal = dx_bytes(names, nr) / 2;
+  int nr_leaves = 1;
+  int bytes = 0;
+  int i, ret;
+
+  qsort(names, nr, sizeof(struct dx_name), dx_compare);
+  starts[0] = 0;
+  for (i = 0; i < nr; i++) {
+    int len = sizeof(struct dirent) + names[i].len;
+
+    if (i > starts[nr_leaves - 1] &&
+        (bytes >= goal || bytes + len > BLOCK_SIZE)) {
+      if (names[i].hash != names[i - 1].hash) {
+        starts[nr_leaves++] = i;
+        bytes = 0;
+      } else if (bytes + len > BLOCK_SIZE) {
+        return -ENOSPC;
+      }
+    }
+    bytes += len;
+  }
+  starts[nr_leaves] = nr;
+  if (root->nr_entries + nr_leaves - 1 > DX_MAX_ENTRIES) return -ENOSPC;
+
+  dx_fill_leaf(block, names, starts[1]);
+  ret = testfs_dir_write_block(dir, DX_BLOCK(root->entries[pos]), block);
+  for (i = 1; ret >= 0 && i < nr_leaves; i++) {
+    // leaves are appended in order, so their numbers stay below the
+    // number of index entries
+    int block_nr = testfs_inode_get_size(dir) / BLOCK_SIZE;
+
+    added[i - 1] = names[starts[i]].hash | block_nr;
+    dx_fill_leaf(block, names + starts[i], starts[i + 1] - starts[i]);
+    ret = testfs_dir_write_block(dir, block_nr, block);
+  }
+  if (ret < 0) {
+    if (orig) testfs_dir_write_block(dir, DX_BLOCK(root->entries[pos]), orig);
+    testfs_truncate_data(dir, size);
+    return ret;
+  }
+  memmove(&root->entries[pos + nr_leaves], &root->entries[pos + 1],
+          (root->nr_entries - pos - 1) * sizeof(u_int32_t));
+  memcpy(&root->entries[pos + 1], added, (nr_leaves - 1) * sizeof(u_int32_t));
+  root->nr_entries += nr_leaves - 1;
+  return dx_write_root(dir, root_block, root);
+}
+
+static int dx_add_dirent(struct inode *dir, char *root_block,
+                         struct dx_root *root, char *name, int inode_nr) {
+  struct dx_name names[DX_LEAF_MAX_NAMES + 1];
+  char leaf[BLOCK_SIZE];
+  char block[BLOCK_SIZE];
+  int nr, pos;
+  int ret;
+
+  ret = dx_find(dir, root, name, leaf, names, &nr, &pos);
+  if (ret >= 0) return -EEXIST;
+  if (ret != -ENOENT) return ret;
+  names[nr].hash = dx_hash(name);
+  names[nr].inode_nr = inode_nr;
+  names[nr].len = strlen(name) + 1;
+  names[nr].name = name;
+  nr++;
+  if (dx_bytes(names, nr) > BLOCK_SIZE)
+    return dx_split(dir, root_block, root, pos, names, nr, leaf);
+  dx_fill_leaf(block, names, nr);
+  return testfs_dir_write_block(dir, DX_BLOCK(root->entries[pos]), block);
+}
+
+/* returns whether the linear directory in buf starts with "." and ".." in
+ * the layout that the index expects. */
+static bool dx_has_dots(const char *buf, int size) {
+  struct dirent d;
+
+  if (testfs_dirent_at(buf, size, 0, &d) != sizeof(struct dirent) + 2 ||
+      d.d_inode_nr < 0 || !testfs_dirent_is(buf, &d, "."))
+    return false;
+  buf += sizeof(struct dirent) + 2;
+  size -= sizeof(struct dirent) + 2;
+  return testfs_dirent_at(buf, size, 0, &d) == sizeof(struct dirent) + 3 &&
+         d.d_inode_nr >= 0 && testfs_dirent_is(buf, &d, "..");
+}
+
+/* converts the linear directory in buf, which fits in one block, to the
+ * indexed format and adds name to it. the linear directory is restored if
+ * the conversion fails. */
+static int dx_convert(struct inode *dir, char *buf, int size, char *name,
+                      int inode_nr) {
+  struct dx_name names[DX_LEAF_MAX_NAMES + 1];
+  struct dx_root root;
+  char block[BLOCK_SIZE];
+  struct dirent d;
+  int off, len;
+  int nr = 0;
+  int ret;
+
+  for (off = DX_ROOT_OFFSET; off < size; off += len) {
+    const char *dname, *end;
+
+    len = testfs_dirent_at(buf, size, off, &d);
+    if (len < 0) return len;
+    if (d.d_inode_nr < 0) continue;
+    dname = buf + off + sizeof(struct dirent);
+    end = memchr(dname, '\0', d.d_name_len);
+    if (!end || nr == DX_LEAF_MAX_NAMES) return -EIO;
+    names[nr].hash = dx_hash(dname);
+    names[nr].inode_nr = d.d_inode_nr;
+    names[nr].len = end - dname + 1;
+    names[nr].name = dname;
+    nr++;
+  }
+  names[nr].hash = dx_hash(name);
+  names[nr].inode_nr = inode_nr;
+  names[nr].len = strlen(name) + 1;
+  names[nr].name = name;
+  nr++;
+
+  memset(block, 0, BLOCK_SIZE);
+  memcpy(block, buf, DX_ROOT_OFFSET);
+  d.d_name_len = DX_INFO_SIZE;
+  d.d_inode_nr = -1;
+  memcpy(block + DX_ROOT_OFFSET, &d, sizeof(struct dirent));
+  memset(&root, 0, sizeof(root));
+  memcpy(root.magic, DX_MAGIC, DX_MAGIC_LEN);
+  root.nr_entries = 1;
+  root.entries[0] = 1;
+  ret = dx_write_root(dir, block, &root);
+  if (ret >= 0) ret = dx_split(dir, block, &root, 0, names, nr, NULL);
+  if (ret < 0) {
+    testfs_write_data(dir, 0, buf, size);
+    testfs_truncate_data(dir, size);
+  }
+  return ret;
+}
+
 /* return 0 on success.
  * return negative value on error. */
 /*
@@ -95,51 +516,73 @@ static int testfs_write_dirent(struct inode *dir, char *name, int len,
  the new file or directories inode is dir.
  */
 
-static int testfs_add_dirent(struct inode *dir, char *name, int inode_nr) {
-  struct dirent *d;
-  int p_offset = 0, offset = 0;
-  int found = 0;
-  int ret = 0;
+static int testfs_dir_add(struct inode *dir, char *name, int inode_nr) {
+  struct dx_root root;
+  char block[BLOCK_SIZE];
+  struct dirent d;
+  char *buf;
   int len = strlen(name) + 1;
-  // newly created file and directories will have there
-  // name recorded.
+  int size, offset;
+  int slot = -1;
+  int ret;
 
   assert(dir);
   assert(testfs_inode_get_type(dir) == I_DIR);
   assert(name);
-  for (; ret == 0 && found == 0; free(d)) {
-    p_offset = offset;
-    // goes through each directory/file entry insode dir.
-    // updates offset to point to next file/directory entry.
-    if ((d = testfs_next_dirent(dir, &offset)) == NULL)
-      // reached last directory/file in the inode
-      break;
-    if ((d->d_inode_nr >= 0) && (strcmp(D_NAME(d), name) == 0)) {
-      // d->d_inode_nr >=0 means we found an inode
-      // strcmp ==0 means the file or directory already exists
-      ret = -EEXIST;
-      continue;
-    }
-    if ((d->d_inode_nr >= 0) || (d->d_name_len != len)) continue;
-    found = 1;
+  // every name must fit in a leaf of the index
+  if (sizeof(struct dirent) + len > BLOCK_SIZE) return -ENAMETOOLONG;
+  ret = dx_read_root(dir, block, &root);
+  if (ret < 0) return ret;
+  if (ret > 0) {
+    // . and .. are always there, in front of the index
+    if (testfs_is_dot(name)) return -EEXIST;
+    return dx_add_dirent(dir, block, &root, name, inode_nr);
   }
+
+  ret = testfs_dir_read_all(dir, &buf);
   if (ret < 0) return ret;
-  assert(found || (p_offset == testfs_inode_get_size(dir)));
-  // writes directory information to file dir. enters name, length
-  // p_offset contains the offset where to write (usually at the end)
-  // dir = name of parent directory. name = name of newly created file/directory
-  // len = length of the string name + 1. inode_nr number of newly created
-  // file or directory.
-  // XXX why do we need to go to the end of the file to write directory
-  // entry?
-  return testfs_write_dirent(dir, name, len, inode_nr, p_offset);
+  size = ret;
+  for (offset = 0; offset < size; offset += ret) {
+    ret = testfs_dirent_at(buf, size, offset, &d);
+    if (ret < 0) goto out;
+    if (d.d_inode_nr >= 0) {
+      if (testfs_dirent_is(buf + offset, &d, name)) {
+        ret = -EEXIST;
+        goto out;
+      }
+    } else if (slot < 0 && d.d_name_len == len) {
+      // reuse the slot of a removed dirent with the same length
+      slot = offset;
+    }
+  }
+  if (slot < 0 && dir_index_enabled && size <= BLOCK_SIZE &&
+      size + (int)sizeof(struct dirent) + len > BLOCK_SIZE &&
+      dx_has_dots(buf, size)) {
+    ret = dx_convert(dir, buf, size, name, inode_nr);
+  } else {
+    ret = testfs_write_dirent(dir, name, len, inode_nr,
+                              slot < 0 ? size : slot);
+  }
+out:
+  free(buf);
+  return ret;
+}
+
+static int testfs_add_dirent(struct inode *dir, char *name, int inode_nr) {
+  int ret = testfs_dir_add(dir, name, inode_nr);
+
+  if (ret >= 0)
+    dcache_insert(testfs_inode_get_sb(dir), testfs_inode_get_nr(dir), name,
+                  inode_nr);
+  return ret;
 }
 
 /* returns negative value if name within dir is not empty */
 static int testfs_remove_dirent_allowed(struct super_block *sb, int inode_nr) {
   struct inode *dir;
-  int offset = 0;
-  struct dirent *d;
+  struct dirent d;
+  char *buf;
+  int size, offset, len;
   int ret = 0;
 
   // get inode will retrive the inode from memory (hash table)
@@ -149,15 +592,26 @@ static int testfs_remove_dirent_allowed(struct super_block *sb, int inode_nr) {
   // if it is only a file that you need to delete, remove the
   // in-memory inode
   if (testfs_inode_get_type(dir) != I_DIR) goto out;
-  // iterate through the directory entries; if there is any entry
-  // other than . or .., or with d_inode_nr < 0, return that there
-  // exists some directory inside the directory (return -ENOEMPTY)
-  for (; ret == 0 && (d = testfs_next_dirent(dir, &offset)); free(d)) {
-    if ((d->d_inode_nr < 0) || (strcmp(D_NAME(d), ".") == 0) ||
-        (strcmp(D_NAME(d), "..") == 0))
+  ret = testfs_dir_read_all(dir, &buf);
+  if (ret < 0) goto out;
+  size = ret;
+  ret = 0;
+  // if there is any live entry other than . or .., return that there
+  // exists something inside the directory (return -ENOTEMPTY)
+  for (offset = 0; ret == 0 && offset < size; offset += len) {
+    len = testfs_dirent_at(buf, size, offset, &d);
+    if (len < 0) {
+      ret = len;
+      break;
+    }
+    if ((d.d_inode_nr < 0) || testfs_dirent_is(buf + offset, &d, ".") ||
+        testfs_dirent_is(buf + offset, &d, ".."))
       continue;
     ret = -ENOTEMPTY;
   }
+  free(buf);
+  // the directory is going away, and its number may be reused
+  if (ret == 0) dcache_forget_dir(sb, inode_nr);
 out:
   // decrement inode count by 1, remove from hash.
   testfs_put_inode(dir);
@@ -167,46 +621,64 @@ out:
 /*
  this does not implement garbage collection. Only
  the inode_nr corresponding to the file or directory to be
- deleted are set to -1.
+ deleted are set to -1, or the dirent is dropped from its leaf
+ in an indexed directory.
  returns inode_nr of dirent removed
  returns negative value if name is not found */
-static int testfs_remove_dirent(struct super_block *sb, struct inode *dir,
-                                char *name) {
-  struct dirent *d;
-  int p_offset;
-  int offset = 0;
-  int inode_nr = -1;
-  int ret = -ENOENT;
+static int testfs_dir_remove(struct super_block *sb, struct inode *dir,
+                             char *name) {
+  struct dx_name names[DX_LEAF_MAX_NAMES];
+  struct dx_root root;
+  char block[BLOCK_SIZE];
+  char leaf[BLOCK_SIZE];
+  struct dirent d;
+  char *buf;
+  int inode_nr, offset;
+  int nr, pos, i;
+  int ret;
 
   assert(dir);
   assert(name);
-  if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+  if (testfs_is_dot(name)) {
     return -EINVAL;
   }
-  for (; inode_nr == -1; free(d)) {
-    p_offset = offset;
-    // reached last element in the dirent file, return
-    // with -ENOENT error
-    if ((d = testfs_next_dirent(dir, &offset)) == NULL) break;
-    // fslice_name(D_NAME(d), d->d_name_len);
-    // XXX in what scenario will d_inode_nr be 0?
-    // if we read a valid directory entry, and it does
-    // not correpond to the directory that we are looking
-    // for, continue.
-    if ((d->d_inode_nr < 0) || (strcmp(D_NAME(d), name) != 0)) continue;
-    /* found the dirent */
-    inode_nr = d->d_inode_nr;
+  ret = dx_read_root(dir, block, &root);
+  if (ret < 0) return ret;
+  if (ret > 0) {
+    i = dx_find(dir, &root, name, leaf, names, &nr, &pos);
+    if (i < 0) return i;
+    inode_nr = names[i].inode_nr;
     // check if there are no children directories or subdirectories
-    // in the directory to delete. also, remove the inode from
-    // hash table, and delete the in memory inode
-    if ((ret = testfs_remove_dirent_allowed(sb, inode_nr)) < 0)
-      continue; /* this will break out of the loop */
+    // in the directory to delete.
+    if ((ret = testfs_remove_dirent_allowed(sb, inode_nr)) < 0) return ret;
+    names[i] = names[--nr];
+    dx_fill_leaf(block, names, nr);
+    ret = testfs_dir_write_block(dir, DX_BLOCK(root.entries[pos]), block);
+    return ret < 0 ? ret : inode_nr;
+  }
+
+  ret = testfs_dir_read_all(dir, &buf);
+  if (ret < 0) return ret;
+  inode_nr = testfs_linear_lookup(buf, ret, name, &offset);
+  ret = inode_nr;
+  if (inode_nr >= 0 &&
+      (ret = testfs_remove_dirent_allowed(sb, inode_nr)) >= 0) {
     // set inode_nr to -1
-    d->d_inode_nr = -1;
-    ret = testfs_write_data(dir, p_offset, (char *)d,
-                            sizeof(struct dirent) + d->d_name_len);
+    memcpy(&d, buf + offset, sizeof(struct dirent));
+    d.d_inode_nr = -1;
+    ret = testfs_write_data(dir, offset, (char *)&d, sizeof(struct dirent));
     if (ret >= 0) ret = inode_nr;
   }
+  free(buf);
+  return ret;
+}
+
+/* removes name from dir, and records in the dentry cache that it is gone */
+static int testfs_remove_dirent(struct super_block *sb, struct inode *dir,
+                                char *name) {
+  int ret = testfs_dir_remove(sb, dir, name);
+
+  if (ret >= 0) dcache_insert(sb, testfs_inode_get_nr(dir), name, -ENOENT);
   return ret;
 }
 
@@ -247,7 +719,8 @@ int testfs_create_file_or_dir(struct super_block *sb, struct inode *dir,
    * allocates new inode (using calloc). assigns in to
    * newly created inode
    */
-  ret = testfs_create_inode(sb, type, &in);
+  ret = testfs_create_inode(
+    sb, dir ? testfs_inode_get_nr(dir) : -1, type, &in);
   if (ret < 0) {
     goto fail;
   }
@@ -267,8 +740,7 @@ int testfs_create_file_or_dir(struct super_block *sb, struct inode *dir,
   }
   testfs_sync_inode(in);
   testfs_put_inode(in);
-  testfs_tx_commit(sb, TX_CREATE);
-  return 0;
+  return testfs_tx_commit(sb, TX_CREATE);
 out:
   testfs_remove_inode(in);
 fail:
@@ -301,24 +773,47 @@ static int testfs_pwd(struct super_block *sb, struct inode *in) {
   return 0;
 }
 
+/* looks name up in the directory itself, bypassing the dentry cache */
+static int testfs_dir_lookup(struct inode *dir, char *name) {
+  struct dx_name names[DX_LEAF_MAX_NAMES];
+  struct dx_root root;
+  char block[BLOCK_SIZE];
+  char *buf;
+  int nr, pos;
+  int ret;
+
+  assert(dir);
+  assert(name);
+  assert(testfs_inode_get_type(dir) == I_DIR);
+  ret = dx_read_root(dir, block, &root);
+  if (ret < 0) return ret;
+  if (ret > 0) {
+    // . and .. are kept in front of the index
+    if (testfs_is_dot(name))
+      return testfs_linear_lookup(block, BLOCK_SIZE, name, NULL);
+    ret = dx_find(dir, &root, name, block, names, &nr, &pos);
+    return ret < 0 ? ret : names[ret].inode_nr;
+  }
+  ret = testfs_dir_read_all(dir, &buf);
+  if (ret < 0) return ret;
+  ret = testfs_linear_lookup(buf, ret, name, NULL);
+  free(buf);
+  return ret;
+}
+
 /* returns negative value if name is not found */
 /* takes current directory inode and the destination path
  to which we need to cd. returns inode number corresponding
  to the destination path.
  */
 int testfs_dir_name_to_inode_nr(struct inode *dir, char *name) {
-  struct dirent *d;
-  int offset = 0;
-  int ret = -ENOENT;
+  struct super_block *sb = testfs_inode_get_sb(dir);
+  int dir_nr = testfs_inode_get_nr(dir);
+  int ret;
 
-  assert(dir);
-  assert(name);
-  assert(testfs_inode_get_type(dir) == I_DIR);
-  for (; ret < 0 && (d = testfs_next_dirent(dir, &offset)); free(d)) {
-    // fslice_name(D_NAME(d), d->d_name_len);
-    if ((d->d_inode_nr < 0) || (strcmp(D_NAME(d), name) != 0)) continue;
-    ret = d->d_inode_nr;
-  }
+  if (dcache_lookup(sb, dir_nr, name, &ret)) return ret;
+  ret = testfs_dir_lookup(dir, name);
+  if (ret >= 0 || ret == -ENOENT) dcache_insert(sb, dir_nr, name, ret);
   return ret;
 }
 
@@ -520,8 +1015,7 @@ int cmd_rm(struct super_block *sb, struct context *c) {
   // TODO check how garbage collection is done.
   testfs_remove_inode(in);
   testfs_sync_inode(c->cur_dir);
-  testfs_tx_commit(sb, TX_RM);
-  return 0;
+  return testfs_tx_commit(sb, TX_RM);
 }
 
 int cmd_mkdir(struct super_block *sb, struct context *c) {
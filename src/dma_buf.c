@@ -0,0 +1,121 @@
+#include "spdk/env.h"
+
+#include "dma_buf.h"
+#include "common.h"
+#include "testfs.h"
+#include "logging.h"
+
+// NOTE: Memory pool elements are cache line aligned. If the device needs a
+//       stricter alignment we skip the pools and always use spdk_dma_malloc().
+#define DMA_BUF_ELT_ALIGN 64
+
+static const size_t dma_buf_class_blocks[NUM_DMA_BUF_CLASSES] = {1, 8, 64};
+static const size_t dma_buf_class_count[NUM_DMA_BUF_CLASSES] = {1024, 128, 16};
+
+// The header sits immediately before the buffer handed out to the caller so
+// that dma_buf_put() knows where the buffer came from.
+struct dma_buf_hdr {
+  struct spdk_mempool *pool;  // NULL if allocated with spdk_dma_malloc()
+  void *base;
+};
+
+static size_t hdr_size(size_t align) {
+  return ROUNDUP(sizeof(struct dma_buf_hdr), MAX(align, DMA_BUF_ELT_ALIGN));
+}
+
+static struct dma_buf_hdr *get_hdr(void *buf) {
+  return (struct dma_buf_hdr *)((char *)buf - sizeof(struct dma_buf_hdr));
+}
+
+int dma_buf_pool_init(
+    struct dma_buf_pool *pool, uint32_t reactor_id, size_t buf_align) {
+  char name[64];
+
+  pool->align = MAX(buf_align, 1);
+  for (size_t i = 0; i < NUM_DMA_BUF_CLASSES; i++) {
+    pool->classes[i] = NULL;
+  }
+  if (pool->align > DMA_BUF_ELT_ALIGN) {
+    LOG("Reactor %u: buf_align %zu too large, DMA buffer pools disabled\n",
+        reactor_id, pool->align);
+    return 0;
+  }
+
+  for (size_t i = 0; i < NUM_DMA_BUF_CLASSES; i++) {
+    snprintf(name, sizeof(name), "testfs_dma_%u_%zu", reactor_id, i);
+    pool->classes[i] = spdk_mempool_create(
+      name,
+      dma_buf_class_count[i],
+      hdr_size(pool->align) + dma_buf_class_blocks[i] * BLOCK_SIZE,
+      // NOTE: Buffers are returned on a different lcore than they are taken
+      //       from, so keep the per-lcore caches small enough that they
+      //       cannot hold most of a class
+      dma_buf_class_count[i] / 8,
+      SPDK_ENV_SOCKET_ID_ANY
+    );
+    if (pool->classes[i] == NULL) {
+      LOG("spdk_mempool_create() failed for %s\n", name);
+      dma_buf_pool_destroy(pool);
+      return -ENOMEM;
+    }
+  }
+  return 0;
+}
+
+void dma_buf_pool_destroy(struct dma_buf_pool *pool) {
+  for (size_t i = 0; i < NUM_DMA_BUF_CLASSES; i++) {
+    if (pool->classes[i] != NULL) {
+      spdk_mempool_free(pool->classes[i]);
+      pool->classes[i] = NULL;
+    }
+  }
+}
+
+void *dma_buf_get(struct dma_buf_pool *pool, size_t nr) {
+  size_t offset = hdr_size(pool->align);
+  struct spdk_mempool *mp = NULL;
+  void *base = NULL;
+
+  for (size_t i = 0; i < NUM_DMA_BUF_CLASSES; i++) {
+    if (pool->classes[i] != NULL && nr <= dma_buf_class_blocks[i]) {
+      mp = pool->classes[i];
+      base = spdk_mempool_get(mp);
+      break;
+    }
+  }
+  if (base == NULL) {
+    // Oversized request or exhausted class
+    mp = NULL;
+    base = spdk_dma_malloc(
+      offset + nr * BLOCK_SIZE, MAX(pool->align, DMA_BUF_ELT_ALIGN), NULL);
+    if (base == NULL) {
+      return NULL;
+    }
+  }
+
+  char *buf = (char *)base + offset;
+  get_hdr(buf)->pool = mp;
+  get_hdr(buf)->base = base;
+  return buf;
+}
+
+void dma_buf_put(void *buf) {
+  struct dma_buf_hdr *hdr = get_hdr(buf);
+  if (hdr->pool != NULL) {
+    spdk_mempool_put(hdr->pool, hdr->base);
+  } else {
+    spdk_dma_free(hdr->base);
+  }
+}
+
+void dma_buf_pool_usage(
+    struct dma_buf_pool *pool, size_t in_use[], size_t capacity[]) {
+  for (size_t i = 0; i < NUM_DMA_BUF_CLASSES; i++) {
+    if (pool->classes[i] == NULL) {
+      in_use[i] = capacity[i] = 0;
+      continue;
+    }
+    capacity[i] = dma_buf_class_count[i];
+    in_use[i] = capacity[i] - spdk_mempool_count(pool->classes[i]);
+  }
+}
@@ -7,8 +7,6 @@
 #include "async.h"
 #include "inode_alternate.h"
 
-#define MIN(x, y) (((x) < (y)) ? (x) : (y))
-
 
 int cmd_cat(struct super_block *sb, struct context *c) {
   char *buf;
@@ -37,7 +35,11 @@ int cmd_cat(struct super_block *sb, struct context *c) {
         ret = -ENOMEM;
         goto out;
       }
-      testfs_read_data(in, 0, buf, sz);
+      ret = testfs_read_data_alternate(in, 0, buf, sz);
+      if (ret < 0) {
+        free(buf);
+        goto out;
+      }
       buf[sz] = 0;
       printf("%s\n", buf);
       free(buf);
@@ -107,7 +109,12 @@ int cmd_catr(struct super_block *sb, struct context *c) {
             ret = -ENOMEM;
             goto out;
           }
-          testfs_read_data(cin, 0, buf, sz);
+          ret = testfs_read_data_alternate(cin, 0, buf, sz);
+          if (ret < 0) {
+            free(buf);
+            testfs_put_inode(cin);
+            goto out;
+          }
           buf[sz] = 0;
           printf("%s\n", buf);
           free(buf);
@@ -127,6 +134,7 @@ int cmd_write(struct super_block *sb, struct context *c) {
   struct inode *in;
   int size;
   int ret = 0;
+  int tx_ret;
   char *filename = NULL;
   char *content = NULL;
 
@@ -149,12 +157,15 @@ int cmd_write(struct super_block *sb, struct context *c) {
   future_init(&f);
   testfs_tx_start(sb, TX_WRITE);
   ret = testfs_write_data_alternate_async(in, &f, 0, content, size);
-  spin_wait(&f);
+  testfs_tx_wait(sb, &f);
   if (ret >= 0) {
     testfs_truncate_data(in, size);
   }
   testfs_sync_inode(in);
-  testfs_tx_commit(sb, TX_WRITE);
+  tx_ret = testfs_tx_commit(sb, TX_WRITE);
+  if (ret >= 0) {
+    ret = tx_ret;
+  }
 out:
   testfs_put_inode(in);
   return ret;
@@ -201,7 +212,10 @@ int cmd_import(struct super_block *sb, struct context *c) {
   }
   printf("size=%d\n", start);
   testfs_sync_inode(in);
-  testfs_tx_commit(sb, TX_WRITE);
+  int tx_ret = testfs_tx_commit(sb, TX_WRITE);
+  if (ret >= 0) {
+    ret = tx_ret;
+  }
 out:
   if (fp != NULL) {
     fclose(fp);
@@ -210,8 +224,13 @@ out:
   return ret;
 }
 
+// Bytes read per batch by export. The next chunk is read while the previous
+// one is written out.
+#define EXPORT_CHUNK_SIZE (32 * BLOCK_SIZE)
+
 int cmd_export(struct super_block *sb, struct context *c) {
-  uint8_t buffer[BLOCK_SIZE];
+  char *buffers[2] = {NULL, NULL};
+  struct future f[2];
   int ret = 0;
   int inode_nr = testfs_dir_name_to_inode_nr(c->cur_dir, c->cmd[1]);
   if (inode_nr < 0) return inode_nr;
@@ -227,19 +246,51 @@ int cmd_export(struct super_block *sb, struct context *c) {
   }
   int size = testfs_inode_get_size(in);
   printf("size=%d\n", size);
+  buffers[0] = malloc(EXPORT_CHUNK_SIZE);
+  buffers[1] = malloc(EXPORT_CHUNK_SIZE);
+  if (buffers[0] == NULL || buffers[1] == NULL) {
+    ret = -ENOMEM;
+    goto out;
+  }
   int start = 0;
-  int nbytes = 0;
-  while (start < size) {
-    nbytes = MIN(size-start, BLOCK_SIZE);
-    testfs_read_data(in, start, buffer, nbytes);
-    fwrite(buffer, sizeof(uint8_t), nbytes, fp);
-    start += BLOCK_SIZE;
+  int cur = 0;
+  future_init(&f[cur]);
+  ret = testfs_read_data_alternate_async(
+    in, &f[cur], start, buffers[cur], MIN(size, EXPORT_CHUNK_SIZE));
+  if (ret < 0) {
+    // Reads issued before the error still target the buffer
+    testfs_tx_wait(sb, &f[cur]);
+  }
+  while (ret >= 0 && start < size) {
+    int nbytes = MIN(size - start, EXPORT_CHUNK_SIZE);
+    int next = start + nbytes;
+    if (next < size) {
+      future_init(&f[!cur]);
+      ret = testfs_read_data_alternate_async(
+        in, &f[!cur], next, buffers[!cur], MIN(size - next, EXPORT_CHUNK_SIZE));
+    }
+    int status = testfs_tx_wait(sb, &f[cur]);
+    if (ret >= 0 && status < 0) {
+      ret = status;
+    }
+    if (ret < 0) {
+      if (next < size) {
+        testfs_tx_wait(sb, &f[!cur]);
+      }
+      break;
+    }
+    fwrite(buffers[cur], sizeof(uint8_t), nbytes, fp);
+    start = next;
+    cur = !cur;
   }
 out:
+  free(buffers[0]);
+  free(buffers[1]);
   if (fp != NULL) {
     fclose(fp);
   }
   testfs_put_inode(in);
+  return ret;
 }
 
 int cmd_owrite(struct super_block *sb, struct context *c) {
@@ -275,7 +326,10 @@ int cmd_owrite(struct super_block *sb, struct context *c) {
     testfs_truncate_data(in, size + offset);
   }
   testfs_sync_inode(in);
-  testfs_tx_commit(sb, TX_WRITE);
+  int tx_ret = testfs_tx_commit(sb, TX_WRITE);
+  if (ret >= 0) {
+    ret = tx_ret;
+  }
 out:
   testfs_put_inode(in);
   return ret;
@@ -1,61 +1,321 @@
 #include <stdlib.h>
 
 #include "inode.h"
+#include "inode_alternate.h"
 #include "block.h"
+#include "cache.h"
 #include "csum.h"
 #include "list.h"
 #include "super.h"
 #include "testfs.h"
 #include "logging.h"
 
-static struct hlist_head *inode_hash_table = NULL;
+/*
+ * Each superblock owns a hash table of its in-memory inodes, keyed by inode
+ * number. A bucket fills one cache line and holds the numbers of up to
+ * INODE_BUCKET_SLOTS inodes next to the pointers to them, so a lookup compares
+ * inode numbers without touching the inodes themselves. A bucket that is full
+ * chains to an overflow bucket.
+ *
+ * Once the table holds more than INODE_HASH_MAX_LOAD inodes per bucket, a
+ * table with twice as many buckets is allocated, and every later operation on
+ * the hash moves INODE_HASH_REHASH_STEP buckets over to it. Until all buckets
+ * have moved, lookups look in both tables.
+ */
 
-#define INODE_HASH_SHIFT 8
+#define INODE_HASH_INITIAL_SHIFT 8
+#define INODE_HASH_MAX_LOAD 2
+#define INODE_HASH_REHASH_STEP 4
+#define INODE_BUCKET_SLOTS 4
+#define CACHE_LINE_SIZE 64
+
+struct inode_bucket {
+  int nr[INODE_BUCKET_SLOTS];
+  // NULL for a free slot
+  struct inode *in[INODE_BUCKET_SLOTS];
+  struct inode_bucket *next;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+struct inode_table {
+  struct inode_bucket *buckets;
+  unsigned int shift;
+};
+
+struct inode_hash {
+  // Inodes are inserted into t[1] while t[0] is being rehashed into it
+  struct inode_table t[2];
+  // Next bucket of t[0] to rehash, -1 if not rehashing
+  long rehash_idx;
+  size_t nr;
+};
+
+#define inode_hashfn(nr, shift) hash_int((unsigned int)(nr), (shift))
+
+// Unreferenced inodes, most recently used first
+static LIST_HEAD(inode_lru);
+static size_t inode_cache_budget = INODE_CACHE_DEFAULT_BUDGET;
+static struct inode_cache_stats inode_stats;
+
+static int readahead_max_window = READAHEAD_DEFAULT_MAX_WINDOW;
+static uint64_t nr_readahead_windows = 0;
+static uint64_t nr_readahead_blocks = 0;
+
+static struct inode_bucket *inode_buckets_alloc(size_t nr) {
+  struct inode_bucket *buckets =
+    aligned_alloc(CACHE_LINE_SIZE, nr * sizeof(struct inode_bucket));
+  if (buckets) {
+    memset(buckets, 0, nr * sizeof(struct inode_bucket));
+  }
+  return buckets;
+}
 
-#define inode_hashfn(nr) hash_int((unsigned int)nr, INODE_HASH_SHIFT)
+static inline size_t inode_table_size(struct inode_table *t) {
+  return (size_t)1 << t->shift;
+}
 
-static const int inode_hash_size = (1 << INODE_HASH_SHIFT);
+static inline struct inode_bucket *inode_table_bucket(
+    struct inode_table *t, int inode_nr) {
+  return &t->buckets[inode_hashfn(inode_nr, t->shift)];
+}
 
-void inode_hash_init(void) {
-  int i;
-  // hash table is of size 256 bytes
-  inode_hash_table = malloc(inode_hash_size * sizeof(struct hlist_head));
-  if (!inode_hash_table) {
+static struct inode *inode_bucket_find(struct inode_bucket *b, int inode_nr) {
+  for (; b; b = b->next) {
+    for (int i = 0; i < INODE_BUCKET_SLOTS; i++) {
+      if (b->nr[i] == inode_nr && b->in[i]) {
+        return b->in[i];
+      }
+    }
+  }
+  return NULL;
+}
+
+static void inode_bucket_add(struct inode_bucket *b, struct inode *in) {
+  for (;; b = b->next) {
+    for (int i = 0; i < INODE_BUCKET_SLOTS; i++) {
+      if (!b->in[i]) {
+        b->nr[i] = in->i_nr;
+        b->in[i] = in;
+        return;
+      }
+    }
+    if (!b->next) {
+      b->next = inode_buckets_alloc(1);
+      if (!b->next) {
+        EXIT("aligned_alloc");
+      }
+    }
+  }
+}
+
+static bool inode_bucket_del(struct inode_bucket *b, struct inode *in) {
+  for (; b; b = b->next) {
+    for (int i = 0; i < INODE_BUCKET_SLOTS; i++) {
+      if (b->in[i] == in) {
+        b->in[i] = NULL;
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+// Frees the overflow buckets chained to a bucket and empties it
+static void inode_bucket_clear(struct inode_bucket *b) {
+  struct inode_bucket *next = b->next;
+  while (next) {
+    struct inode_bucket *tmp = next->next;
+    free(next);
+    next = tmp;
+  }
+  memset(b, 0, sizeof(struct inode_bucket));
+}
+
+static void inode_hash_rehash_step(struct inode_hash *h) {
+  for (int step = 0; step < INODE_HASH_REHASH_STEP && h->rehash_idx >= 0;
+       step++) {
+    struct inode_bucket *b = &h->t[0].buckets[h->rehash_idx];
+    for (struct inode_bucket *o = b; o; o = o->next) {
+      for (int i = 0; i < INODE_BUCKET_SLOTS; i++) {
+        if (o->in[i]) {
+          inode_bucket_add(inode_table_bucket(&h->t[1], o->nr[i]), o->in[i]);
+        }
+      }
+    }
+    inode_bucket_clear(b);
+    if ((size_t)++h->rehash_idx == inode_table_size(&h->t[0])) {
+      free(h->t[0].buckets);
+      h->t[0] = h->t[1];
+      h->t[1].buckets = NULL;
+      h->rehash_idx = -1;
+    }
+  }
+}
+
+static void inode_hash_maybe_grow(struct inode_hash *h) {
+  if (h->rehash_idx >= 0 ||
+      h->nr <= inode_table_size(&h->t[0]) * INODE_HASH_MAX_LOAD ||
+      h->t[0].shift >= 31) {
+    return;
+  }
+  h->t[1].shift = h->t[0].shift + 1;
+  h->t[1].buckets = inode_buckets_alloc(inode_table_size(&h->t[1]));
+  // keep using the current table if there is no memory for a larger one
+  if (h->t[1].buckets) {
+    h->rehash_idx = 0;
+  }
+}
+
+static void inode_hash_remove(struct inode *in) {
+  struct inode_hash *h = in->sb->inode_hash;
+  if (h->rehash_idx >= 0) {
+    inode_hash_rehash_step(h);
+  }
+  if (!(h->rehash_idx >= 0 &&
+        inode_bucket_del(inode_table_bucket(&h->t[1], in->i_nr), in))) {
+    bool found = inode_bucket_del(inode_table_bucket(&h->t[0], in->i_nr), in);
+    assert(found);
+  }
+  h->nr--;
+}
+
+static void inode_cache_evict(struct inode *in) {
+  list_del(&in->lru);
+  inode_hash_remove(in);
+  inode_stats.nr_cached--;
+  inode_stats.nr_unused--;
+  free(in);
+}
+
+// Evicts least recently used inodes until the cache fits in the budget
+static void inode_cache_shrink(void) {
+  while (!list_empty(&inode_lru) &&
+         inode_stats.nr_cached * sizeof(struct inode) > inode_cache_budget) {
+    inode_cache_evict(list_entry(inode_lru.prev, struct inode, lru));
+    inode_stats.evictions++;
+  }
+}
+
+static void inode_cache_drop_unused(struct super_block *sb) {
+  struct inode *in, *tmp;
+  list_for_each_entry_safe(in, tmp, &inode_lru, lru) {
+    if (in->sb == sb) {
+      inode_cache_evict(in);
+    }
+  }
+}
+
+void inode_hash_init(struct super_block *sb) {
+  struct inode_hash *h;
+
+  // re-initializing a superblock must not leak the table it already has
+  if (sb->inode_hash) {
+    inode_hash_destroy(sb);
+  }
+  h = malloc(sizeof(struct inode_hash));
+  if (!h) {
     EXIT("malloc");
   }
-  for (i = 0; i < inode_hash_size; i++) {
-    INIT_HLIST_HEAD(&inode_hash_table[i]);
+  h->t[0].shift = INODE_HASH_INITIAL_SHIFT;
+  h->t[0].buckets = inode_buckets_alloc(inode_table_size(&h->t[0]));
+  if (!h->t[0].buckets) {
+    EXIT("aligned_alloc");
   }
+  h->t[1].shift = 0;
+  h->t[1].buckets = NULL;
+  h->rehash_idx = -1;
+  h->nr = 0;
+  sb->inode_hash = h;
 }
 
-void inode_hash_destroy(void) {
-  int i;
-  assert(inode_hash_table);
-  for (i = 0; i < inode_hash_size; i++) {
-    assert(hlist_empty(&inode_hash_table[i]));
+void inode_hash_destroy(struct super_block *sb) {
+  struct inode_hash *h = sb->inode_hash;
+
+  assert(h);
+  inode_cache_drop_unused(sb);
+  assert(h->nr == 0);
+  for (int t = 0; t < 2; t++) {
+    if (!h->t[t].buckets) {
+      continue;
+    }
+    for (size_t i = 0; i < inode_table_size(&h->t[t]); i++) {
+      inode_bucket_clear(&h->t[t].buckets[i]);
+    }
+    free(h->t[t].buckets);
+  }
+  free(h);
+  sb->inode_hash = NULL;
+}
+
+void testfs_set_inode_cache_budget(size_t bytes) {
+  inode_cache_budget = bytes;
+  inode_cache_shrink();
+}
+
+size_t testfs_get_inode_cache_budget(void) { return inode_cache_budget; }
+
+void testfs_get_inode_cache_stats(struct inode_cache_stats *stats) {
+  *stats = inode_stats;
+}
+
+void testfs_reset_inode_cache_stats(void) {
+  inode_stats.hits = 0;
+  inode_stats.misses = 0;
+  inode_stats.evictions = 0;
+}
+
+void testfs_print_inode_cache_stats(struct super_block *sb) {
+  printf(
+    "budget: %zu KiB (%zu inodes)  cached: %zu  unused: %zu\n",
+    inode_cache_budget / 1024,
+    inode_cache_budget / sizeof(struct inode),
+    inode_stats.nr_cached,
+    inode_stats.nr_unused
+  );
+  printf(
+    "hits: %llu  misses: %llu  evictions: %llu\n",
+    (unsigned long long) inode_stats.hits,
+    (unsigned long long) inode_stats.misses,
+    (unsigned long long) inode_stats.evictions
+  );
+  if (sb && sb->inode_hash) {
+    struct inode_hash *h = sb->inode_hash;
+    printf(
+      "hash: %zu inodes in %zu buckets%s\n",
+      h->nr,
+      inode_table_size(&h->t[h->rehash_idx >= 0 ? 1 : 0]),
+      h->rehash_idx >= 0 ? " (growing)" : ""
+    );
   }
-  free(inode_hash_table);
 }
 
 static struct inode *inode_hash_find(struct super_block *sb, int inode_nr) {
-  struct hlist_node *elem;
-  struct inode *in;
+  struct inode_hash *h = sb->inode_hash;
+  struct inode *in = NULL;
 
-  hlist_for_each_entry(in, elem, &inode_hash_table[inode_hashfn(inode_nr)],
-                       hnode) {
-    if ((in->sb == sb) && (in->i_nr == inode_nr)) {
-      return in;
-    }
+  if (h->rehash_idx >= 0) {
+    inode_hash_rehash_step(h);
   }
-  return NULL;
+  if (h->rehash_idx >= 0) {
+    in = inode_bucket_find(inode_table_bucket(&h->t[1], inode_nr), inode_nr);
+  }
+  if (!in) {
+    in = inode_bucket_find(inode_table_bucket(&h->t[0], inode_nr), inode_nr);
+  }
+  return in;
 }
 
 static void inode_hash_insert(struct inode *in) {
-  INIT_HLIST_NODE(&in->hnode);
-  hlist_add_head(&in->hnode, &inode_hash_table[inode_hashfn(in->i_nr)]);
-}
+  struct inode_hash *h = in->sb->inode_hash;
 
-static void inode_hash_remove(struct inode *in) { hlist_del(&in->hnode); }
+  inode_hash_maybe_grow(h);
+  if (h->rehash_idx >= 0) {
+    inode_hash_rehash_step(h);
+  }
+  // the rehash may have just finished
+  inode_bucket_add(
+    inode_table_bucket(&h->t[h->rehash_idx >= 0 ? 1 : 0], in->i_nr), in);
+  h->nr++;
+}
 
 /*
  Blocks are maintained both on disk and in memory.
@@ -78,15 +338,22 @@ int testfs_inode_to_block_offset(struct inode *in) {
   return block_offset;
 }
 
-static void testfs_read_inode_block(struct inode *in, char *block) {
-  int block_nr = testfs_inode_to_block_nr(in);
-  // read from in->sb into block buffer.
-  read_blocks(in->sb, block, in->sb->sb.inode_blocks_start + block_nr, 1);
+// Returns the dinode of the inode in the resident inode table
+static char *testfs_inode_table_entry(struct inode *in) {
+  assert(in->sb->inode_table);
+  return in->sb->inode_table + testfs_inode_to_block_nr(in) * BLOCK_SIZE +
+         testfs_inode_to_block_offset(in);
 }
 
-static void testfs_write_inode_block(struct inode *in, char *block) {
-  int block_nr = testfs_inode_to_block_nr(in);
-  write_blocks(in->sb, block, in->sb->sb.inode_blocks_start + block_nr, 1);
+void testfs_inode_store(struct inode *in) {
+  memcpy(testfs_inode_table_entry(in), &in->in, sizeof(struct dinode));
+  // NOTE: Atomic, as a failed asynchronous flush re-marks blocks from another
+  //       reactor (see testfs_write_dirty_blocks())
+  __atomic_store_n(
+    &in->sb->inode_block_dirty[testfs_inode_to_block_nr(in)],
+    true,
+    __ATOMIC_RELAXED
+  );
 }
 
 /* given logical block number, read physical block
@@ -99,24 +366,16 @@ static int testfs_get_block(struct inode *in, char *block, int log_block_nr) {
   int phy_block_nr;
 
   assert(log_block_nr >= 0);
-  if (log_block_nr < NR_DIRECT_BLOCKS) {
-    phy_block_nr = in->in.i_block_nr[log_block_nr];
-    goto read_block;
-  }
-  log_block_nr -= NR_DIRECT_BLOCKS;
-  if (log_block_nr >= NR_INDIRECT_BLOCKS) return -EFBIG;
-  if (in->in.i_indirect == 0) return 0;
-  read_blocks(in->sb, block, in->in.i_indirect, 1);
-  phy_block_nr = ((int *)block)[log_block_nr];
-read_block:
+  // the indirect block is kept in memory (see testfs_inode_log_to_phy)
+  phy_block_nr = testfs_inode_log_to_phy(in, log_block_nr);
   if (phy_block_nr > 0) read_blocks(in->sb, block, phy_block_nr, 1);
   return phy_block_nr;
 }
 
 static int testfs_allocate_block(struct inode *in, char *block,
                                  int log_block_nr) {
-  char indirect[BLOCK_SIZE];
   int phy_block_nr;
+  int goal;
 
   assert(log_block_nr >= 0);
   // this reads log_block_nr inside block buffer, and returns
@@ -124,16 +383,19 @@ static int testfs_allocate_block(struct inode *in, char *block,
   phy_block_nr = testfs_get_block(in, block, log_block_nr);
   // successfully obtained a physical block.
   if (phy_block_nr != 0) return phy_block_nr;
-  // otherwise we will need to allocate a new physical block
+  // otherwise we will need to allocate a new physical block,
+  // preferably right after the previous block of the file.
+  goal = testfs_inode_alloc_goal(in, log_block_nr);
   if (log_block_nr < NR_DIRECT_BLOCKS) {
     // initializes block buffer with 0.
     // uses in->sb to allocate block in block freemap
-    phy_block_nr = testfs_alloc_block(in->sb, block);
+    phy_block_nr = testfs_alloc_block(in->sb, goal, block);
     // error in allocating block in freemap, return
     // -ENOSPC
     if (phy_block_nr < 0) return phy_block_nr;
     // make logical-physical block number mapping
     in->in.i_block_nr[log_block_nr] = phy_block_nr;
+    in->alloc_goal = phy_block_nr + 1;
     in->i_flags |= I_FLAGS_DIRTY;
     return phy_block_nr;
   }
@@ -141,23 +403,25 @@ static int testfs_allocate_block(struct inode *in, char *block,
   assert(log_block_nr < NR_INDIRECT_BLOCKS);
   // if there are no indirect blocks, assign a new inode
   // and point indirect block pointer to that newly created
-  // block.
+  // block. the data block then goes right after it.
   if (in->in.i_indirect == 0) {
-    // indirect is the temporary char block we take here
-    phy_block_nr = testfs_alloc_block(in->sb, indirect);
+    // the in-memory copy of the new indirect block starts out zeroed
+    phy_block_nr = testfs_alloc_block(in->sb, goal, (char *)in->indirect);
     if (phy_block_nr < 0) return phy_block_nr;
     in->in.i_indirect = phy_block_nr;
-    in->i_flags |= I_FLAGS_DIRTY;
+    in->i_flags |= I_FLAGS_DIRTY | I_FLAGS_INDIRECT_LOADED;
+    goal = phy_block_nr + 1;
   } else {
-    // if we already have an indirect block, then we read the
-    // indirect block into the indirect buffer.
-    read_blocks(in->sb, indirect, in->in.i_indirect, 1);
-  }
-  // allocate a new block and make logical to physical block mapping
-  phy_block_nr = testfs_alloc_block(in->sb, block);
-  if (phy_block_nr > 0) ((int *)indirect)[log_block_nr] = phy_block_nr;
-  // write the indirect buffer to disk
-  write_blocks(in->sb, indirect, in->in.i_indirect, 1);
+    testfs_ensure_indirect_loaded(in);
+  }
+  // allocate a new block and make logical to physical block mapping.
+  // the indirect block is written to disk by testfs_sync_inode().
+  phy_block_nr = testfs_alloc_block(in->sb, goal, block);
+  if (phy_block_nr > 0) {
+    in->indirect[log_block_nr] = phy_block_nr;
+    in->alloc_goal = phy_block_nr + 1;
+    in->i_flags |= I_FLAGS_DIRTY | I_FLAGS_INDIRECT_DIRTY;
+  }
   return phy_block_nr;
 }
 
@@ -172,15 +436,19 @@ static int testfs_allocate_block(struct inode *in, char *block,
  */
 
 struct inode *testfs_get_inode(struct super_block *sb, int inode_nr) {
-  char block[BLOCK_SIZE];
-  int block_offset;
   struct inode *in;
 
   in = inode_hash_find(sb, inode_nr);
   if (in) {
-    in->i_count++;
+    if (in->i_count++ == 0) {
+      // take it off the LRU list while it is in use
+      list_del(&in->lru);
+      inode_stats.nr_unused--;
+    }
+    inode_stats.hits++;
     return in;
   }
+  inode_stats.misses++;
   if ((in = calloc(1, sizeof(struct inode))) == NULL) {
     EXIT("calloc");
   }
@@ -188,30 +456,24 @@ struct inode *testfs_get_inode(struct super_block *sb, int inode_nr) {
   in->i_nr = inode_nr;
   in->sb = sb;
   in->i_count = 1;
-  // read from disk into block in-memory buffer.
-  // the in structure has sb sub-structure that has link to drive name.
-  // this drive name is used to read data.
-  // in next few instructions, we will read the
-  // dinode contents from block buffer later into in->in structure.
-  testfs_read_inode_block(in, block);
-  block_offset = testfs_inode_to_block_offset(in);
-  // copy inode disk contents from block+block_offset
-  // into sb->in structure
-  memcpy(&in->in, block + block_offset, sizeof(struct dinode));
+  in->ra.prev_block = -1;
+  in->ra.size = READAHEAD_MIN_WINDOW;
+  // copy the dinode contents from the resident inode table,
+  // which was read from disk at mount time, into in->in.
+  memcpy(&in->in, testfs_inode_table_entry(in), sizeof(struct dinode));
   // insert in into in memory hash map
   inode_hash_insert(in);
+  inode_stats.nr_cached++;
   return in;
 }
 
 void testfs_sync_inode(struct inode *in) {
-  char block[BLOCK_SIZE];
-  int block_offset;
-
   assert(in->i_flags & I_FLAGS_DIRTY);
-  testfs_read_inode_block(in, block);
-  block_offset = testfs_inode_to_block_offset(in);
-  memcpy(block + block_offset, &in->in, sizeof(struct dinode));
-  testfs_write_inode_block(in, block);
+  // the inode block is written when the transaction commits
+  testfs_inode_store(in);
+  if (in->sb->tx_in_progress == TX_NONE) {
+    testfs_flush_inode_blocks(in->sb);
+  }
 
   if (in->i_flags & I_FLAGS_INDIRECT_DIRTY) {
     write_blocks(in->sb, (char *) (in->indirect), in->in.i_indirect, 1);
@@ -221,11 +483,21 @@ void testfs_sync_inode(struct inode *in) {
   in->i_flags &= ~I_FLAGS_DIRTY;
 }
 
+static void readahead_wait(struct inode *in) {
+  if (in->ra.inflight) {
+    spin_wait(&in->ra.f);
+    in->ra.inflight = false;
+  }
+}
+
 void testfs_put_inode(struct inode *in) {
   assert((in->i_flags & I_FLAGS_DIRTY) == 0);
   if (--in->i_count == 0) {
-    inode_hash_remove(in);
-    free(in);
+    readahead_wait(in);
+    // keep the clean inode, and its indirect block, for the next user
+    list_add(&in->lru, &inode_lru);
+    inode_stats.nr_unused++;
+    inode_cache_shrink();
   }
 }
 
@@ -242,10 +514,10 @@ inline struct super_block *testfs_inode_get_sb(struct inode *in) {
 }
 
 /* returns negative value on error */
-int testfs_create_inode(struct super_block *sb, inode_type type,
-                        struct inode **inp) {
+int testfs_create_inode(struct super_block *sb, int parent_nr,
+                        inode_type type, struct inode **inp) {
   struct inode *in;
-  int inode_nr = testfs_get_inode_freemap(sb);
+  int inode_nr = testfs_get_inode_freemap(sb, parent_nr);
 
   if (inode_nr < 0) {
     return inode_nr;
@@ -263,12 +535,112 @@ void testfs_remove_inode(struct inode *in) {
   testfs_truncate_data(in, 0);
   /* zero the inode */
   bzero(&in->in, sizeof(struct dinode));
+  /* the inode stays cached, so forget what belonged to the old file */
+  in->i_flags &= ~(I_FLAGS_INDIRECT_LOADED | I_FLAGS_INDIRECT_DIRTY);
+  in->alloc_goal = 0;
+  in->ra.prev_block = -1;
+  in->ra.size = READAHEAD_MIN_WINDOW;
   in->i_flags |= I_FLAGS_DIRTY;
   testfs_put_inode_freemap(in->sb, in->i_nr);
   testfs_sync_inode(in);
   testfs_put_inode(in);
 }
 
+// Reads logical blocks [start, start + nr) of the file into the block cache,
+// with one request per run of physically consecutive blocks not cached yet
+static void readahead_issue(struct inode *in, int start, int nr) {
+  struct super_block *sb = in->sb;
+  int run_start = 0;
+  int run_nr = 0;
+
+  future_init(&in->ra.f);
+  for (int i = start; i <= start + nr; i++) {
+    int phy_block_nr = 0;
+    if (i < start + nr) {
+      phy_block_nr = testfs_inode_log_to_phy(in, i);
+      if (phy_block_nr > 0 && cache_contains(sb->fs->cache, phy_block_nr)) {
+        phy_block_nr = 0;
+      }
+    }
+    if (run_nr > 0 && phy_block_nr != run_start + run_nr) {
+      readahead_blocks_async(
+        sb, block_data_reactor(sb, run_start), &in->ra.f, run_start, run_nr);
+      nr_readahead_blocks += run_nr;
+      run_nr = 0;
+    }
+    if (phy_block_nr > 0) {
+      if (run_nr == 0) {
+        run_start = phy_block_nr;
+      }
+      run_nr++;
+    }
+  }
+  // Start the reads now instead of at the reader's next wait
+  flush_requests();
+  in->ra.inflight = true;
+  nr_readahead_windows++;
+}
+
+// Once a sequential reader enters the window read ahead last, the next, larger
+// window is issued, so the reader consumes one window while the next is in
+// flight.
+void testfs_readahead(struct inode *in, int first, int last) {
+  struct readahead *ra = &in->ra;
+  int nr_file_blocks = DIVROUNDUP(in->in.i_size, BLOCK_SIZE);
+
+  if (readahead_max_window == 0 ||
+      cache_get_mode(in->sb->fs->cache) == CACHE_MODE_OFF ||
+      (first == ra->prev_block && last == first)) {
+    return;
+  }
+
+  bool sequential = first == ra->prev_block || first == ra->prev_block + 1;
+  ra->prev_block = last;
+  if (!sequential) {
+    readahead_wait(in);
+    ra->start = ra->end = last + 1;
+    ra->size = READAHEAD_MIN_WINDOW;
+    return;
+  }
+  if (last < ra->start) {
+    return;
+  }
+
+  // The reader needs the current window now
+  readahead_wait(in);
+  int start = MAX(ra->end, last + 1);
+  int nr = MIN(ra->size, nr_file_blocks - start);
+  if (nr <= 0) {
+    return;
+  }
+  readahead_issue(in, start, nr);
+  ra->start = start;
+  ra->end = start + nr;
+  ra->size = MIN(ra->size * 2, readahead_max_window);
+}
+
+void testfs_set_readahead_window(int max_blocks) {
+  readahead_max_window = MAX(max_blocks, 0);
+}
+
+int testfs_get_readahead_window(void) {
+  return readahead_max_window;
+}
+
+void testfs_print_readahead_stats(struct super_block *sb) {
+  struct cache_stats stats;
+  cache_get_stats(sb->fs->cache, &stats);
+
+  printf("max window: %d blocks\n", readahead_max_window);
+  printf(
+    "windows: %llu  blocks: %llu  hits: %llu  waste: %llu\n",
+    (unsigned long long) nr_readahead_windows,
+    (unsigned long long) nr_readahead_blocks,
+    (unsigned long long) stats.readahead_hits,
+    (unsigned long long) stats.readahead_waste
+  );
+}
+
 /* read data from inode in, from start to start+size, into buf[size].
  * return 0 on success.
  * return negative value on error. */
@@ -286,6 +658,7 @@ int testfs_read_data(struct inode *in, int start, char *buf, const int size) {
     int block_nr = (start + buf_offset) / BLOCK_SIZE;
     int copy_size;
 
+    testfs_readahead(in, block_nr, block_nr);
     // reads inode block to block buffer. returns
     // physical block number
     block_nr = testfs_get_block(in, block, block_nr);
@@ -374,21 +747,21 @@ void testfs_truncate_data(struct inode *in, const int size) {
   e_block_nr -= NR_DIRECT_BLOCKS;
 
   if (e_block_nr > 0) { /* remove indirect blocks */
-    char block[BLOCK_SIZE];
     assert(in->in.i_indirect > 0);
-    read_blocks(in->sb, block, in->in.i_indirect, 1);
+    testfs_ensure_indirect_loaded(in);
     for (i = s_block_nr; i < e_block_nr && i < NR_INDIRECT_BLOCKS; i++) {
-      int block_nr = ((int *)block)[i];
+      int block_nr = in->indirect[i];
       assert(block_nr > 0);
       testfs_free_block(in->sb, block_nr);
-      ((int *)block)[i] = 0;
+      in->indirect[i] = 0;
     }
     if (s_block_nr == 0) {
       testfs_free_block(in->sb, in->in.i_indirect);
       in->in.i_indirect = 0;
+      in->i_flags &= ~(I_FLAGS_INDIRECT_LOADED | I_FLAGS_INDIRECT_DIRTY);
       in->i_flags |= I_FLAGS_DIRTY;
     } else {
-      write_blocks(in->sb, block, in->in.i_indirect, 1);
+      in->i_flags |= I_FLAGS_DIRTY | I_FLAGS_INDIRECT_DIRTY;
     }
   } else {
     assert(in->in.i_indirect == 0);
@@ -398,15 +771,20 @@ void testfs_truncate_data(struct inode *in, const int size) {
 }
 
 int testfs_check_inode(struct super_block *sb, struct bitmap *b_freemap,
-                       struct inode *in) {
+                       struct inode *in, int *nr_extents) {
   int size = 0;
+  int prev_block_nr = 0;
   int i;
   char block[BLOCK_SIZE];
 
+  *nr_extents = 0;
   for (i = 0; i < NR_DIRECT_BLOCKS; i++) {
     int block_nr = in->in.i_block_nr[i];
     if (block_nr == 0) return size;
     size += BLOCK_SIZE;
+    /* a block that does not follow the previous one starts an extent */
+    if (block_nr != prev_block_nr + 1) (*nr_extents)++;
+    prev_block_nr = block_nr;
 
     /* verify checksum */
     testfs_verify_csum(sb, block_nr);
@@ -419,12 +797,15 @@ int testfs_check_inode(struct super_block *sb, struct bitmap *b_freemap,
     return size;
   }
   bitmap_mark(b_freemap, in->in.i_indirect - sb->sb.data_blocks_start);
+  /* check the indirect block on disk, not the copy cached in the inode */
   read_blocks(in->sb, block, in->in.i_indirect, 1);
   for (i = 0; i < NR_INDIRECT_BLOCKS; i++) {
     int block_nr = ((int *)block)[i];
     if (block_nr == 0) return size;
     testfs_verify_csum(sb, block_nr);
     size += BLOCK_SIZE;
+    if (block_nr != prev_block_nr + 1) (*nr_extents)++;
+    prev_block_nr = block_nr;
     block_nr -= sb->sb.data_blocks_start;
     bitmap_mark(b_freemap, block_nr);
   }
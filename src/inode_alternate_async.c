@@ -19,22 +19,158 @@ static int testfs_file_write_block_async(
     return phy_block_nr;
   }
 
-  write_blocks_async(in->sb, DATA_REACTOR, f, buf, phy_block_nr, 1);
+  write_blocks_async(
+    in->sb,
+    block_data_reactor(in->sb, phy_block_nr),
+    f,
+    buf,
+    phy_block_nr,
+    1
+  );
   testfs_set_csum(
     in->sb, phy_block_nr, testfs_calculate_csum(buf, BLOCK_SIZE));
   return 0;
 }
 
+// Writes a run of nr physically consecutive blocks from buf with one request
+static void testfs_file_write_run_async(
+  struct inode *in,
+  struct future *f,
+  int phy_block_nr,
+  int nr,
+  char *buf
+) {
+  write_blocks_async(
+    in->sb,
+    block_data_reactor(in->sb, phy_block_nr),
+    f,
+    buf,
+    phy_block_nr,
+    nr
+  );
+  for (int i = 0; i < nr; i++) {
+    testfs_set_csum(
+      in->sb,
+      phy_block_nr + i,
+      testfs_calculate_csum(buf + i * BLOCK_SIZE, BLOCK_SIZE)
+    );
+  }
+}
+
 static void testfs_file_read_block_async(
     struct inode *in, struct future *f, int log_block_nr, char *buf) {
   int phy_block_nr = testfs_inode_log_to_phy(in, log_block_nr);
   if (phy_block_nr > 0) {
-    read_blocks_async(in->sb, DATA_REACTOR, f, buf, phy_block_nr, 1);
+    read_blocks_async(
+      in->sb,
+      block_data_reactor(in->sb, phy_block_nr),
+      f,
+      buf,
+      phy_block_nr,
+      1
+    );
   } else {
     memset(buf, 0, BLOCK_SIZE);
   }
 }
 
+// Partial blocks are read whole; the bytes the caller did not ask for land
+// here. Their contents are never looked at.
+static char discard[BLOCK_SIZE];
+
+// Reads a run of nr physically consecutive blocks starting at phy_block_nr
+// with one request. Bytes [skip, skip + len) of the run go to buf.
+static void testfs_file_read_run_async(
+  struct inode *in,
+  struct future *f,
+  int phy_block_nr,
+  int nr,
+  int skip,
+  char *buf,
+  int len
+) {
+  struct iovec iov[3];
+  int iovcnt = 0;
+  int rest = nr * BLOCK_SIZE - skip - len;
+  uint32_t reactor_id = block_data_reactor(in->sb, phy_block_nr);
+
+  assert(skip < BLOCK_SIZE && rest < BLOCK_SIZE);
+  if (skip == 0 && rest == 0) {
+    read_blocks_async(in->sb, reactor_id, f, buf, phy_block_nr, nr);
+    return;
+  }
+  if (skip > 0) {
+    iov[iovcnt++] = (struct iovec) {.iov_base = discard, .iov_len = skip};
+  }
+  iov[iovcnt++] = (struct iovec) {.iov_base = buf, .iov_len = len};
+  if (rest > 0) {
+    iov[iovcnt++] = (struct iovec) {.iov_base = discard, .iov_len = rest};
+  }
+  readv_blocks_async(in->sb, reactor_id, f, iov, iovcnt, phy_block_nr, nr);
+}
+
+int testfs_read_data_alternate_async(
+    struct inode *in, struct future *f, int start, char *buf, const int size) {
+  if (size <= 0) {
+    return 0;
+  }
+  assert(start >= 0 && start + size <= in->in.i_size);
+
+  int log_block_start = start / BLOCK_SIZE;
+  int log_block_end = (start + size - 1) / BLOCK_SIZE;
+  testfs_readahead(in, log_block_start, log_block_end);
+
+  // The run of physically consecutive blocks being built
+  int run_phy_block_nr = 0;
+  int run_nr = 0;
+  int run_skip = 0;
+  int run_buf_offset = 0;
+  int run_len = 0;
+
+  for (int log_block_nr = log_block_start; log_block_nr <= log_block_end;
+       log_block_nr++) {
+    // The part of this block the caller asked for
+    int block_start = MAX(start, log_block_nr * BLOCK_SIZE);
+    int block_end = MIN(start + size, (log_block_nr + 1) * BLOCK_SIZE);
+    int buf_offset = block_start - start;
+    int len = block_end - block_start;
+
+    // NOTE: The mapping comes from the in-memory indirect block, so only the
+    //       first indirect lookup may wait for the device
+    int phy_block_nr = testfs_inode_log_to_phy(in, log_block_nr);
+    if (phy_block_nr < 0) {
+      return phy_block_nr;
+    }
+
+    if (run_nr > 0 && phy_block_nr == run_phy_block_nr + run_nr) {
+      run_nr++;
+      run_len += len;
+      continue;
+    }
+    if (run_nr > 0) {
+      testfs_file_read_run_async(
+        in, f, run_phy_block_nr, run_nr, run_skip, buf + run_buf_offset,
+        run_len);
+      run_nr = 0;
+    }
+    if (phy_block_nr == 0) {
+      // A hole reads as zeros
+      memset(buf + buf_offset, 0, len);
+      continue;
+    }
+    run_phy_block_nr = phy_block_nr;
+    run_nr = 1;
+    run_skip = block_start - log_block_nr * BLOCK_SIZE;
+    run_buf_offset = buf_offset;
+    run_len = len;
+  }
+  if (run_nr > 0) {
+    testfs_file_read_run_async(
+      in, f, run_phy_block_nr, run_nr, run_skip, buf + run_buf_offset, run_len);
+  }
+  return 0;
+}
+
 int testfs_write_data_alternate_async(
     struct inode *in, struct future *f, int start, char *buf, const int size) {
   if (size <= 0) {
@@ -83,18 +219,29 @@ int testfs_write_data_alternate_async(
     }
   }
 
-  // 4. Initiate all the other writes
+  // 4. Initiate all the other writes, one per run of physically consecutive
+  //    blocks
   int buf_offset = first_block_offset;
-  for (int log_block_nr = log_contig_start;
-        log_block_nr <= log_contig_end; log_block_nr++) {
-    RETURN_IF_NEG(
-      testfs_file_write_block_async(in, f, log_block_nr, buf + buf_offset));
-    buf_offset += BLOCK_SIZE;
+  for (int log_block_nr = log_contig_start; log_block_nr <= log_contig_end;) {
+    int run_nr;
+    int phy_block_nr = testfs_map_run_alternate(
+      in, log_block_nr, log_contig_end - log_block_nr + 1, &run_nr);
+    if (phy_block_nr < 0) {
+      // NOTE: The head & tail reads go into this stack frame, so they must
+      //       finish before we return
+      if (has_head || has_tail) {
+        testfs_tx_wait(in->sb, &head_tail_f);
+      }
+      return phy_block_nr;
+    }
+    testfs_file_write_run_async(in, f, phy_block_nr, run_nr, buf + buf_offset);
+    log_block_nr += run_nr;
+    buf_offset += run_nr * BLOCK_SIZE;
   }
 
   // 5. Write the head & tail
   if (has_head || has_tail) {
-    spin_wait(&head_tail_f);
+    RETURN_IF_NEG(testfs_tx_wait(in->sb, &head_tail_f));
     if (has_head) {
       memcpy(head + first_block_offset, buf, BLOCK_SIZE - first_block_offset);
       RETURN_IF_NEG(
@@ -126,7 +273,7 @@ void testfs_bulk_sync_inode_async(
     }
     write_blocks_async(
       sb,
-      METADATA_REACTOR,
+      block_metadata_reactor(inodes[i]->in.i_indirect),
       f,
       (char *) (inodes[i]->indirect),
       inodes[i]->in.i_indirect,
@@ -135,36 +282,11 @@ void testfs_bulk_sync_inode_async(
     inodes[i]->i_flags &= ~(I_FLAGS_INDIRECT_DIRTY);
   }
 
-  // 2. Ensure that the inodes are clustered by physical block number
-  qsort(inodes, num_inodes, sizeof(struct inode *), inode_compare);
-
-  // 3. Write the inodes block by block
-  int cur_block_nr = -1;
-  char block[BLOCK_SIZE];
-  struct future read_f;
-  future_init(&read_f);
-
+  // 2. Copy the inodes into the inode table and write each dirty block of
+  //    the table once
   for (size_t i = 0; i < num_inodes; i++) {
-    int block_nr =
-      sb->sb.inode_blocks_start + testfs_inode_to_block_nr(inodes[i]);
-
-    // Flush the block we've been building so far if we reach a new block and
-    // then load the next inode block
-    if (block_nr != cur_block_nr) {
-      if (cur_block_nr != -1) {
-        write_blocks_async(sb, METADATA_REACTOR, f, block, cur_block_nr, 1);
-      }
-      read_blocks_async(sb, METADATA_REACTOR, &read_f, block, block_nr, 1);
-      spin_wait(&read_f);
-      cur_block_nr = block_nr;
-    }
-
-    // Copy the updated dinode into the block
-    int offset = testfs_inode_to_block_offset(inodes[i]);
-    memcpy(block + offset, &(inodes[i]->in), sizeof(struct dinode));
+    testfs_inode_store(inodes[i]);
     inodes[i]->i_flags &= ~(I_FLAGS_DIRTY);
   }
-
-  // Flush the last block
-  write_blocks_async(sb, METADATA_REACTOR, f, block, cur_block_nr, 1);
+  testfs_flush_inode_blocks_async(sb, f);
 }
@@ -10,8 +10,14 @@ void testfs_ensure_indirect_loaded(struct inode *in) {
   struct future f;
   future_init(&f);
   read_blocks_async(
-    in->sb, METADATA_REACTOR, &f, (char *) in->indirect, in->in.i_indirect, 1);
-  spin_wait(&f);
+    in->sb,
+    block_metadata_reactor(in->in.i_indirect),
+    &f,
+    (char *) in->indirect,
+    in->in.i_indirect,
+    1
+  );
+  testfs_tx_wait(in->sb, &f);
   in->i_flags |= I_FLAGS_INDIRECT_LOADED;
 }
 
@@ -41,13 +47,49 @@ int testfs_inode_log_to_phy(struct inode *in, int log_block_nr) {
   return in->indirect[indirect_log_block_nr];
 }
 
-int testfs_allocate_block_alternate(struct inode *in, int log_block_nr) {
-  int phy_block_nr = testfs_alloc_block_alternate(in->sb);
-  if (phy_block_nr < 0) {
-    return phy_block_nr;
+int testfs_inode_alloc_goal(struct inode *in, int log_block_nr) {
+  if (log_block_nr > 0) {
+    int prev_phy_block_nr = testfs_inode_log_to_phy(in, log_block_nr - 1);
+    if (prev_phy_block_nr > 0) {
+      return prev_phy_block_nr + 1;
+    }
+  }
+  return in->alloc_goal;
+}
+
+// Allocates an empty indirect block for the inode near goal
+static int testfs_inode_alloc_indirect(struct inode *in, int goal) {
+  int indirect_block_nr = testfs_alloc_block_alternate(in->sb, goal);
+  if (indirect_block_nr < 0) {
+    return indirect_block_nr;
+  }
+  memset(in->indirect, 0, sizeof(int) * NR_INDIRECT_BLOCKS);
+  in->in.i_indirect = indirect_block_nr;
+  in->i_flags |=
+    I_FLAGS_DIRTY | I_FLAGS_INDIRECT_LOADED | I_FLAGS_INDIRECT_DIRTY;
+  return indirect_block_nr;
+}
+
+// Returns the goal for data blocks starting at log_block_nr. If they will be
+// mapped through an indirect block that does not exist yet, the indirect
+// block is allocated at the goal first and the data follows it.
+static int testfs_inode_prepare_alloc(
+    struct inode *in, int log_block_nr, int nr) {
+  int goal = testfs_inode_alloc_goal(in, log_block_nr);
+  if (log_block_nr + nr > NR_DIRECT_BLOCKS && in->in.i_indirect == 0) {
+    int indirect_block_nr = testfs_inode_alloc_indirect(in, goal);
+    RETURN_IF_NEG(indirect_block_nr);
+    goal = indirect_block_nr + 1;
   }
+  return goal;
+}
 
+// Maps a logical block of the file to a newly allocated physical block,
+// allocating the indirect block first if needed
+static int testfs_inode_set_phy(
+    struct inode *in, int log_block_nr, int phy_block_nr) {
   in->i_flags |= I_FLAGS_DIRTY;
+  in->alloc_goal = phy_block_nr + 1;
 
   if (log_block_nr < NR_DIRECT_BLOCKS) {
     in->in.i_block_nr[log_block_nr] = phy_block_nr;
@@ -56,14 +98,10 @@ int testfs_allocate_block_alternate(struct inode *in, int log_block_nr) {
 
   if (in->in.i_indirect == 0) {
     // Allocate the indirect block if one doesn't exist
-    int indirect_block_nr = testfs_alloc_block_alternate(in->sb);
+    int indirect_block_nr = testfs_inode_alloc_indirect(in, phy_block_nr);
     if (indirect_block_nr < 0) {
       return indirect_block_nr;
     }
-    memset(in->indirect, 0, sizeof(int) * NR_INDIRECT_BLOCKS);
-    in->in.i_indirect = indirect_block_nr;
-    in->i_flags |= I_FLAGS_INDIRECT_LOADED;
-
   } else {
     testfs_ensure_indirect_loaded(in);
   }
@@ -74,7 +112,70 @@ int testfs_allocate_block_alternate(struct inode *in, int log_block_nr) {
   return phy_block_nr;
 }
 
-int inode_compare(const void *p1, const void *p2) {
-  return testfs_inode_to_block_nr(*((struct inode **)p1)) -
-    testfs_inode_to_block_nr(*((struct inode **)p2));
+int testfs_allocate_block_alternate(struct inode *in, int log_block_nr) {
+  int goal = testfs_inode_prepare_alloc(in, log_block_nr, 1);
+  RETURN_IF_NEG(goal);
+  int phy_block_nr = testfs_alloc_block_alternate(in->sb, goal);
+  if (phy_block_nr < 0) {
+    return phy_block_nr;
+  }
+  int ret = testfs_inode_set_phy(in, log_block_nr, phy_block_nr);
+  if (ret < 0) {
+    testfs_free_block(in->sb, phy_block_nr);
+  }
+  return ret;
+}
+
+int testfs_allocate_blocks_alternate(
+    struct inode *in, int log_block_nr, int nr, int *got) {
+  int goal = testfs_inode_prepare_alloc(in, log_block_nr, nr);
+  RETURN_IF_NEG(goal);
+  int phy_block_nr = testfs_alloc_blocks_alternate(in->sb, goal, nr, got);
+  if (phy_block_nr < 0) {
+    return phy_block_nr;
+  }
+  for (int i = 0; i < *got; i++) {
+    int ret = testfs_inode_set_phy(in, log_block_nr + i, phy_block_nr + i);
+    if (ret < 0) {
+      // The blocks mapped so far belong to the inode, free the rest
+      for (int j = i; j < *got; j++) {
+        testfs_free_block(in->sb, phy_block_nr + j);
+      }
+      return ret;
+    }
+  }
+  return phy_block_nr;
+}
+
+int testfs_map_run_alternate(
+    struct inode *in, int log_block_nr, int max_nr, int *run_nr) {
+  int first_phy_block_nr = 0;
+
+  assert(max_nr > 0);
+  for (*run_nr = 0; *run_nr < max_nr; (*run_nr)++) {
+    int phy_block_nr = testfs_inode_log_to_phy(in, log_block_nr + *run_nr);
+    if (phy_block_nr == 0) {
+      // Allocate one extent for this and the following unmapped blocks
+      int nr_unmapped = 1;
+      while (*run_nr + nr_unmapped < max_nr &&
+             testfs_inode_log_to_phy(
+               in, log_block_nr + *run_nr + nr_unmapped) == 0) {
+        nr_unmapped++;
+      }
+      int got;
+      phy_block_nr = testfs_allocate_blocks_alternate(
+        in, log_block_nr + *run_nr, nr_unmapped, &got);
+    }
+    if (phy_block_nr < 0) {
+      // Blocks mapped so far are still written by the caller
+      return *run_nr > 0 ? first_phy_block_nr : phy_block_nr;
+    }
+    if (*run_nr == 0) {
+      first_phy_block_nr = phy_block_nr;
+    } else if (phy_block_nr != first_phy_block_nr + *run_nr) {
+      // The block stays mapped and starts the next run
+      break;
+    }
+  }
+  return first_phy_block_nr;
 }
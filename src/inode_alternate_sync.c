@@ -25,6 +25,19 @@ static int testfs_file_write_block(
   return 0;
 }
 
+// Writes a run of nr physically consecutive blocks from buf with one request
+static void testfs_file_write_run(
+    struct inode *in, int phy_block_nr, int nr, char *buf) {
+  write_blocks(in->sb, buf, phy_block_nr, nr);
+  for (int i = 0; i < nr; i++) {
+    testfs_set_csum(
+      in->sb,
+      phy_block_nr + i,
+      testfs_calculate_csum(buf + i * BLOCK_SIZE, BLOCK_SIZE)
+    );
+  }
+}
+
 static void testfs_file_read_block(
     struct inode *in, int log_block_nr, char *buf) {
   int phy_block_nr = testfs_inode_log_to_phy(in, log_block_nr);
@@ -35,6 +48,17 @@ static void testfs_file_read_block(
   }
 }
 
+int testfs_read_data_alternate(
+    struct inode *in, int start, char *buf, const int size) {
+  struct future f;
+  future_init(&f);
+  int ret = testfs_read_data_alternate_async(in, &f, start, buf, size);
+  // NOTE: Reads into buf may have been started before an error, so they must
+  //       finish before we return
+  int status = testfs_tx_wait(in->sb, &f);
+  return ret < 0 ? ret : status;
+}
+
 int testfs_write_data_alternate(
     struct inode *in, int start, char *buf, const int size) {
   if (size <= 0) {
@@ -81,12 +105,17 @@ int testfs_write_data_alternate(
     }
   }
 
-  // 4. Initiate all the other writes
+  // 4. Initiate all the other writes, one per run of physically consecutive
+  //    blocks
   int buf_offset = first_block_offset;
-  for (int log_block_nr = log_contig_start;
-        log_block_nr <= log_contig_end; log_block_nr++) {
-    RETURN_IF_NEG(testfs_file_write_block(in, log_block_nr, buf + buf_offset));
-    buf_offset += BLOCK_SIZE;
+  for (int log_block_nr = log_contig_start; log_block_nr <= log_contig_end;) {
+    int run_nr;
+    int phy_block_nr = testfs_map_run_alternate(
+      in, log_block_nr, log_contig_end - log_block_nr + 1, &run_nr);
+    RETURN_IF_NEG(phy_block_nr);
+    testfs_file_write_run(in, phy_block_nr, run_nr, buf + buf_offset);
+    log_block_nr += run_nr;
+    buf_offset += run_nr * BLOCK_SIZE;
   }
 
   // 5. Write the head & tail
@@ -127,33 +156,11 @@ void testfs_bulk_sync_inode(struct inode *inodes[], size_t num_inodes) {
     inodes[i]->i_flags &= ~(I_FLAGS_INDIRECT_DIRTY);
   }
 
-  // 2. Ensure that the inodes are clustered by physical block number
-  qsort(inodes, num_inodes, sizeof(struct inode *), inode_compare);
-
-  // 3. Write the inodes block by block
-  int cur_block_nr = -1;
-  char block[BLOCK_SIZE];
-
+  // 2. Copy the inodes into the inode table and write each dirty block of
+  //    the table once
   for (size_t i = 0; i < num_inodes; i++) {
-    int block_nr =
-      sb->sb.inode_blocks_start + testfs_inode_to_block_nr(inodes[i]);
-
-    // Flush the block we've been building so far if we reach a new block and
-    // then load the next inode block
-    if (block_nr != cur_block_nr) {
-      if (cur_block_nr != -1) {
-        write_blocks(sb, block, cur_block_nr, 1);
-      }
-      read_blocks(sb, block, block_nr, 1);
-      cur_block_nr = block_nr;
-    }
-
-    // Copy the updated dinode into the block
-    int offset = testfs_inode_to_block_offset(inodes[i]);
-    memcpy(block + offset, &(inodes[i]->in), sizeof(struct dinode));
+    testfs_inode_store(inodes[i]);
     inodes[i]->i_flags &= ~(I_FLAGS_DIRTY);
   }
-
-  // Flush the last block
-  write_blocks(sb, block, cur_block_nr, 1);
+  testfs_flush_inode_blocks(sb);
 }
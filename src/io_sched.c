@@ -0,0 +1,377 @@
+#include "spdk/bdev.h"
+#include "spdk/env.h"
+#include "spdk/log.h"
+#include "spdk/stdinc.h"
+#include "spdk/thread.h"
+
+#include "io_sched.h"
+#include "block_request.h"
+#include "testfs.h"
+#include "logging.h"
+
+// Number of merged commands that can be in flight on one reactor. When all of
+// them are in use, queued requests are dispatched unmerged.
+#define IO_SCHED_NR_MERGES 128
+
+struct io_sched_merge;
+
+struct io_sched {
+  struct spdk_poller *poller;
+  struct spdk_bdev *bdev;
+  struct spdk_io_channel *io_channel;
+  // Optimal I/O boundary of the device in blocks (0 if there is none)
+  uint32_t boundary;
+
+  TAILQ_HEAD(rw_request_queue, rw_request) queue;
+  // The LBA the current sweep continues from, see next_in_sweep()
+  uint64_t cursor;
+  struct io_sched_merge *merges;
+  struct io_sched_merge *free_merges;
+
+  // Device commands submitted and not yet completed, and the limit on them
+  uint32_t inflight;
+  volatile uint32_t max_inflight;
+  // Set while waiting for the bdev layer to free up resources after a
+  // submission failed with -ENOMEM. Nothing is dispatched in the meantime.
+  bool waiting;
+  struct spdk_bdev_io_wait_entry wait_entry;
+
+  // Statistics, only updated by the owning reactor
+  struct io_sched_stats stats;
+};
+
+struct io_sched_merge {
+  struct io_sched *sched;
+  // The merged requests, linked through merged_next in LBA order
+  struct rw_request *head;
+  struct iovec iov[BLOCK_MAX_IOVS];
+  int iovcnt;
+  struct io_sched_merge *next_free;
+};
+
+static int request_iovcnt(struct rw_request *req) {
+  return req->buf != NULL ? 1 : req->iovcnt;
+}
+
+static void merge_append_iov(
+    struct io_sched_merge *merge, struct rw_request *req) {
+  if (req->buf != NULL) {
+    merge->iov[merge->iovcnt].iov_base = req->buf;
+    merge->iov[merge->iovcnt].iov_len = req->nr * BLOCK_SIZE;
+    merge->iovcnt++;
+    return;
+  }
+  for (int i = 0; i < req->iovcnt; i++) {
+    merge->iov[merge->iovcnt++] = req->iov[i];
+  }
+}
+
+static bool can_merge(
+  struct io_sched *sched,
+  struct rw_request *first,
+  size_t nr,
+  int iovcnt,
+  struct rw_request *next
+) {
+  if (next->is_write != first->is_write ||
+      next->start != first->start + nr ||
+      nr + next->nr > IO_SCHED_MAX_MERGE_BLOCKS ||
+      iovcnt + request_iovcnt(next) > BLOCK_MAX_IOVS) {
+    return false;
+  }
+  if (sched->boundary != 0 &&
+      first->start / sched->boundary !=
+        (first->start + nr + next->nr - 1) / sched->boundary) {
+    return false;
+  }
+  return true;
+}
+
+static void complete_chain(struct rw_request *req, bool success) {
+  while (req != NULL) {
+    // NOTE: Completing the request returns it to its pool
+    struct rw_request *next = req->merged_next;
+    block_request_complete(req, success);
+    req = next;
+  }
+}
+
+static void release_merge(
+    struct io_sched *sched, struct io_sched_merge *merge) {
+  merge->next_free = sched->free_merges;
+  sched->free_merges = merge;
+}
+
+static void single_complete(
+    struct spdk_bdev_io *bdev_io, bool success, void *cb_arg) {
+  struct rw_request *req = cb_arg;
+  spdk_bdev_free_io(bdev_io);
+  req->sched->inflight--;
+  block_request_complete(req, success);
+}
+
+static void merge_complete(
+    struct spdk_bdev_io *bdev_io, bool success, void *cb_arg) {
+  struct io_sched_merge *merge = cb_arg;
+  struct rw_request *head = merge->head;
+  spdk_bdev_free_io(bdev_io);
+
+  merge->sched->inflight--;
+  release_merge(merge->sched, merge);
+  complete_chain(head, success);
+}
+
+static int submit_single(struct io_sched *sched, struct rw_request *req) {
+  if (req->buf != NULL) {
+    return (req->is_write ? spdk_bdev_write_blocks : spdk_bdev_read_blocks)(
+      req->bdev_desc,
+      req->io_channel,
+      req->buf,
+      req->start,
+      req->nr,
+      single_complete,
+      req
+    );
+  }
+  return (req->is_write ? spdk_bdev_writev_blocks : spdk_bdev_readv_blocks)(
+    req->bdev_desc,
+    req->io_channel,
+    req->iov,
+    req->iovcnt,
+    req->start,
+    req->nr,
+    single_complete,
+    req
+  );
+}
+
+static int submit_merge(
+    struct io_sched *sched, struct rw_request *head, size_t nr) {
+  struct io_sched_merge *merge = sched->free_merges;
+  sched->free_merges = merge->next_free;
+
+  merge->head = head;
+  merge->iovcnt = 0;
+  for (struct rw_request *req = head; req != NULL; req = req->merged_next) {
+    merge_append_iov(merge, req);
+  }
+
+  int rc = (head->is_write ? spdk_bdev_writev_blocks : spdk_bdev_readv_blocks)(
+    head->bdev_desc,
+    head->io_channel,
+    merge->iov,
+    merge->iovcnt,
+    head->start,
+    nr,
+    merge_complete,
+    merge
+  );
+  if (rc != 0) {
+    release_merge(sched, merge);
+  }
+  return rc;
+}
+
+static void insert_sorted(struct io_sched *sched, struct rw_request *req) {
+  struct rw_request *pos;
+
+  // Keep the queue sorted by LBA. Requests for the same LBA stay in
+  // submission order.
+  TAILQ_FOREACH_REVERSE(pos, &(sched->queue), rw_request_queue, sched_link) {
+    if (pos->start <= req->start) {
+      break;
+    }
+  }
+  if (pos == NULL) {
+    TAILQ_INSERT_HEAD(&(sched->queue), req, sched_link);
+  } else {
+    TAILQ_INSERT_AFTER(&(sched->queue), pos, req, sched_link);
+  }
+}
+
+// Puts the requests of a command the device could not accept back into the
+// queue, ahead of any queued request for the same or a later LBA, preserving
+// their order
+static void requeue_chain(struct io_sched *sched, struct rw_request *head) {
+  struct rw_request *pos;
+
+  TAILQ_FOREACH(pos, &(sched->queue), sched_link) {
+    if (pos->start >= head->start) {
+      break;
+    }
+  }
+  for (struct rw_request *req = head; req != NULL; req = req->merged_next) {
+    if (pos == NULL) {
+      TAILQ_INSERT_TAIL(&(sched->queue), req, sched_link);
+    } else {
+      TAILQ_INSERT_BEFORE(pos, req, sched_link);
+    }
+  }
+}
+
+// Returns the queued request to dispatch next. Requests are dispatched in
+// ascending LBA sweeps (C-SCAN): the sweep continues from the end of the last
+// command and wraps around to the lowest LBA once no request is left ahead of
+// it. Requests that keep arriving behind the cursor thus cannot starve those
+// ahead of it, and each request is dispatched within one sweep.
+static struct rw_request *next_in_sweep(struct io_sched *sched) {
+  struct rw_request *req;
+
+  TAILQ_FOREACH(req, &(sched->queue), sched_link) {
+    if (req->start >= sched->cursor) {
+      return req;
+    }
+  }
+  return TAILQ_FIRST(&(sched->queue));
+}
+
+static int io_sched_poll(void *arg);
+
+static void io_sched_resume(void *arg) {
+  struct io_sched *sched = arg;
+  sched->waiting = false;
+  io_sched_poll(sched);
+}
+
+static void wait_for_resources(struct io_sched *sched) {
+  sched->wait_entry.bdev = sched->bdev;
+  sched->wait_entry.cb_fn = io_sched_resume;
+  sched->wait_entry.cb_arg = sched;
+  if (spdk_bdev_queue_io_wait(
+        sched->bdev, sched->io_channel, &(sched->wait_entry)) == 0) {
+    sched->waiting = true;
+  }
+  // NOTE: If the wait could not be queued, the poller simply retries on its
+  //       next iteration
+}
+
+// Submits one command made of the chain of requests starting at head. Returns
+// false if the device is out of resources and dispatching should stop.
+static bool dispatch(struct io_sched *sched, struct rw_request *head, size_t nr) {
+  int rc;
+
+  if (head->merged_next != NULL && sched->free_merges != NULL) {
+    rc = submit_merge(sched, head, nr);
+  } else if (head->merged_next != NULL) {
+    // No merge descriptor is available - put all but the first request back
+    requeue_chain(sched, head->merged_next);
+    head->merged_next = NULL;
+    rc = submit_single(sched, head);
+  } else {
+    rc = submit_single(sched, head);
+  }
+
+  if (rc == 0) {
+    sched->cursor = head->start + (head->merged_next != NULL ? nr : head->nr);
+    sched->inflight++;
+    sched->stats.nr_commands++;
+    if (sched->inflight > sched->stats.max_inflight_seen) {
+      sched->stats.max_inflight_seen = sched->inflight;
+    }
+    return true;
+  }
+  if (rc == -ENOMEM) {
+    sched->stats.nr_nomem++;
+    requeue_chain(sched, head);
+    wait_for_resources(sched);
+    return false;
+  }
+  SPDK_ERRLOG("Block I/O submission failed: %d\n", rc);
+  complete_chain(head, false);
+  return true;
+}
+
+static int io_sched_poll(void *arg) {
+  struct io_sched *sched = arg;
+  int dispatched = 0;
+
+  while (!TAILQ_EMPTY(&(sched->queue)) && !sched->waiting &&
+         sched->inflight < sched->max_inflight) {
+    struct rw_request *first = next_in_sweep(sched);
+    struct rw_request *tail = first;
+    struct rw_request *next = TAILQ_NEXT(first, sched_link);
+    size_t nr = first->nr;
+    int iovcnt = request_iovcnt(first);
+
+    TAILQ_REMOVE(&(sched->queue), first, sched_link);
+    first->merged_next = NULL;
+
+    // Collect the run of queued requests that continue where this one ends
+    while (next != NULL && can_merge(sched, first, nr, iovcnt, next)) {
+      struct rw_request *after = TAILQ_NEXT(next, sched_link);
+      TAILQ_REMOVE(&(sched->queue), next, sched_link);
+      next->merged_next = NULL;
+      tail->merged_next = next;
+      tail = next;
+      nr += next->nr;
+      iovcnt += request_iovcnt(next);
+      next = after;
+    }
+
+    if (!dispatch(sched, first, nr)) {
+      break;
+    }
+    dispatched++;
+  }
+  return dispatched;
+}
+
+struct io_sched *io_sched_create(
+    struct spdk_bdev *bdev, struct spdk_io_channel *io_channel) {
+  struct io_sched *sched = calloc(1, sizeof(struct io_sched));
+  if (sched == NULL) {
+    return NULL;
+  }
+  sched->bdev = bdev;
+  sched->io_channel = io_channel;
+  sched->boundary = spdk_bdev_get_optimal_io_boundary(bdev);
+  sched->max_inflight = IO_SCHED_DEFAULT_MAX_INFLIGHT;
+  TAILQ_INIT(&(sched->queue));
+
+  sched->merges = calloc(IO_SCHED_NR_MERGES, sizeof(struct io_sched_merge));
+  if (sched->merges == NULL) {
+    free(sched);
+    return NULL;
+  }
+  sched->free_merges = NULL;
+  for (size_t i = 0; i < IO_SCHED_NR_MERGES; i++) {
+    sched->merges[i].sched = sched;
+    sched->merges[i].next_free = sched->free_merges;
+    sched->free_merges = &(sched->merges[i]);
+  }
+
+  // NOTE: A period of 0 runs the poller on every iteration of the reactor, so
+  //       requests delivered by the events processed in one iteration are
+  //       merged with each other before they reach the device
+  sched->poller = spdk_poller_register(io_sched_poll, sched, 0);
+  if (sched->poller == NULL) {
+    free(sched->merges);
+    free(sched);
+    return NULL;
+  }
+  return sched;
+}
+
+void io_sched_destroy(struct io_sched *sched) {
+  assert(TAILQ_EMPTY(&(sched->queue)));
+  spdk_poller_unregister(&(sched->poller));
+  free(sched->merges);
+  free(sched);
+}
+
+void io_sched_enqueue(struct io_sched *sched, struct rw_request *req) {
+  insert_sorted(sched, req);
+  sched->stats.nr_requests++;
+}
+
+void io_sched_set_max_inflight(struct io_sched *sched, uint32_t max_inflight) {
+  sched->max_inflight = max_inflight > 0 ? max_inflight : 1;
+}
+
+uint32_t io_sched_get_max_inflight(struct io_sched *sched) {
+  return sched->max_inflight;
+}
+
+void io_sched_get_stats(struct io_sched *sched, struct io_sched_stats *stats) {
+  *stats = sched->stats;
+}
@@ -37,8 +37,9 @@ int test_write(struct super_block *sb, struct context *c, char *filename, char *
 #define M 100
 
 void perf_main(struct filesystem *fs) {
-  struct context *c = malloc(sizeof(struct context));
-  struct super_block *sb = malloc(sizeof(struct super_block));
+  struct context *c = calloc(1, sizeof(struct context));
+  // cmd_mkfs() releases what the old superblock holds, of which there is none
+  struct super_block *sb = calloc(1, sizeof(struct super_block));
   c->fs = fs;
   fs->sb = sb;
   sb->fs = fs;
@@ -69,6 +70,10 @@ void perf_main(struct filesystem *fs) {
 
 
 int main(int argc, char *const argv[]) {
-  dev_init("", perf_main);
+  struct dev_opts opts;
+  dev_opts_init(&opts);
+  if (dev_init(&opts, perf_main) < 0) {
+    return 1;
+  }
   return 0;
 }
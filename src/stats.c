@@ -0,0 +1,365 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "testfs.h"
+#include "super.h"
+#include "block.h"
+#include "dcache.h"
+#include "dir.h"
+#include "inode.h"
+
+// Parses an argument that must be a decimal number as a whole. Returns -EINVAL
+// if it is not.
+static int parse_long(const char *arg, long *value) {
+  char *end;
+  *value = strtol(arg, &end, 10);
+  return end == arg || *end != '\0' ? -EINVAL : 0;
+}
+
+/**
+ * Prints runtime statistics of the file system and the I/O layer.
+ *
+ * Arguments:
+ * cmd[1]: "reset" (optional) - Clears the wait counters instead
+ */
+int cmd_stats(struct super_block *sb, struct context *c) {
+  if (c->nargs == 2 && strcmp(c->cmd[1], "reset") == 0) {
+    reset_wait_stats();
+    return 0;
+  }
+  if (c->nargs != 1) {
+    return -EINVAL;
+  }
+
+  struct filesystem *fs = sb->fs;
+
+  printf("===== I/O pools =====\n");
+  block_print_stats(fs);
+  printf("===== Waits =====\n");
+  print_wait_stats();
+  printf("===== Block cache =====\n");
+  block_print_cache_stats(fs);
+  printf("===== Read-ahead =====\n");
+  testfs_print_readahead_stats(sb);
+  printf("===== Inode cache =====\n");
+  testfs_print_inode_cache_stats(sb);
+  printf("===== Dentry cache =====\n");
+  dcache_print_stats();
+  return 0;
+}
+
+/**
+ * Shows the dentry cache statistics, turns the cache on or off, or clears the
+ * statistics.
+ *
+ * Arguments:
+ * cmd[1]: "on", "off" or "reset" (optional)
+ */
+int cmd_dentry_cache(struct super_block *sb, struct context *c) {
+  if (c->nargs == 2) {
+    if (strcmp(c->cmd[1], "reset") == 0) {
+      dcache_reset_stats();
+      return 0;
+    } else if (strcmp(c->cmd[1], "on") == 0) {
+      dcache_set_enabled(true);
+    } else if (strcmp(c->cmd[1], "off") == 0) {
+      dcache_set_enabled(false);
+    } else {
+      return -EINVAL;
+    }
+  } else if (c->nargs != 1) {
+    return -EINVAL;
+  }
+
+  dcache_print_stats();
+  return 0;
+}
+
+/**
+ * Shows the inode cache statistics, sets its memory budget or clears the
+ * statistics.
+ *
+ * Arguments:
+ * cmd[1]: Budget in KiB, 0 to free inodes once unreferenced, or "reset"
+ *         (optional)
+ */
+int cmd_inode_cache(struct super_block *sb, struct context *c) {
+  if (c->nargs == 2) {
+    if (strcmp(c->cmd[1], "reset") == 0) {
+      testfs_reset_inode_cache_stats();
+      return 0;
+    }
+    char *end;
+    long budget_kb = strtol(c->cmd[1], &end, 10);
+    if (*end != '\0' || budget_kb < 0) {
+      return -EINVAL;
+    }
+    testfs_set_inode_cache_budget(budget_kb * 1024);
+  } else if (c->nargs != 1) {
+    return -EINVAL;
+  }
+
+  testfs_print_inode_cache_stats(sb);
+  return 0;
+}
+
+/**
+ * Shows the read-ahead statistics or sets the largest read-ahead window.
+ *
+ * Arguments:
+ * cmd[1]: Largest window in blocks, 0 to disable read-ahead (optional)
+ */
+int cmd_readahead(struct super_block *sb, struct context *c) {
+  if (c->nargs == 2) {
+    char *end;
+    long max_blocks = strtol(c->cmd[1], &end, 10);
+    if (*end != '\0' || max_blocks < 0) {
+      return -EINVAL;
+    }
+    testfs_set_readahead_window(max_blocks);
+  } else if (c->nargs != 1) {
+    return -EINVAL;
+  }
+
+  testfs_print_readahead_stats(sb);
+  return 0;
+}
+
+/**
+ * Shows the block cache statistics, selects the cache mode or clears the
+ * statistics.
+ *
+ * Arguments:
+ * cmd[1]: "off", "wt", "wb" or "reset" (optional)
+ */
+int cmd_cache(struct super_block *sb, struct context *c) {
+  struct filesystem *fs = sb->fs;
+
+  if (c->nargs == 2) {
+    if (strcmp(c->cmd[1], "reset") == 0) {
+      cache_reset_stats(fs->cache);
+      return 0;
+    }
+    enum cache_mode mode;
+    if (cache_parse_mode(c->cmd[1], &mode) < 0) {
+      return -EINVAL;
+    }
+    return block_cache_set_mode(sb, mode);
+  } else if (c->nargs != 1) {
+    return -EINVAL;
+  }
+
+  block_print_cache_stats(fs);
+  return 0;
+}
+
+/**
+ * Writes all dirty blocks held by the block cache to the device.
+ */
+int cmd_sync(struct super_block *sb, struct context *c) {
+  if (c->nargs != 1) {
+    return -EINVAL;
+  }
+  return block_cache_sync(sb);
+}
+
+/**
+ * Shows or sets when dirty blocks of the write-back cache are written back.
+ *
+ * Arguments:
+ * cmd[1]: Dirty percent of the cache that starts the background flusher, or
+ *         "commit" followed by "on" or "off" to sync on every commit (optional)
+ * cmd[2]: Dirty percent of the cache above which writers are throttled
+ * cmd[3]: Interval of the background flusher in ms, 0 to disable the timer
+ */
+int cmd_dirty_limits(struct super_block *sb, struct context *c) {
+  struct dirty_limits limits;
+  block_get_dirty_limits(&limits);
+
+  if (c->nargs == 3 && strcmp(c->cmd[1], "commit") == 0) {
+    if (strcmp(c->cmd[2], "on") == 0) {
+      limits.sync_on_commit = true;
+    } else if (strcmp(c->cmd[2], "off") == 0) {
+      limits.sync_on_commit = false;
+    } else {
+      return -EINVAL;
+    }
+    block_set_dirty_limits(&limits);
+  } else if (c->nargs == 4) {
+    long background, limit, interval_ms;
+    if (parse_long(c->cmd[1], &background) < 0 ||
+        parse_long(c->cmd[2], &limit) < 0 ||
+        parse_long(c->cmd[3], &interval_ms) < 0) {
+      return -EINVAL;
+    }
+    // The flusher must start before writers are throttled
+    if (background <= 0 || background >= limit || limit > 100 ||
+        interval_ms < 0) {
+      return -EINVAL;
+    }
+    limits.background_percent = background;
+    limits.limit_percent = limit;
+    limits.interval_ms = interval_ms;
+    block_set_dirty_limits(&limits);
+  } else if (c->nargs != 1) {
+    return -EINVAL;
+  }
+
+  block_get_dirty_limits(&limits);
+  printf(
+    "background: %u%%  limit: %u%%  interval: %u ms  sync on commit: %s\n",
+    limits.background_percent,
+    limits.limit_percent,
+    limits.interval_ms,
+    limits.sync_on_commit ? "on" : "off"
+  );
+  return 0;
+}
+
+/**
+ * Shows or sets the I/O queue depth limits.
+ *
+ * Arguments:
+ * cmd[1]: Device commands in flight per reactor (optional)
+ * cmd[2]: Requests outstanding per reactor before submitters wait (optional)
+ */
+int cmd_io_limits(struct super_block *sb, struct context *c) {
+  struct filesystem *fs = sb->fs;
+
+  if (c->nargs == 3) {
+    long max_inflight, max_outstanding;
+    if (parse_long(c->cmd[1], &max_inflight) < 0 ||
+        parse_long(c->cmd[2], &max_outstanding) < 0 ||
+        max_inflight <= 0 || max_outstanding <= 0) {
+      return -EINVAL;
+    }
+    for (size_t i = 0; i < NUM_REACTORS; i++) {
+      io_sched_set_max_inflight(fs->reactors[i].sched, max_inflight);
+    }
+    block_set_max_outstanding(max_outstanding);
+  } else if (c->nargs != 1) {
+    return -EINVAL;
+  }
+
+  printf(
+    "max in flight: %u  max outstanding: %zu\n",
+    io_sched_get_max_inflight(fs->reactors[DATA_REACTOR].sched),
+    block_get_max_outstanding()
+  );
+  return 0;
+}
+
+/**
+ * Shows or selects the reactor that synchronous block I/O is routed to.
+ *
+ * Arguments:
+ * cmd[1]: "data", "metadata" or "least" (optional)
+ */
+int cmd_sync_route(struct super_block *sb, struct context *c) {
+  if (c->nargs == 2) {
+    enum sync_route route;
+    if (block_parse_sync_route(c->cmd[1], &route) < 0) {
+      return -EINVAL;
+    }
+    block_set_sync_route(route);
+  } else if (c->nargs != 1) {
+    return -EINVAL;
+  }
+
+  printf("sync route: %s\n", block_sync_route_name(block_get_sync_route()));
+  return 0;
+}
+
+/**
+ * Shows or selects how file data I/O is spread across the data reactors.
+ *
+ * Arguments:
+ * cmd[1]: "rr", "hash" or "least" (optional)
+ */
+int cmd_data_dispatch(struct super_block *sb, struct context *c) {
+  if (c->nargs == 2) {
+    enum data_dispatch dispatch;
+    if (block_parse_data_dispatch(c->cmd[1], &dispatch) < 0) {
+      return -EINVAL;
+    }
+    block_set_data_dispatch(dispatch);
+  } else if (c->nargs != 1) {
+    return -EINVAL;
+  }
+
+  printf(
+    "data dispatch: %s over %u data reactors\n",
+    block_data_dispatch_name(block_get_data_dispatch()),
+    block_get_active_data_reactors()
+  );
+  return 0;
+}
+
+/**
+ * Shows or selects where new blocks and inodes are placed.
+ *
+ * Arguments:
+ * cmd[1]: "first", "next" or "goal" (optional)
+ */
+int cmd_alloc_policy(struct super_block *sb, struct context *c) {
+  if (c->nargs == 2) {
+    enum alloc_policy policy;
+    if (testfs_parse_alloc_policy(c->cmd[1], &policy) < 0) {
+      return -EINVAL;
+    }
+    testfs_set_alloc_policy(policy);
+  } else if (c->nargs != 1) {
+    return -EINVAL;
+  }
+
+  printf(
+    "allocation policy: %s\n",
+    testfs_alloc_policy_name(testfs_get_alloc_policy())
+  );
+  return 0;
+}
+
+/**
+ * Shows or selects whether directories that outgrow one block are converted
+ * to the hashed directory index.
+ *
+ * Arguments:
+ * cmd[1]: "on" or "off" (optional)
+ */
+int cmd_dir_index(struct super_block *sb, struct context *c) {
+  if (c->nargs == 2) {
+    if (strcmp(c->cmd[1], "on") == 0) {
+      testfs_set_dir_index(true);
+    } else if (strcmp(c->cmd[1], "off") == 0) {
+      testfs_set_dir_index(false);
+    } else {
+      return -EINVAL;
+    }
+  } else if (c->nargs != 1) {
+    return -EINVAL;
+  }
+
+  printf("directory index: %s\n", testfs_get_dir_index() ? "on" : "off");
+  return 0;
+}
+
+/**
+ * Selects how the REPL waits for outstanding I/O.
+ *
+ * Arguments:
+ * cmd[1]: "spin" or "backoff"
+ */
+int cmd_wait_mode(struct super_block *sb, struct context *c) {
+  if (c->nargs != 2) {
+    return -EINVAL;
+  }
+
+  if (strcmp(c->cmd[1], "spin") == 0) {
+    set_wait_mode(WAIT_MODE_SPIN);
+  } else if (strcmp(c->cmd[1], "backoff") == 0) {
+    set_wait_mode(WAIT_MODE_BACKOFF);
+  } else {
+    return -EINVAL;
+  }
+  return 0;
+}
@@ -2,6 +2,7 @@
 #include "bitmap.h"
 #include "block.h"
 #include "csum.h"
+#include "dcache.h"
 #include "dir.h"
 #include "inode.h"
 #include "testfs.h"
@@ -20,7 +21,8 @@ void testfs_make_super_block(struct filesystem *fs) {
   sb->sb.data_blocks_start = sb->sb.inode_blocks_start + NR_INODE_BLOCKS;
   sb->sb.modification_time = 0;
   testfs_write_super_block(sb);
-  inode_hash_init();
+  inode_hash_init(sb);
+  dcache_init(sb);
 }
 
 void testfs_make_inode_freemap(struct super_block *sb) {
@@ -49,7 +51,8 @@ void testfs_make_inode_blocks(struct super_block *sb) {
  sb block.
  */
 int testfs_init_super_block(struct filesystem *fs, int corrupt) {
-  struct super_block *sb = malloc(sizeof(struct super_block));
+  // NOTE: Zeroed so that the transaction state is valid for the first read
+  struct super_block *sb = calloc(1, sizeof(struct super_block));
   char block[BLOCK_SIZE];
   int ret;
 
@@ -80,24 +83,35 @@ int testfs_init_super_block(struct filesystem *fs, int corrupt) {
   // data from sb->dev is used to populate arg 2  sb->inode_freemap
   read_blocks(sb, bitmap_getdata(sb->inode_freemap), sb->sb.inode_freemap_start,
               INODE_FREEMAP_SIZE);
+  bitmap_rebuild(sb->inode_freemap);
 
   ret = bitmap_create(BLOCK_SIZE * BLOCK_FREEMAP_SIZE * BITS_PER_WORD,
                       &sb->block_freemap);
   if (ret < 0) return ret;
   read_blocks(sb, bitmap_getdata(sb->block_freemap), sb->sb.block_freemap_start,
               BLOCK_FREEMAP_SIZE);
+  bitmap_rebuild(sb->block_freemap);
   sb->csum_table = malloc(CSUM_TABLE_SIZE * BLOCK_SIZE);
   if (!sb->csum_table) return -ENOMEM;
   memset(sb->csum_block_dirty, 0, sizeof(bool) * CSUM_TABLE_SIZE);
   read_blocks(sb, (char *)sb->csum_table, sb->sb.csum_table_start,
               CSUM_TABLE_SIZE);
+  sb->inode_table = malloc(NR_INODE_BLOCKS * BLOCK_SIZE);
+  if (!sb->inode_table) return -ENOMEM;
+  memset(sb->inode_block_dirty, 0, sizeof(bool) * NR_INODE_BLOCKS);
+  read_blocks(sb, sb->inode_table, sb->sb.inode_blocks_start,
+              NR_INODE_BLOCKS);
   sb->tx_in_progress = TX_NONE;
+  sb->tx_status = 0;
+  sb->alloc_cursor = 0;
+  memset(sb->inode_freemap_dirty, 0, sizeof(bool) * INODE_FREEMAP_SIZE);
+  memset(sb->block_freemap_dirty, 0, sizeof(bool) * BLOCK_FREEMAP_SIZE);
   /*
-   inode_hash_init() initializes inode_hash_table of size 256 bytes
-   each entry of the inode table contains a first pointer. each
-   node of the first pointer has a prev pointer and a next pointer.
+   inode_hash_init() initializes the table of in-memory inodes of sb.
+   it starts with 256 buckets and grows as more inodes are cached.
    */
-  inode_hash_init();
+  inode_hash_init(sb);
+  dcache_init(sb);
 
   return 0;
 }
@@ -114,87 +128,264 @@ void testfs_write_super_block(struct super_block *sb) {
   write_blocks(sb, block, 0, 1);
 }
 
-void testfs_flush_super_block(struct super_block *sb) {
+int testfs_flush_super_block(struct super_block *sb) {
+  int ret;
+
   testfs_tx_start(sb, TX_UMOUNT);
   // write sb->sb of type dsuper_block to disk at offset 0.
   testfs_write_super_block(sb);
-  // assume there are no entries in the inode hash table.
-  // delete the 256 hash size inode hash table
-  inode_hash_destroy();
+  // assume no inode is referenced anymore. drop the cached inodes
+  // and delete the inode hash table and the dentry cache
+  inode_hash_destroy(sb);
+  dcache_destroy(sb);
+  // write the changed inode table and freemap blocks to disk.
+  testfs_flush_inode_blocks(sb);
+  free(sb->inode_table);
+  sb->inode_table = NULL;
+  testfs_flush_freemaps(sb);
   if (sb->inode_freemap) {
-    // write inode map to disk.
-    write_blocks(sb, bitmap_getdata(sb->inode_freemap),
-                 sb->sb.inode_freemap_start, INODE_FREEMAP_SIZE);
     // free in memory bitmap file.
     bitmap_destroy(sb->inode_freemap);
     sb->inode_freemap = NULL;
   }
   if (sb->block_freemap) {
-    // write inode freemap to disk
-    write_blocks(sb, bitmap_getdata(sb->block_freemap),
-                 sb->sb.block_freemap_start, BLOCK_FREEMAP_SIZE);
-    // destroy inode freemap
+    // destroy block freemap
     bitmap_destroy(sb->block_freemap);
     sb->block_freemap = NULL;
   }
-  testfs_tx_commit(sb, TX_UMOUNT);
+  // write back any blocks the block cache is still holding.
+  ret = block_cache_sync(sb);
+  if (ret < 0 && sb->tx_status == 0) {
+    sb->tx_status = ret;
+  }
+  return testfs_tx_commit(sb, TX_UMOUNT);
+}
+
+// Frees the superblock and everything it still holds in memory, without
+// writing anything back
+static void testfs_free_super_block(struct super_block *sb) {
+  if (sb->inode_hash) {
+    inode_hash_destroy(sb);
+  }
+  if (sb->dcache) {
+    dcache_destroy(sb);
+  }
+  free(sb->inode_table);
+  if (sb->inode_freemap) {
+    bitmap_destroy(sb->inode_freemap);
+  }
+  if (sb->block_freemap) {
+    bitmap_destroy(sb->block_freemap);
+  }
+  free(sb->csum_table);
+  free(sb);
 }
 
 void testfs_close_super_block(struct super_block *sb) {
   testfs_flush_super_block(sb);
-  free(sb);
+  testfs_free_super_block(sb);
 }
 
-static void testfs_write_inode_freemap(struct super_block *sb, int inode_nr) {
-  char *freemap;
-  int nr;
+// Freemap blocks are written at commit time (see testfs_flush_freemaps)
+static void testfs_dirty_inode_freemap(struct super_block *sb, int inode_nr) {
+  int nr = inode_nr / (BLOCK_SIZE * BITS_PER_WORD);
 
-  assert(sb->inode_freemap);
-  freemap = bitmap_getdata(sb->inode_freemap);
-  nr = inode_nr / (BLOCK_SIZE * BITS_PER_WORD);
-  write_blocks(sb, freemap + (nr * BLOCK_SIZE), sb->sb.inode_freemap_start + nr,
-               1);
+  assert(nr < INODE_FREEMAP_SIZE);
+  __atomic_store_n(&sb->inode_freemap_dirty[nr], true, __ATOMIC_RELAXED);
 }
 
-static void testfs_write_block_freemap(struct super_block *sb, int block_nr) {
-  char *freemap;
+static void testfs_dirty_block_freemap(
+    struct super_block *sb, int block_nr, int count) {
+  int first = block_nr / (BLOCK_SIZE * BITS_PER_WORD);
+  int last = (block_nr + count - 1) / (BLOCK_SIZE * BITS_PER_WORD);
+
+  assert(last < BLOCK_FREEMAP_SIZE);
+  for (int nr = first; nr <= last; nr++) {
+    __atomic_store_n(&sb->block_freemap_dirty[nr], true, __ATOMIC_RELAXED);
+  }
+}
+
+// A run of dirty blocks written asynchronously by testfs_write_dirty_blocks()
+struct dirty_run {
+  struct future f;
+  struct future *caller;
+  bool *dirty;
   int nr;
+};
+
+// Marks the run dirty again if its write failed, so that the next flush
+// retries it, and passes the status on to the caller's future
+//
+// NOTE: This runs on the completing reactor while the main reactor may read
+//       and write the same flags, so all accesses to the dirty flags of the
+//       resident metadata are atomic
+static void dirty_run_done(struct future *f, void *arg) {
+  struct dirty_run *run = arg;
+
+  if (f->status < 0) {
+    for (int i = 0; i < run->nr; i++) {
+      __atomic_store_n(&run->dirty[i], true, __ATOMIC_RELAXED);
+    }
+  }
+  future_complete(run->caller, f->status);
+  free(run);
+}
 
-  assert(sb->block_freemap);
-  freemap = bitmap_getdata(sb->block_freemap);
-  nr = block_nr / (BLOCK_SIZE * BITS_PER_WORD);
-  write_blocks(
-    sb, freemap + (nr * BLOCK_SIZE), sb->sb.block_freemap_start + nr, 1);
+// Writes the dirty blocks of a resident metadata region, one request per run
+// of consecutive dirty blocks. Writes synchronously if f is NULL. A block stays
+// dirty unless its write succeeds; errors reach sb->tx_status through the
+// transaction's wait.
+//
+// NOTE: An asynchronous run is marked clean when it is submitted and dirty
+//       again if it fails. Clearing it on completion instead would lose a
+//       change made to the block while the write was in flight.
+static bool is_dirty(bool dirty[], int nr) {
+  return __atomic_load_n(&dirty[nr], __ATOMIC_RELAXED);
 }
 
-/* return free block number or negative value */
-static int testfs_get_block_freemap(struct super_block *sb) {
+static void mark_clean(bool dirty[], int from, int to) {
+  for (int nr = from; nr < to; nr++) {
+    __atomic_store_n(&dirty[nr], false, __ATOMIC_RELAXED);
+  }
+}
+
+static void testfs_write_dirty_blocks(
+  struct super_block *sb,
+  struct future *f,
+  char *data,
+  bool dirty[],
+  int nr_blocks,
+  int start
+) {
+  int nr = 0;
+
+  while (nr < nr_blocks) {
+    if (!is_dirty(dirty, nr)) {
+      nr++;
+      continue;
+    }
+    int run_start = nr;
+    while (nr < nr_blocks && is_dirty(dirty, nr)) {
+      nr++;
+    }
+    if (f) {
+      struct dirty_run *run = malloc(sizeof(struct dirty_run));
+      if (!run) {
+        EXIT("malloc");
+      }
+      future_init(&run->f);
+      run->caller = f;
+      run->dirty = dirty + run_start;
+      run->nr = nr - run_start;
+      mark_clean(dirty, run_start, nr);
+      future_expect(f);
+      write_blocks_async(
+        sb,
+        block_metadata_reactor(start + run_start),
+        &run->f,
+        data + run_start * BLOCK_SIZE,
+        start + run_start,
+        nr - run_start
+      );
+      future_then(&run->f, FUTURE_ANY_LCORE, dirty_run_done, run);
+    } else {
+      int ret = write_blocks(
+        sb, data + run_start * BLOCK_SIZE, start + run_start,
+        nr - run_start);
+      if (ret == 0) {
+        mark_clean(dirty, run_start, nr);
+      }
+    }
+  }
+}
+
+static enum alloc_policy alloc_policy = ALLOC_GOAL;
+
+static const char *alloc_policy_names[NUM_ALLOC_POLICIES] = {
+  "first",
+  "next",
+  "goal",
+};
+
+void testfs_set_alloc_policy(enum alloc_policy policy) {
+  assert(policy < NUM_ALLOC_POLICIES);
+  alloc_policy = policy;
+}
+
+enum alloc_policy testfs_get_alloc_policy(void) { return alloc_policy; }
+
+int testfs_parse_alloc_policy(const char *name, enum alloc_policy *policy) {
+  for (size_t i = 0; i < NUM_ALLOC_POLICIES; i++) {
+    if (strcmp(name, alloc_policy_names[i]) == 0) {
+      *policy = i;
+      return 0;
+    }
+  }
+  return -EINVAL;
+}
+
+const char *testfs_alloc_policy_name(enum alloc_policy policy) {
+  return alloc_policy_names[policy];
+}
+
+// Returns the index in the block freemap where the search for a free block
+// starts, given the physical block number the caller would like
+static u_int32_t testfs_block_search_start(struct super_block *sb, int goal) {
+  if (alloc_policy == ALLOC_FIRST_FIT) {
+    return 0;
+  }
+  if (alloc_policy == ALLOC_GOAL && goal >= sb->sb.data_blocks_start) {
+    return goal - sb->sb.data_blocks_start;
+  }
+  return sb->alloc_cursor;
+}
+
+// Allocates up to want consecutive blocks in the in-memory block freemap
+// according to the allocation policy. Returns the freemap index of the first
+// block or a negative value.
+static int testfs_alloc_freemap_range(
+    struct super_block *sb, int goal, int want, int *got) {
   u_int32_t index;
+  u_int32_t nr;
   int ret;
 
   assert(sb->block_freemap);
-  ret = bitmap_alloc(sb->block_freemap, &index);
+  ret = bitmap_alloc_range(sb->block_freemap,
+                           testfs_block_search_start(sb, goal), want, &index,
+                           &nr);
   if (ret < 0) return ret;
-  testfs_write_block_freemap(sb, index);
+  sb->alloc_cursor = index + nr;
+  testfs_dirty_block_freemap(sb, index, nr);
+  *got = nr;
   return index;
 }
 
+/* return free block number or negative value */
+static int testfs_get_block_freemap(struct super_block *sb, int goal) {
+  int nr;
+  return testfs_alloc_freemap_range(sb, goal, 1, &nr);
+}
+
 /* release allocated block */
 static void testfs_put_block_freemap(struct super_block *sb, int block_nr) {
   assert(sb->block_freemap);
   bitmap_unmark(sb->block_freemap, block_nr);
-  testfs_write_block_freemap(sb, block_nr);
+  testfs_dirty_block_freemap(sb, block_nr, 1);
 }
 
 /* return free inode number or negative value */
-int testfs_get_inode_freemap(struct super_block *sb) {
+int testfs_get_inode_freemap(struct super_block *sb, int goal_nr) {
   u_int32_t index;
   int ret;
 
   assert(sb->inode_freemap);
-  ret = bitmap_alloc(sb->inode_freemap, &index);
+  if (alloc_policy == ALLOC_GOAL && goal_nr >= 0) {
+    ret = bitmap_alloc_near(sb->inode_freemap, goal_nr, &index);
+  } else {
+    ret = bitmap_alloc(sb->inode_freemap, &index);
+  }
   if (ret < 0) return ret;
-  testfs_write_inode_freemap(sb, index);
+  testfs_dirty_inode_freemap(sb, index);
   return index;
 }
 
@@ -202,15 +393,15 @@ int testfs_get_inode_freemap(struct super_block *sb) {
 void testfs_put_inode_freemap(struct super_block *sb, int inode_nr) {
   assert(sb->inode_freemap);
   bitmap_unmark(sb->inode_freemap, inode_nr);
-  testfs_write_inode_freemap(sb, inode_nr);
+  testfs_dirty_inode_freemap(sb, inode_nr);
 }
 
 /* allocate a block and return its block number.
  * returns negative value on error. */
-int testfs_alloc_block(struct super_block *sb, char *block) {
+int testfs_alloc_block(struct super_block *sb, int goal, char *block) {
   int phy_block_nr;
 
-  phy_block_nr = testfs_get_block_freemap(sb);
+  phy_block_nr = testfs_get_block_freemap(sb, goal);
   // if error occurred, return -ENOSPC
   if (phy_block_nr < 0) return phy_block_nr;
   bzero(block, BLOCK_SIZE);
@@ -227,11 +418,23 @@ int testfs_free_block(struct super_block *sb, int block_nr) {
   return 0;
 }
 
+/* how fragmented the files are, collected by testfs_checkfs */
+struct frag_report {
+  int nr_files;
+  int nr_blocks;
+  int nr_extents;
+  /* files with more than one extent */
+  int nr_fragmented;
+  int max_extents;
+};
+
 static int testfs_checkfs(struct super_block *sb, struct bitmap *i_freemap,
-                          struct bitmap *b_freemap, int inode_nr) {
+                          struct bitmap *b_freemap, struct frag_report *frag,
+                          int inode_nr) {
   struct inode *in = testfs_get_inode(sb, inode_nr);
   int size;
   int size_roundup = ROUNDUP(testfs_inode_get_size(in), BLOCK_SIZE);
+  int nr_extents;
 
   assert((testfs_inode_get_type(in) == I_FILE) ||
          (testfs_inode_get_type(in) == I_DIR));
@@ -245,19 +448,59 @@ static int testfs_checkfs(struct super_block *sb, struct bitmap *i_freemap,
       if ((d->d_inode_nr < 0) || (strcmp(D_NAME(d), ".") == 0) ||
           (strcmp(D_NAME(d), "..") == 0))
         continue;
-      testfs_checkfs(sb, i_freemap, b_freemap, d->d_inode_nr);
+      testfs_checkfs(sb, i_freemap, b_freemap, frag, d->d_inode_nr);
     }
   }
   /* block processing */
-  size = testfs_check_inode(sb, b_freemap, in);
+  size = testfs_check_inode(sb, b_freemap, in, &nr_extents);
   assert(size == size_roundup);
+  if (size > 0) {
+    frag->nr_files++;
+    frag->nr_blocks += size / BLOCK_SIZE;
+    frag->nr_extents += nr_extents;
+    if (nr_extents > 1) frag->nr_fragmented++;
+    frag->max_extents = MAX(frag->max_extents, nr_extents);
+  }
   testfs_put_inode(in);
   return 0;
 }
 
+static void testfs_print_frag_report(struct super_block *sb,
+                                     struct frag_report *frag) {
+  u_int32_t largest_free;
+  u_int32_t nr_free_extents =
+    bitmap_free_extents(sb->block_freemap, NR_DATA_BLOCKS, &largest_free);
+  int nr_inode_blocks = 0;
+  int i, j;
+
+  /* inode table blocks holding at least one inode */
+  for (i = 0; i < NR_INODE_BLOCKS; i++) {
+    for (j = 0; j < INODES_PER_BLOCK; j++) {
+      if (bitmap_isset(sb->inode_freemap, i * INODES_PER_BLOCK + j)) {
+        nr_inode_blocks++;
+        break;
+      }
+    }
+  }
+
+  printf("allocation policy = %s\n",
+         testfs_alloc_policy_name(testfs_get_alloc_policy()));
+  printf("nr of inodes with blocks = %d, blocks = %d, extents = %d\n",
+         frag->nr_files, frag->nr_blocks, frag->nr_extents);
+  if (frag->nr_files > 0) {
+    printf("extents per inode = %.2f (max %d), fragmented inodes = %d\n",
+           (double)frag->nr_extents / frag->nr_files, frag->max_extents,
+           frag->nr_fragmented);
+  }
+  printf("free extents = %u, largest free extent = %u blocks\n",
+         nr_free_extents, largest_free);
+  printf("inode table blocks in use = %d\n", nr_inode_blocks);
+}
+
 int cmd_checkfs(struct super_block *sb, struct context *c) {
   struct bitmap *i_freemap;
   struct bitmap *b_freemap;
+  struct frag_report frag = {0};
   int ret;
 
   if (c->nargs != 1) {
@@ -268,8 +511,11 @@ int cmd_checkfs(struct super_block *sb, struct context *c) {
   if (ret < 0) return ret;
   ret = bitmap_create(BLOCK_SIZE * BLOCK_FREEMAP_SIZE * BITS_PER_WORD,
                       &b_freemap);
-  if (ret < 0) return ret;
-  testfs_checkfs(sb, i_freemap, b_freemap, 0);
+  if (ret < 0) {
+    bitmap_destroy(i_freemap);
+    return ret;
+  }
+  testfs_checkfs(sb, i_freemap, b_freemap, &frag, 0);
 
   if (!bitmap_equal(sb->inode_freemap, i_freemap)) {
     printf("inode freemap is not consistent\n");
@@ -281,6 +527,9 @@ int cmd_checkfs(struct super_block *sb, struct context *c) {
          bitmap_nr_allocated(sb->inode_freemap));
   printf("nr of allocated blocks = %d\n",
          bitmap_nr_allocated(sb->block_freemap));
+  testfs_print_frag_report(sb, &frag);
+  bitmap_destroy(i_freemap);
+  bitmap_destroy(b_freemap);
   return 0;
 }
 
@@ -291,7 +540,8 @@ int cmd_mkfs(struct super_block *sb, struct context *c) {
     c->cur_dir = NULL;
   }
   struct filesystem *fs = c->fs;
-  free(sb);
+  // drop everything held in memory for the old file system
+  testfs_free_super_block(sb);
   testfs_make_super_block(fs);
   struct super_block *sb_tmp = fs->sb;
   testfs_make_inode_freemap(sb_tmp);
@@ -299,7 +549,7 @@ int cmd_mkfs(struct super_block *sb, struct context *c) {
   testfs_make_csum_table(sb_tmp);
   testfs_make_inode_blocks(sb_tmp);
   testfs_flush_super_block(sb_tmp);
-  free(sb_tmp);
+  testfs_free_super_block(sb_tmp);
   ret = testfs_init_super_block(fs, 0);
   if (ret) {
 	EXIT("testfs_init_super_block");;
@@ -308,7 +558,7 @@ int cmd_mkfs(struct super_block *sb, struct context *c) {
   if (ret) {
 	EXIT("testfs_make_root_dir");
   }
-  testfs_flush_super_block(fs->sb);
+  testfs_close_super_block(fs->sb);
   ret = testfs_init_super_block(fs, 0);
   if (ret) {
 	EXIT("testfs_init_super_block");;
@@ -317,35 +567,80 @@ int cmd_mkfs(struct super_block *sb, struct context *c) {
   return 0;
 }
 
-int testfs_alloc_block_alternate(struct super_block *sb) {
-  u_int32_t index;
-  int ret = bitmap_alloc(sb->block_freemap, &index);
-  if (ret < 0) {
-    return ret;
+int testfs_alloc_block_alternate(struct super_block *sb, int goal) {
+  int nr;
+  return testfs_alloc_blocks_alternate(sb, goal, 1, &nr);
+}
+
+int testfs_alloc_blocks_alternate(
+    struct super_block *sb, int goal, int want, int *got) {
+  int index = testfs_alloc_freemap_range(sb, goal, want, got);
+  if (index < 0) {
+    return index;
   }
   return sb->sb.data_blocks_start + index;
 }
 
 void testfs_flush_block_freemap_async(
     struct super_block *sb, struct future *f) {
-  // NOTE: We choose to just flush the whole freemap since it is only 2 blocks.
-  //       If the freemap were really large, we could do something more clever
-  //       by tracking the changed bits so that we only flush the dirty blocks.
-  write_blocks_async(
+  testfs_write_dirty_blocks(
     sb,
-    METADATA_REACTOR,
     f,
     bitmap_getdata(sb->block_freemap),
-    sb->sb.block_freemap_start,
-    BLOCK_FREEMAP_SIZE
+    sb->block_freemap_dirty,
+    BLOCK_FREEMAP_SIZE,
+    sb->sb.block_freemap_start
   );
 }
 
 void testfs_flush_block_freemap(struct super_block *sb) {
-  write_blocks(
+  testfs_write_dirty_blocks(
     sb,
+    NULL,
     bitmap_getdata(sb->block_freemap),
-    sb->sb.block_freemap_start,
-    BLOCK_FREEMAP_SIZE
+    sb->block_freemap_dirty,
+    BLOCK_FREEMAP_SIZE,
+    sb->sb.block_freemap_start
+  );
+}
+
+void testfs_flush_freemaps(struct super_block *sb) {
+  if (sb->inode_freemap) {
+    testfs_write_dirty_blocks(
+      sb,
+      NULL,
+      bitmap_getdata(sb->inode_freemap),
+      sb->inode_freemap_dirty,
+      INODE_FREEMAP_SIZE,
+      sb->sb.inode_freemap_start
+    );
+  }
+  if (sb->block_freemap) {
+    testfs_flush_block_freemap(sb);
+  }
+}
+
+void testfs_flush_inode_blocks_async(
+    struct super_block *sb, struct future *f) {
+  testfs_write_dirty_blocks(
+    sb,
+    f,
+    sb->inode_table,
+    sb->inode_block_dirty,
+    NR_INODE_BLOCKS,
+    sb->sb.inode_blocks_start
   );
 }
+
+void testfs_flush_inode_blocks(struct super_block *sb) {
+  if (sb->inode_table) {
+    testfs_write_dirty_blocks(
+      sb,
+      NULL,
+      sb->inode_table,
+      sb->inode_block_dirty,
+      NR_INODE_BLOCKS,
+      sb->sb.inode_blocks_start
+    );
+  }
+}
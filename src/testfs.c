@@ -114,6 +114,71 @@ static struct {
         cmd_benchmark,
         MAX_ARGS,
     },
+    {
+        "stats",
+        cmd_stats,
+        1,
+    },
+    {
+        "iolimits",
+        cmd_io_limits,
+        2,
+    },
+    {
+        "syncroute",
+        cmd_sync_route,
+        1,
+    },
+    {
+        "dispatch",
+        cmd_data_dispatch,
+        1,
+    },
+    {
+        "cache",
+        cmd_cache,
+        1,
+    },
+    {
+        "sync",
+        cmd_sync,
+        1,
+    },
+    {
+        "dirty",
+        cmd_dirty_limits,
+        3,
+    },
+    {
+        "readahead",
+        cmd_readahead,
+        1,
+    },
+    {
+        "icache",
+        cmd_inode_cache,
+        1,
+    },
+    {
+        "dcache",
+        cmd_dentry_cache,
+        1,
+    },
+    {
+        "alloc",
+        cmd_alloc_policy,
+        1,
+    },
+    {
+        "dirindex",
+        cmd_dir_index,
+        1,
+    },
+    {
+        "waitmode",
+        cmd_wait_mode,
+        1,
+    },
     {
         "run-experiments",
         cmd_experiment,
@@ -129,7 +194,9 @@ static struct {
 // These commands are the only commands that can be executed
 // if a file system does not exist (i.e. the user has not run mkfs)
 static const char *non_fs_commands[] =
-  {"?", "quit", "mkfs", "bench", "run-experiments", NULL};
+  {"?", "quit", "mkfs", "bench", "run-experiments", "stats",
+   "waitmode", "iolimits", "syncroute", "dispatch", "cache", "sync", "dirty",
+   "readahead", "alloc", "icache", "dcache", "dirindex", NULL};
 
 static bool fs_exists(struct context *c) {
   return testfs_inode_get_type(c->cur_dir) == I_DIR;
@@ -213,15 +280,30 @@ static void handle_command(struct super_block *sb, struct context *c,
 }
 
 static void usage(const char *progname) {
-  fprintf(stdout, "Usage: %s [-ch][--help] rawfile\n", progname);
+  fprintf(
+    stdout,
+    "Usage: %s [-ch][--help][-f config][-m reactor_mask]\n"
+    "       [--metadata-reactors N][--data-reactors N] rawfile\n",
+    progname
+  );
   exit(1);
 }
 
 struct args {
   const char *disk;  // name of disk
   int corrupt;       // to corrupt or not
+  struct dev_opts dev_opts;
 };
 
+static uint32_t parse_reactor_count(const char *progname, const char *arg) {
+  char *end;
+  long count = strtol(arg, &end, 10);
+  if (*end != '\0' || count < 1 || count >= MAX_REACTORS) {
+    usage(progname);
+  }
+  return count;
+}
+
 static struct args *parse_arguments(int argc, char *const argv[]) {
   static struct args args = {0};
   // struct options -
@@ -233,17 +315,23 @@ static struct args *parse_arguments(int argc, char *const argv[]) {
   static struct option long_options[] = {
       {"corrupt", no_argument, 0, 'c'},
       {"help", no_argument, 0, 'h'},
+      {"config", required_argument, 0, 'f'},
+      {"reactor-mask", required_argument, 0, 'm'},
+      {"metadata-reactors", required_argument, 0, 'M'},
+      {"data-reactors", required_argument, 0, 'D'},
       {0, 0, 0, 0},
   };
   int running = 1;
 
+  dev_opts_init(&args.dev_opts);
+
   while (running) {
     int option_index = 0;
     // getopt_long - decode options from argv.
     // getopt_long (int argc, char *const *argv, const char *shortopts, const
     // struct option *longopts, int *indexptr)
     //
-    int c = getopt_long(argc, argv, "ch", long_options, &option_index);
+    int c = getopt_long(argc, argv, "chf:m:", long_options, &option_index);
     switch (c) {
       case -1:
         running = 0;
@@ -256,6 +344,19 @@ static struct args *parse_arguments(int argc, char *const argv[]) {
       case 'h':
         usage(argv[0]);
         break;
+      case 'f':
+        args.dev_opts.config_file = optarg;
+        break;
+      case 'm':
+        args.dev_opts.reactor_mask = optarg;
+        break;
+      case 'M':
+        args.dev_opts.num_metadata_reactors =
+          parse_reactor_count(argv[0], optarg);
+        break;
+      case 'D':
+        args.dev_opts.num_data_reactors = parse_reactor_count(argv[0], optarg);
+        break;
       case '?':
         usage(argv[0]);
         break;
@@ -330,6 +431,8 @@ int main(int argc, char *const argv[]) {
   // inode of directory from which cmd was issued, and no of args.
 
   struct args *args = parse_arguments(argc, argv);
-  dev_init(args->disk, testfs_main);
+  if (dev_init(&(args->dev_opts), testfs_main) < 0) {
+    return 1;
+  }
   return 0;
 }
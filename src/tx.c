@@ -1,5 +1,7 @@
 #include "tx.h"
 #include <assert.h>
+#include "async.h"
+#include "block.h"
 #include "super.h"
 
 char *tx_type_array[] = {"TX_NONE", "TX_WRITE", "TX_CREATE", "TX_RM",
@@ -8,9 +10,34 @@ char *tx_type_array[] = {"TX_NONE", "TX_WRITE", "TX_CREATE", "TX_RM",
 void testfs_tx_start(struct super_block *sb, tx_type type) {
   assert(sb->tx_in_progress == TX_NONE);
   sb->tx_in_progress = type;
+  sb->tx_status = 0;
 }
 
-void testfs_tx_commit(struct super_block *sb, tx_type type) {
+int testfs_tx_commit(struct super_block *sb, tx_type type) {
+  struct dirty_limits limits;
+
   assert(sb->tx_in_progress == type);
+  // Write the inode table and freemap blocks the transaction changed
+  testfs_flush_inode_blocks(sb);
+  testfs_flush_freemaps(sb);
+  // Post any asynchronous writes of this transaction still waiting in a batch
+  flush_requests();
+  block_get_dirty_limits(&limits);
+  if (limits.sync_on_commit) {
+    int ret = block_cache_sync(sb);
+    if (ret < 0 && sb->tx_status == 0) {
+      sb->tx_status = ret;
+    }
+  }
   sb->tx_in_progress = TX_NONE;
+  return sb->tx_status;
+}
+
+int testfs_tx_wait_at(
+    struct super_block *sb, struct future *f, const char *site) {
+  int status = spin_wait_at(f, site);
+  if (status < 0 && sb->tx_status == 0) {
+    sb->tx_status = status;
+  }
+  return status;
 }